@@ -27,16 +27,111 @@
 
 #include <alsa/asoundlib.h>
 #include <errno.h>
+#include <glib.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
 
 #include "audio.h"
+#include "dsp.h"
+#include "pcm-export.h"
+#include "spectrum.h"
+#include "trace.h"
 
+/* Gather this many periods before writing, and wake up when they fit */
+#define ALSA_BATCH_PERIODS	2
+#define ALSA_MAX_ZONES		4
+#define ALSA_ZONE_CHUNKS	64
+/* A zone this far behind the others skips audio to catch up */
+#define ALSA_ZONE_MAX_MS	200
+/* Chunk starts the clock zone keeps, to tell what its device is playing */
+#define ALSA_MARKS		256
 
-static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
+/*
+ * Processed audio on its way to the device. Chunks from libspotify are
+ * small, so rather than a wait and a write for each of them they are
+ * gathered here and written a few whole periods at a time, as much as
+ * the device has room for.
+ */
+/* Where a chunk starts in what a zone staged, and where in its track */
+typedef struct alsa_mark {
+	int64_t at;
+	unsigned int track;
+	int64_t frame;
+} alsa_mark_t;
+
+typedef struct alsa_out {
+	snd_pcm_t *h;
+	int rate;
+	int channels;
+	int period;
+	int buffer;		/* device buffer, frames */
+	int16_t *buf;
+	int size;		/* capacity in frames */
+	int fill;		/* frames gathered */
+	int clock;		/* counts towards the written audio in the stats */
+	/* The clock zone also tracks its chunks to publish audio_clock_t */
+	int64_t staged;		/* frames ever gathered, since the last reset */
+	int64_t written;	/* of those, written or dropped */
+	alsa_mark_t marks[ALSA_MARKS];
+	int mark_head;
+	int mark_count;
+} alsa_out_t;
+
+/*
+ * An output device. Every zone gets the same processed chunks, shared
+ * and reference counted, through its own short queue, and a writer
+ * thread of its own applies the zone gain and delay and writes them.
+ */
+typedef struct alsa_zone {
+	char dev[64];
+	int gain;		/* Q12 */
+	int delay_ms;		/* lines this zone up with the others */
+	int pad;		/* delay still to be inserted */
+	int disabled;		/* the device can't be opened */
+	int reopen;		/* audio_set_output() wants the device reopened */
+	int switching;		/* handing over to the reopened device */
+	int stalled;		/* fell behind, no longer sets the pace */
+	alsa_out_t out;
+	unsigned int epoch;
+	audio_fifo_data_t *q[ALSA_ZONE_CHUNKS];
+	int head;
+	int count;
+	int qframes;
+	long latency;		/* gathered plus device buffered frames */
+	pthread_cond_t cond;
+	audio_fifo_t *af;
+} alsa_zone_t;
+
+static alsa_zone_t zones[ALSA_MAX_ZONES];
+static int nzones;
+/* Guards the zone queues */
+static pthread_mutex_t zones_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zones_room = PTHREAD_COND_INITIALIZER;
+/* Period asked of the devices, frames */
+static int alsa_period = AUDIO_PERIOD;
+
+/* The output change audio_set_output() asked for, under zones_mutex */
+static struct {
+	char dev[64];		/* for the first zone, empty to keep it */
+	int period;		/* asked for, 0 to keep it */
+	int pending;		/* zones still to reopen */
+	int failed;
+	int unreported;		/* see audio_output_switched() */
+} alsa_switch;
+
+/*
+ * Open and set up dev, asking for a period of *period frames and a
+ * buffer of four. With SND_PCM_NONBLOCK in mode, a device that is held
+ * fails to open instead of waiting for it, with errno EBUSY; writes
+ * block either way. Returns NULL on failure, else the handle, with the
+ * period and buffer the device settled on.
+ */
+static snd_pcm_t *alsa_open(const char *dev, int mode, int rate,
+                            int channels, int *period, int *buffer)
 {
 	snd_pcm_hw_params_t *hwp;
 	snd_pcm_sw_params_t *swp;
@@ -50,8 +145,15 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	snd_pcm_uframes_t period_size;
 	snd_pcm_uframes_t buffer_size;
 
-	if ((r = snd_pcm_open(&h, dev, SND_PCM_STREAM_PLAYBACK, 0) < 0))
+	r = snd_pcm_open(&h, dev, SND_PCM_STREAM_PLAYBACK, mode);
+	if (r < 0) {
+		errno = -r;
 		return NULL;
+	}
+	if ((mode & SND_PCM_NONBLOCK) && snd_pcm_nonblock(h, 0) < 0) {
+		snd_pcm_close(h);
+		return NULL;
+	}
 
 	hwp = alloca(snd_pcm_hw_params_sizeof());
 	memset(hwp, 0, snd_pcm_hw_params_sizeof());
@@ -69,7 +171,7 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	dir = 0;
 	snd_pcm_hw_params_get_period_size_max(hwp, &period_size_max, &dir);
 
-	period_size = 1024;
+	period_size = *period;
 
 	dir = 0;
 	r = snd_pcm_hw_params_set_period_size_near(h, hwp, &period_size, &dir);
@@ -134,7 +236,8 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 	memset(hwp, 0, snd_pcm_sw_params_sizeof());
 	snd_pcm_sw_params_current(h, swp);
 
-	r = snd_pcm_sw_params_set_avail_min(h, swp, period_size);
+	r = snd_pcm_sw_params_set_avail_min(h, swp,
+	                                    period_size * ALSA_BATCH_PERIODS);
 
 	if (r < 0) {
 		fprintf(stderr, "audio: Unable to configure wakeup threshold (%s)\n",
@@ -169,60 +272,807 @@ static snd_pcm_t *alsa_open(char *dev, int rate, int channels)
 		return NULL;
 	}
 
+	*period = period_size;
+	*buffer = buffer_size;
 	return h;
 }
 
-static void* alsa_audio_start(void *aux)
+/*
+ * Returns 1 if afd was queued before the latest seek. The first chunk of
+ * a new epoch is where the seek latency is measured; the zones drop what
+ * their devices still hold when they get to it.
+ */
+static int alsa_check_epoch(audio_fifo_t *af, audio_fifo_data_t *afd,
+                            unsigned int *cur_epoch)
 {
-	audio_fifo_t *af = aux;
-	snd_pcm_t *h = NULL;
-	int c;
-	int cur_channels = 0;
-	int cur_rate = 0;
+	struct timespec now;
+	unsigned int us;
+
+	pthread_mutex_lock(&af->mutex);
+
+	if (afd->epoch != af->epoch) {
+		af->stats.stale_chunks++;
+		pthread_mutex_unlock(&af->mutex);
+		return 1;
+	}
+
+	if (afd->epoch != *cur_epoch) {
+		*cur_epoch = afd->epoch;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		us = (now.tv_sec - af->seek_time.tv_sec) * 1000000 +
+		     (now.tv_nsec - af->seek_time.tv_nsec) / 1000;
+		af->stats.seek_latency_us = us;
+		if (us > af->stats.seek_latency_max_us)
+			af->stats.seek_latency_max_us = us;
+	}
+
+	pthread_mutex_unlock(&af->mutex);
+	return 0;
+}
+
+/*
+ * Run afd through the filter chain, picking up a new chain first if one
+ * was set.
+ */
+static void alsa_dsp(audio_fifo_t *af, dsp_chain_t **chain,
+                     audio_fifo_data_t *afd)
+{
+	uint64_t ns[DSP_STAGES] = { 0 };
+	int i;
+
+	pthread_mutex_lock(&af->mutex);
+	if (af->dsp_pending) {
+		if (*chain)
+			dsp_chain_free(*chain);
+		*chain = af->dsp_next;
+		af->dsp_next = NULL;
+		af->dsp_pending = 0;
+	}
+	pthread_mutex_unlock(&af->mutex);
+
+	if (!*chain)
+		return;
+
+	dsp_chain_process(*chain, afd->samples, afd->nsamples, afd->rate,
+	                  afd->channels, ns);
+
+	pthread_mutex_lock(&af->mutex);
+	for (i = 0; i < DSP_STAGES; i++)
+		af->stats.dsp_ns[i] += ns[i];
+	af->stats.dsp_audio_us += (uint64_t)afd->nsamples * 1000000 / afd->rate;
+	pthread_mutex_unlock(&af->mutex);
+}
+
+static void alsa_unref(audio_fifo_data_t *afd)
+{
+	if (!__atomic_sub_fetch(&afd->refs, 1, __ATOMIC_ACQ_REL))
+		free(afd);
+}
+
+static int alsa_reserve(alsa_out_t *out, int frames)
+{
+	int16_t *buf;
+	int size;
+
+	if (out->fill + frames <= out->size)
+		return 0;
+
+	size = out->fill + frames;
+	if (size < out->period * ALSA_BATCH_PERIODS * 2)
+		size = out->period * ALSA_BATCH_PERIODS * 2;
+	buf = realloc(out->buf, size * out->channels * sizeof(int16_t));
+	if (!buf)
+		return -1;
+	out->buf = buf;
+	out->size = size;
+	return 0;
+}
+
+static void alsa_mark(alsa_out_t *out, const audio_fifo_data_t *afd)
+{
+	alsa_mark_t *m;
+
+	if (out->mark_count == ALSA_MARKS) {
+		out->mark_head = (out->mark_head + 1) % ALSA_MARKS;
+		out->mark_count--;
+	}
+	m = &out->marks[(out->mark_head + out->mark_count++) % ALSA_MARKS];
+	m->at = out->staged;
+	m->track = afd->track;
+	m->frame = afd->frame;
+}
+
+static void alsa_clock_publish(audio_clock_t *c, unsigned int track,
+                               int64_t frame, int rate, long ahead)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	c->track = track;
+	c->frame = frame;
+	c->ns = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	c->rate = rate;
+	c->ahead = ahead;
+	__atomic_store_n(&c->seq, c->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Publish what the clock zone's device is playing: the frame that was
+ * written delay frames ago, looked up in the marks of the chunks it came
+ * from. Marks of chunks already played are dropped on the way.
+ */
+static void alsa_clock_update(alsa_zone_t *z, long delay)
+{
+	alsa_out_t *out = &z->out;
+	int64_t heard = out->written - delay;
+	alsa_mark_t *m;
+
+	while (out->mark_count > 1 &&
+	       out->marks[(out->mark_head + 1) % ALSA_MARKS].at <= heard) {
+		out->mark_head = (out->mark_head + 1) % ALSA_MARKS;
+		out->mark_count--;
+	}
+	m = &out->marks[out->mark_head];
+	if (!out->mark_count || m->at > heard)
+		return;
+	alsa_clock_publish(&z->af->clock, m->track, m->frame + heard - m->at,
+	                   out->rate, delay);
+}
+
+/* Gathered audio that will never be written, as far as the clock goes */
+static void alsa_discard(alsa_out_t *out)
+{
+	out->written += out->fill;
+	out->fill = 0;
+}
+
+static void alsa_stage(alsa_zone_t *z, const audio_fifo_data_t *afd)
+{
+	alsa_out_t *out = &z->out;
+	int16_t *dst;
+	int n = afd->nsamples * afd->channels;
+
+	if (z->pad && !alsa_reserve(out, z->pad)) {
+		memset(out->buf + out->fill * out->channels, 0,
+		       z->pad * out->channels * sizeof(int16_t));
+		out->fill += z->pad;
+		out->staged += z->pad;
+		z->pad = 0;
+	}
+
+	if (alsa_reserve(out, afd->nsamples))
+		return;
+	if (out->clock && !(afd->flags & AUDIO_FIFO_SILENCE))
+		alsa_mark(out, afd);
+	out->staged += afd->nsamples;
+	dst = out->buf + out->fill * out->channels;
+	memcpy(dst, afd->samples, n * sizeof(int16_t));
+	dsp_gain_s16(dst, n, z->gain);
+	out->fill += afd->nsamples;
+}
+
+static unsigned int alsa_epoch(audio_fifo_t *af)
+{
+	unsigned int epoch;
+
+	pthread_mutex_lock(&af->mutex);
+	epoch = af->epoch;
+	pthread_mutex_unlock(&af->mutex);
+	return epoch;
+}
+
+/*
+ * Write the gathered audio in whole periods, sized to what the device
+ * can take, until less than a period is left. With drain set, that is
+ * written too: nothing more is queued, so nothing should wait for it.
+ * Returns 1 if the device ran dry on the way.
+ */
+static int alsa_write(alsa_zone_t *z, int drain)
+{
+	audio_fifo_t *af = z->af;
+	alsa_out_t *out = &z->out;
+	snd_pcm_sframes_t avail, n, delay;
+	unsigned int calls = 0, writes = 0, wakeups = 0, xruns = 0;
+	int64_t written = 0;
+
+	trace_begin(ALSA_WRITE, z - zones, out->fill);
+	while (out->fill >= (drain ? 1 : out->period)) {
+		avail = snd_pcm_avail_update(out->h);
+		calls++;
+		if (avail >= 0) {
+			n = avail < out->fill ? avail : out->fill;
+			if (!drain || n < out->fill)
+				n -= n % out->period;
+			if (!n) {
+				snd_pcm_wait(out->h, 1000);
+				calls++;
+				wakeups++;
+				/* A seek while waiting makes what is gathered stale */
+				if (alsa_epoch(af) != z->epoch) {
+					alsa_discard(out);
+					break;
+				}
+				continue;
+			}
+			avail = snd_pcm_writei(out->h, out->buf, n);
+			calls++;
+			writes++;
+		}
+
+		if (avail < 0) {
+			if (avail == -EPIPE) {
+				xruns++;
+				trace(XRUN, z - zones, 0);
+			}
+			calls++;
+			if (snd_pcm_prepare(out->h) < 0) {
+				alsa_discard(out);
+				break;
+			}
+			continue;
+		}
+
+		out->fill -= avail;
+		memmove(out->buf, out->buf + avail * out->channels,
+		        out->fill * out->channels * sizeof(int16_t));
+		written += avail;
+	}
+	out->written += written;
+
+	avail = snd_pcm_avail_update(out->h);
+	calls++;
+	if (avail < 0 || avail > out->buffer)
+		avail = out->buffer;
+	__atomic_store_n(&z->latency, (long)(out->fill + out->buffer - avail),
+	                 __ATOMIC_RELAXED);
+	if (out->clock) {
+		if (snd_pcm_delay(out->h, &delay) < 0 || delay < 0)
+			delay = out->buffer - avail;
+		calls++;
+		alsa_clock_update(z, delay);
+	}
+
+	pthread_mutex_lock(&af->mutex);
+	af->stats.pcm_calls += calls;
+	af->stats.pcm_writes += writes;
+	af->stats.wakeups += wakeups;
+	af->stats.xruns += xruns;
+	if (out->clock)
+		af->stats.written_us += written * 1000000 / out->rate;
+	pthread_mutex_unlock(&af->mutex);
+	trace_end(ALSA_WRITE, z - zones, written);
+	return xruns > 0;
+}
+
+/*
+ * While a zone drains its device on a switch, the output thread waits for
+ * it however long that takes rather than skipping its audio.
+ */
+static void alsa_switching(alsa_zone_t *z, int on)
+{
+	pthread_mutex_lock(&zones_mutex);
+	z->switching = on;
+	if (!on)
+		pthread_cond_signal(&zones_room);
+	pthread_mutex_unlock(&zones_mutex);
+}
+
+/* Drop what the zone has gathered and what its device holds */
+static void alsa_zone_reset(alsa_zone_t *z)
+{
+	audio_clock_t *c = &z->af->clock;
+
+	z->out.fill = 0;
+	z->pad = z->out.rate * z->delay_ms / 1000;
+	if (z->out.h) {
+		snd_pcm_drop(z->out.h);
+		snd_pcm_prepare(z->out.h);
+	}
+	z->out.staged = z->out.written = 0;
+	z->out.mark_count = 0;
+	/* Silent until the new audio is written; only this thread writes c */
+	if (z->out.clock && c->rate)
+		alsa_clock_publish(c, c->track, c->frame, c->rate, 0);
+}
+
+/*
+ * Set the zone's handle, device (NULL to keep it), period and buffer.
+ * audio_get_output() reads the last three from other threads.
+ */
+static void alsa_zone_set(alsa_zone_t *z, snd_pcm_t *h, const char *dev,
+                          int period, int buffer)
+{
+	pthread_mutex_lock(&zones_mutex);
+	z->out.h = h;
+	if (dev)
+		snprintf(z->dev, sizeof(z->dev), "%s", dev);
+	z->out.period = period;
+	z->out.buffer = buffer;
+	pthread_mutex_unlock(&zones_mutex);
+}
+
+static int alsa_zone_open(alsa_zone_t *z, int rate, int channels)
+{
+	alsa_out_t *out = &z->out;
+	snd_pcm_t *h;
+	int period, buffer;
+
+	if (out->h) {
+		/* Play out what was gathered in the old format */
+		alsa_write(z, 1);
+		alsa_switching(z, 1);
+		snd_pcm_drain(out->h);
+		alsa_switching(z, 0);
+		snd_pcm_close(out->h);
+	}
+
+	out->rate = rate;
+	out->channels = channels;
+	out->fill = 0;
+	out->size = 0;
+	free(out->buf);
+	out->buf = NULL;
+	z->pad = rate * z->delay_ms / 1000;
+
+	period = __atomic_load_n(&alsa_period, __ATOMIC_RELAXED);
+	buffer = out->buffer;
+	h = alsa_open(z->dev, 0, rate, channels, &period, &buffer);
+	alsa_zone_set(z, h, NULL, h ? period : out->period, buffer);
+	return h ? 0 : -1;
+}
 
+/*
+ * Reopen the zone's device as audio_set_output() asked, without losing
+ * audio: the new device is opened first, what was gathered goes to the
+ * old one and that is drained before the new one takes over, so the
+ * music stops for as long as the new device takes to start. Opens
+ * don't wait for a device that is held; only when it is held, likely by
+ * the old handle, is that closed before the new device is opened again.
+ * A device that can't be opened leaves the old one in place, and if
+ * that can't be opened again either the zone is disabled until the next
+ * change. Returns 0, or -1 if the change couldn't be applied.
+ */
+static int alsa_zone_switch(alsa_zone_t *z, const char *dev, int period)
+{
+	alsa_out_t *out = &z->out;
+	snd_pcm_t *h;
+	int buffer, held, ret = 0;
+
+	if (!out->h) {
+		/* Nothing open yet: just check the next open will work */
+		h = alsa_open(dev, SND_PCM_NONBLOCK, 44100, 2, &period,
+		              &buffer);
+		if (!h)
+			return -1;
+		snd_pcm_close(h);
+		z->disabled = 0;
+		alsa_zone_set(z, NULL, dev, period, buffer);
+		return 0;
+	}
+
+	h = alsa_open(dev, SND_PCM_NONBLOCK, out->rate, out->channels,
+	              &period, &buffer);
+	held = !h && errno == EBUSY;
+	if (!h && !held)
+		return -1;
+
+	alsa_write(z, 1);
+	alsa_switching(z, 1);
+	snd_pcm_drain(out->h);
+	alsa_switching(z, 0);
+	snd_pcm_close(out->h);
+
+	if (held)
+		h = alsa_open(dev, SND_PCM_NONBLOCK, out->rate, out->channels,
+		              &period, &buffer);
+	if (h) {
+		alsa_zone_set(z, h, dev, period, buffer);
+	} else {
+		ret = -1;
+		period = out->period;
+		h = alsa_open(z->dev, SND_PCM_NONBLOCK, out->rate,
+		              out->channels, &period, &buffer);
+		if (h) {
+			alsa_zone_set(z, h, NULL, period, buffer);
+		} else {
+			fprintf(stderr, "audio: Unable to reopen %s, zone disabled\n",
+			        z->dev);
+			z->disabled = 1;
+			alsa_zone_set(z, NULL, NULL, out->period, out->buffer);
+		}
+	}
+	z->pad = out->rate * z->delay_ms / 1000;
+	return ret;
+}
+
+/* Carry out the pending audio_set_output() for this zone */
+static void alsa_zone_reopen(alsa_zone_t *z)
+{
+	char dev[sizeof(z->dev)];
+	int period, ok;
+
+	pthread_mutex_lock(&zones_mutex);
+	z->reopen = 0;
+	snprintf(dev, sizeof(dev), "%s",
+	         z == zones && alsa_switch.dev[0] ? alsa_switch.dev : z->dev);
+	period = alsa_period;
+	pthread_mutex_unlock(&zones_mutex);
+
+	ok = !alsa_zone_switch(z, dev, period);
+
+	pthread_mutex_lock(&zones_mutex);
+	if (!ok)
+		alsa_switch.failed = 1;
+	alsa_switch.pending--;
+	pthread_mutex_unlock(&zones_mutex);
+}
+
+static audio_fifo_data_t *alsa_zone_get(alsa_zone_t *z, int *more)
+{
 	audio_fifo_data_t *afd;
 
-	for (;;) {
-		afd = audio_get(af);
+	pthread_mutex_lock(&zones_mutex);
+	while (!z->count && !z->reopen)
+		pthread_cond_wait(&z->cond, &zones_mutex);
+	if (!z->count) {
+		pthread_mutex_unlock(&zones_mutex);
+		return NULL;
+	}
+	afd = z->q[z->head];
+	z->head = (z->head + 1) % ALSA_ZONE_CHUNKS;
+	z->count--;
+	z->qframes -= afd->nsamples;
+	*more = z->count > 0;
+	pthread_cond_signal(&zones_room);
+	pthread_mutex_unlock(&zones_mutex);
+	return afd;
+}
 
-		if (!h || cur_rate != afd->rate || cur_channels != afd->channels) {
-			if (h) snd_pcm_close(h);
+static void *alsa_zone_start(void *aux)
+{
+	alsa_zone_t *z = aux;
+	audio_fifo_data_t *afd;
+	int more;
 
-			cur_rate = afd->rate;
-			cur_channels = afd->channels;
+	for (;;) {
+		if (__atomic_load_n(&z->reopen, __ATOMIC_RELAXED))
+			alsa_zone_reopen(z);
+		afd = alsa_zone_get(z, &more);
+		if (!afd)
+			continue;
 
-			h = alsa_open("default", cur_rate, cur_channels);
+		/* Queued before a seek that came in since */
+		if (afd->epoch != alsa_epoch(z->af)) {
+			alsa_unref(afd);
+			continue;
+		}
 
-			if (!h) {
+		if (!z->disabled && (!z->out.h || z->out.rate != afd->rate ||
+		                     z->out.channels != afd->channels) &&
+		    alsa_zone_open(z, afd->rate, afd->channels)) {
+			if (z == zones) {
 				fprintf(stderr, "Unable to open ALSA device (%d channels, %d Hz), dying\n",
-				        cur_channels, cur_rate);
+				        afd->channels, afd->rate);
 				exit(1);
 			}
+			fprintf(stderr, "audio: Unable to open %s, zone disabled\n",
+			        z->dev);
+			z->disabled = 1;
+		}
+		if (z->disabled) {
+			alsa_unref(afd);
+			continue;
+		}
+
+		if (afd->epoch != z->epoch) {
+			z->epoch = afd->epoch;
+			alsa_zone_reset(z);
 		}
 
-		c = snd_pcm_wait(h, 1000);
+		alsa_stage(z, afd);
+		alsa_unref(afd);
 
-		if (c >= 0)
-			c = snd_pcm_avail_update(h);
+		/* Gather whatever is already queued, up to a batch */
+		if (z->out.fill < z->out.period * ALSA_BATCH_PERIODS && more)
+			continue;
+		/* Starting over from an empty buffer loses the alignment */
+		if (alsa_write(z, !more))
+			z->pad = z->out.rate * z->delay_ms / 1000;
+	}
+	return NULL;
+}
 
-		if (c == -EPIPE)
-			snd_pcm_prepare(h);
+static void alsa_deadline(struct timespec *until, int ms)
+{
+	clock_gettime(CLOCK_REALTIME, until);
+	until->tv_nsec += ms * 1000000L;
+	until->tv_sec += until->tv_nsec / 1000000000;
+	until->tv_nsec %= 1000000000;
+}
 
-		snd_pcm_writei(h, afd->samples, afd->nsamples);
-		free(afd);
+static int alsa_zone_full(const alsa_zone_t *z, int limit)
+{
+	return z->qframes >= limit || z->count == ALSA_ZONE_CHUNKS;
+}
+
+/*
+ * The zone the output thread keeps pace with: the first one that keeps
+ * up, or the first one if none does. Called with zones_mutex held.
+ */
+static alsa_zone_t *alsa_pacer(void)
+{
+	int i;
+
+	for (i = 0; i < nzones; i++)
+		if (!zones[i].stalled)
+			return &zones[i];
+	return zones;
+}
+
+/*
+ * Hand afd to every zone. The first zone that keeps up sets the pace:
+ * the output thread waits while its queue is full. If that takes longer
+ * than ALSA_ZONE_MAX_MS its device hangs, and the zone is left behind
+ * until it has drained half its queue, so a later chunk doesn't wait for
+ * it again. Any zone that falls that far behind skips its oldest chunks
+ * rather than holding the others up.
+ */
+static void alsa_fanout(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	int limit = afd->rate * ALSA_ZONE_MAX_MS / 1000;
+	unsigned int skipped = 0;
+	struct timespec until;
+	alsa_zone_t *z;
+	int i;
+
+	afd->refs = nzones;
+
+	alsa_deadline(&until, ALSA_ZONE_MAX_MS);
+	pthread_mutex_lock(&zones_mutex);
+	for (i = 0; i < nzones; i++)
+		if (zones[i].stalled && zones[i].qframes < limit / 2)
+			zones[i].stalled = 0;
+	while (alsa_zone_full(z = alsa_pacer(), limit)) {
+		if (!pthread_cond_timedwait(&zones_room, &zones_mutex, &until))
+			continue;
+		alsa_deadline(&until, ALSA_ZONE_MAX_MS);
+		/* A device handover may take that long */
+		if (z->switching)
+			continue;
+		/* With every zone behind, that wait was the pace */
+		if (z->stalled)
+			break;
+		z->stalled = 1;
 	}
+
+	for (i = 0; i < nzones; i++) {
+		z = &zones[i];
+		while (z->count && alsa_zone_full(z, limit)) {
+			z->qframes -= z->q[z->head]->nsamples;
+			alsa_unref(z->q[z->head]);
+			z->head = (z->head + 1) % ALSA_ZONE_CHUNKS;
+			z->count--;
+			skipped++;
+		}
+		z->q[(z->head + z->count) % ALSA_ZONE_CHUNKS] = afd;
+		z->count++;
+		z->qframes += afd->nsamples;
+		pthread_cond_signal(&z->cond);
+	}
+	pthread_mutex_unlock(&zones_mutex);
+
+	if (skipped) {
+		pthread_mutex_lock(&af->mutex);
+		af->stats.zone_skipped += skipped;
+		pthread_mutex_unlock(&af->mutex);
+	}
+}
+
+/* Frames between the output thread and the first zone's speaker */
+static long alsa_delay(void)
+{
+	long delay;
+
+	pthread_mutex_lock(&zones_mutex);
+	delay = zones[0].qframes;
+	pthread_mutex_unlock(&zones_mutex);
+	return delay + __atomic_load_n(&zones[0].latency, __ATOMIC_RELAXED);
+}
+
+static void* alsa_audio_start(void *aux)
+{
+	audio_fifo_t *af = aux;
+	unsigned int cur_epoch = 0;
+	long delay;
+	dsp_chain_t *chain = NULL;
+
+	audio_fifo_data_t *afd;
+
+	for (;;) {
+		afd = audio_get(af);
+
+		pthread_mutex_lock(&af->mutex);
+		audio_replay_push(af, afd);
+		pthread_mutex_unlock(&af->mutex);
+
+		if (alsa_check_epoch(af, afd, &cur_epoch)) {
+			free(afd);
+			continue;
+		}
+
+		if (!(afd->flags & AUDIO_FIFO_SILENCE))
+			spectrum_feed(afd->samples, afd->nsamples,
+			              afd->channels, afd->rate);
+
+		audio_gain_process(af, afd);
+		alsa_dsp(af, &chain, afd);
+
+		/* The export gets the music without the prompts */
+		pcm_export_feed(afd->samples, afd->nsamples, afd->channels,
+		                afd->rate, afd->epoch);
+
+		delay = audio_prompt_active(af) ? alsa_delay() : 0;
+		audio_prompt_mix(af, afd, delay);
+
+		alsa_fanout(af, afd);
+	}
+	return NULL;
+}
+
+/*
+ * Parse the zones: output devices separated by ';', each optionally
+ * followed by a gain in dB and a delay in ms, e.g. "default;rear -6 15".
+ * Returns the number of zones.
+ */
+static int alsa_zones_parse(const char *spec)
+{
+	char buf[256], *zone, *save, *dev, *end;
+	float db;
+	int n = 0, ms;
+
+	snprintf(buf, sizeof(buf), "%s", spec && *spec ? spec : "default");
+	for (zone = strtok_r(buf, ";", &save); zone && n < ALSA_MAX_ZONES;
+	     zone = strtok_r(NULL, ";", &save)) {
+		dev = zone + strspn(zone, " ");
+		if (!*dev)
+			continue;
+		db = 0;
+		ms = 0;
+		zone = dev + strcspn(dev, " ");
+		if (*zone) {
+			*zone++ = '\0';
+			/* not sscanf's %f, which wants a decimal comma in some locales */
+			db = g_ascii_strtod(zone, &end);
+			if (end != zone)
+				ms = atoi(end);
+		}
+		snprintf(zones[n].dev, sizeof(zones[n].dev), "%s", dev);
+		zones[n].gain = dsp_gain_from_db(db);
+		zones[n].delay_ms = ms > 0 ? ms : 0;
+		n++;
+	}
+	return n;
 }
 
-void audio_init(audio_fifo_t *af)
+/*
+ * Start the output threads. zones_spec lists the output devices as
+ * parsed by alsa_zones_parse(), NULL for just "default".
+ */
+void audio_init(audio_fifo_t *af, const char *zones_spec)
 {
 	pthread_t tid;
+	int i;
 
 	TAILQ_INIT(&af->q);
 	af->qlen = 0;
+	af->epoch = 0;
+	af->rate = 0;
+	af->channels = 0;
+	af->pos_ms = 0;
+	af->pos_frames = 0;
+	memset(&af->stats, 0, sizeof(af->stats));
+	memset(&af->replay, 0, sizeof(af->replay));
+	af->replay.complete = 1;
+	af->replay.next_complete = 1;
+
+	TAILQ_INIT(&af->prompt);
+	af->prompt_len = 0;
+	af->prompt_off = 0;
+	af->duck_gain = DSP_UNITY;
+	af->volume = DSP_UNITY;
+	af->norm_gain = DSP_UNITY;
+	af->norm_next = DSP_UNITY;
+	af->norm_track = 0;
+	af->speed_gain = DSP_UNITY;
+	af->out_gain = DSP_UNITY;
+	memset(&af->loudness, 0, sizeof(af->loudness));
+	memset(&af->heard, 0, sizeof(af->heard));
+	audio_xfade_cancel(af);
+	af->dsp_next = NULL;
+	af->dsp_pending = 0;
+	memset(&af->trim, 0, sizeof(af->trim));
+	memset(&af->clock, 0, sizeof(af->clock));
+	af->track = 0;
 
 	pthread_mutex_init(&af->mutex, NULL);
 	pthread_cond_init(&af->cond, NULL);
 
+	nzones = alsa_zones_parse(zones_spec);
+	if (!nzones)
+		nzones = alsa_zones_parse(NULL);
+	for (i = 0; i < nzones; i++) {
+		zones[i].af = af;
+		zones[i].out.clock = !i;
+		pthread_cond_init(&zones[i].cond, NULL);
+		pthread_create(&tid, NULL, alsa_zone_start, &zones[i]);
+	}
+
 	pthread_create(&tid, NULL, alsa_audio_start, af);
 }
 
+/*
+ * Move the first zone to dev and every zone to a period of period frames,
+ * keeping what either is now when NULL or 0, while playing: see
+ * alsa_zone_switch(). The zone threads switch on their own, without
+ * holding up the caller; audio_output_switched() tells how that went.
+ */
+void audio_set_output(audio_fifo_t *af, const char *dev, int period)
+{
+	int i;
+
+	pthread_mutex_lock(&zones_mutex);
+	snprintf(alsa_switch.dev, sizeof(alsa_switch.dev), "%s",
+	         dev ? dev : "");
+	alsa_switch.period = period > 0 ? period : 0;
+	alsa_switch.failed = 0;
+	alsa_switch.unreported = 1;
+	if (period > 0)
+		__atomic_store_n(&alsa_period, period, __ATOMIC_RELAXED);
+	for (i = 0; i < nzones; i++) {
+		if (!zones[i].reopen)
+			alsa_switch.pending++;
+		zones[i].reopen = 1;
+		pthread_cond_signal(&zones[i].cond);
+	}
+	pthread_mutex_unlock(&zones_mutex);
+}
+
+/*
+ * How the last audio_set_output() went, with the device and period it
+ * asked for: AUDIO_SWITCH_PENDING while the zones switch, then
+ * AUDIO_SWITCH_DONE or AUDIO_SWITCH_FAILED once, and AUDIO_SWITCH_IDLE
+ * after that.
+ */
+int audio_output_switched(audio_fifo_t *af, char *dev, int len, int *period)
+{
+	int state;
+
+	pthread_mutex_lock(&zones_mutex);
+	snprintf(dev, len, "%s", alsa_switch.dev);
+	*period = alsa_switch.period;
+	if (!alsa_switch.unreported)
+		state = AUDIO_SWITCH_IDLE;
+	else if (alsa_switch.pending)
+		state = AUDIO_SWITCH_PENDING;
+	else {
+		state = alsa_switch.failed ? AUDIO_SWITCH_FAILED :
+		                             AUDIO_SWITCH_DONE;
+		alsa_switch.unreported = 0;
+	}
+	pthread_mutex_unlock(&zones_mutex);
+	return state;
+}
+
+/* What the first zone plays on, with its period and buffer in frames */
+void audio_get_output(audio_fifo_t *af, char *dev, int len, int *period,
+                      int *buffer)
+{
+	pthread_mutex_lock(&zones_mutex);
+	snprintf(dev, len, "%s", zones[0].dev);
+	*period = zones[0].out.period ? zones[0].out.period : alsa_period;
+	*buffer = zones[0].out.buffer;
+	pthread_mutex_unlock(&zones_mutex);
+}
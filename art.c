@@ -0,0 +1,390 @@
+/**
+ * Album art for the OSD.
+ *
+ * Covers are fetched with libspotify on the main thread, but decoding and
+ * scaling happen on a worker thread so a large JPEG never stalls map
+ * rendering. Thumbnails are written as "<image id>.png" to a directory in
+ * the libspotify cache, so a cover is only downloaded and decoded once,
+ * and the last ART_CACHE_ENTRIES are kept decoded in memory.
+ */
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "art.h"
+#include "log.h"
+
+/// Hex image id plus terminator
+#define ART_ID_LEN 41
+
+struct art_job
+{
+  char id[ART_ID_LEN];
+  void *data;			/* encoded image, NULL to reload the thumbnail */
+  size_t size;
+  int callback;			/* waiting in a load callback */
+};
+
+struct art_entry
+{
+  char id[ART_ID_LEN];
+  GdkPixbuf *thumb;
+};
+
+static sp_session *g_art_session;
+static char *g_art_dir;
+static int g_art_size;
+static GAsyncQueue *g_art_jobs;
+/// id -> link in g_art_lru, whose head is the most recently used entry
+static GHashTable *g_art_cache;
+static GQueue *g_art_lru;
+/// ids being downloaded or decoded
+static GHashTable *g_art_pending;
+static pthread_mutex_t g_art_mutex = PTHREAD_MUTEX_INITIALIZER;
+/// Last cover art_path() looked for on disk, and whether it was there
+static char g_art_disk_id[ART_ID_LEN];
+static int g_art_disk;
+
+static int
+art_cover_id (sp_track *track, char *id)
+{
+  sp_album *album = track ? sp_track_album (track) : NULL;
+  const byte *cover;
+  int i;
+
+  if (!album)
+    return -1;
+  cover = sp_album_cover (album, SP_IMAGE_SIZE_NORMAL);
+  if (!cover)
+    return -1;
+  for (i = 0; i < 20; i++)
+    sprintf (id + 2 * i, "%02x", cover[i]);
+  return 0;
+}
+
+static char *
+art_thumb_path (const char *id)
+{
+  char *name = g_strdup_printf ("%s.png", id);
+  char *path = g_build_filename (g_art_dir, name, NULL);
+
+  g_free (name);
+  return path;
+}
+
+/* Called with g_art_mutex held; moves the entry to the head of the LRU */
+static struct art_entry *
+art_lookup (const char *id)
+{
+  GList *link = g_hash_table_lookup (g_art_cache, id);
+
+  if (!link)
+    return NULL;
+  g_queue_unlink (g_art_lru, link);
+  g_queue_push_head_link (g_art_lru, link);
+  return link->data;
+}
+
+static void
+art_insert (const char *id, GdkPixbuf *thumb)
+{
+  struct art_entry *entry;
+  GList *link;
+
+  pthread_mutex_lock (&g_art_mutex);
+  g_hash_table_remove (g_art_pending, id);
+  if ((entry = art_lookup (id)))
+    {
+      g_object_unref (entry->thumb);
+      entry->thumb = thumb;
+      pthread_mutex_unlock (&g_art_mutex);
+      return;
+    }
+
+  entry = g_new0 (struct art_entry, 1);
+  strcpy (entry->id, id);
+  entry->thumb = thumb;
+  link = g_list_alloc ();
+  link->data = entry;
+  g_queue_push_head_link (g_art_lru, link);
+  g_hash_table_insert (g_art_cache, entry->id, link);
+
+  if (g_queue_get_length (g_art_lru) > ART_CACHE_ENTRIES)
+    {
+      link = g_queue_pop_tail_link (g_art_lru);
+      entry = link->data;
+      g_hash_table_remove (g_art_cache, entry->id);
+      if (!strcmp (entry->id, g_art_disk_id))
+        g_art_disk_id[0] = '\0';
+      g_object_unref (entry->thumb);
+      g_free (entry);
+      g_list_free_1 (link);
+    }
+  pthread_mutex_unlock (&g_art_mutex);
+}
+
+static void
+art_failed (const char *id)
+{
+  pthread_mutex_lock (&g_art_mutex);
+  g_hash_table_remove (g_art_pending, id);
+  pthread_mutex_unlock (&g_art_mutex);
+}
+
+/**
+ * Decode a downloaded cover and scale it to fit in g_art_size, keeping
+ * the aspect ratio.
+ */
+static GdkPixbuf *
+art_decode (const struct art_job *job)
+{
+  GdkPixbufLoader *loader = gdk_pixbuf_loader_new ();
+  GdkPixbuf *image, *thumb = NULL;
+  GError *error = NULL;
+  int w, h, ok;
+
+  /* The loader is closed even after a failed write, but only once */
+  ok = gdk_pixbuf_loader_write (loader, job->data, job->size, &error);
+  if (!gdk_pixbuf_loader_close (loader, ok ? &error : NULL))
+    ok = 0;
+  if (ok)
+    {
+      image = gdk_pixbuf_loader_get_pixbuf (loader);
+      w = gdk_pixbuf_get_width (image);
+      h = gdk_pixbuf_get_height (image);
+      if (w > h)
+        thumb = gdk_pixbuf_scale_simple (image, g_art_size,
+                                         MAX (h * g_art_size / w, 1),
+                                         GDK_INTERP_BILINEAR);
+      else
+        thumb = gdk_pixbuf_scale_simple (image, MAX (w * g_art_size / h, 1),
+                                         g_art_size, GDK_INTERP_BILINEAR);
+    }
+  else
+    {
+      dbg (0, "can't decode cover %s: %s\n", job->id, error->message);
+      g_error_free (error);
+    }
+  g_object_unref (loader);
+  return thumb;
+}
+
+static gpointer
+art_worker (gpointer data)
+{
+  struct art_job *job;
+  GdkPixbuf *thumb;
+  GError *error = NULL;
+  char *path, *tmp;
+
+  for (;;)
+    {
+      job = g_async_queue_pop (g_art_jobs);
+      path = art_thumb_path (job->id);
+
+      if (job->data)
+        {
+          thumb = art_decode (job);
+          if (thumb)
+            {
+              /* Write and rename so a reader never sees half a file */
+              tmp = g_strdup_printf ("%s.tmp", path);
+              if (gdk_pixbuf_save (thumb, tmp, "png", &error, NULL))
+                g_rename (tmp, path);
+              else
+                {
+                  dbg (0, "can't save cover %s: %s\n", path, error->message);
+                  g_clear_error (&error);
+                }
+              g_free (tmp);
+            }
+        }
+      else
+        {
+          thumb = gdk_pixbuf_new_from_file (path, NULL);
+        }
+
+      if (thumb)
+        art_insert (job->id, thumb);
+      else
+        art_failed (job->id);
+
+      g_free (path);
+      free (job->data);
+      g_free (job);
+    }
+  return NULL;
+}
+
+/**
+ * libspotify callback, on the main thread, once a cover is downloaded.
+ * Only the encoded bytes are copied here; decoding is up to the worker.
+ */
+static void
+art_image_loaded (sp_image *image, void *userdata)
+{
+  struct art_job *job = userdata;
+  const void *data;
+
+  if (job->callback)
+    sp_image_remove_load_callback (image, art_image_loaded, job);
+  if (sp_image_error (image) == SP_ERROR_OK
+      && (data = sp_image_data (image, &job->size)) && job->size)
+    {
+      job->data = malloc (job->size);
+      memcpy (job->data, data, job->size);
+      g_async_queue_push (g_art_jobs, job);
+    }
+  else
+    {
+      dbg (1, "cover %s failed to load\n", job->id);
+      art_failed (job->id);
+      g_free (job);
+    }
+  sp_image_release (image);
+}
+
+/**
+ * Set up the caches and start the decoder thread.
+ *
+ * @param  session       The session covers are fetched with
+ * @param  cache_dir     Directory for the thumbnail cache
+ * @param  size          Largest thumbnail side, in pixels
+ */
+void
+art_init (sp_session *session, const char *cache_dir, int size)
+{
+  g_art_session = session;
+  g_art_dir = g_strdup (cache_dir);
+  g_art_size = size;
+  g_mkdir_with_parents (g_art_dir, 0755);
+
+  g_art_jobs = g_async_queue_new ();
+  g_art_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
+  g_art_lru = g_queue_new ();
+  g_art_pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                         NULL);
+  g_thread_new ("spotify-art", art_worker, NULL);
+}
+
+/**
+ * Get the cover of a track ready, from memory, the thumbnail cache or
+ * libspotify, whichever has it first. Must be called on the main thread.
+ *
+ * @return 0 if the cover is ready or on its way, -1 if the track's
+ *         album isn't known yet
+ */
+int
+art_request (sp_track *track)
+{
+  char id[ART_ID_LEN];
+  struct art_job *job;
+  sp_image *image;
+  char *path;
+  int known;
+
+  if (!g_art_jobs || art_cover_id (track, id))
+    return -1;
+
+  pthread_mutex_lock (&g_art_mutex);
+  known = art_lookup (id) || g_hash_table_lookup (g_art_pending, id);
+  if (!known)
+    g_hash_table_insert (g_art_pending, g_strdup (id), GINT_TO_POINTER (1));
+  pthread_mutex_unlock (&g_art_mutex);
+  if (known)
+    return 0;
+
+  job = g_new0 (struct art_job, 1);
+  strcpy (job->id, id);
+
+  path = art_thumb_path (id);
+  if (g_file_test (path, G_FILE_TEST_EXISTS))
+    {
+      g_async_queue_push (g_art_jobs, job);
+      g_free (path);
+      return 0;
+    }
+  g_free (path);
+
+  image = sp_image_create (g_art_session,
+                           sp_album_cover (sp_track_album (track),
+                                           SP_IMAGE_SIZE_NORMAL));
+  if (sp_image_is_loaded (image))
+    art_image_loaded (image, job);
+  else
+    {
+      job->callback = 1;
+      sp_image_add_load_callback (image, art_image_loaded, job);
+    }
+  return 0;
+}
+
+/**
+ * Path of the thumbnail of the track's cover. Like art_get(), this looks
+ * at the track's metadata, so it belongs on the main thread.
+ *
+ * @return 0 if the thumbnail is ready, -1 otherwise
+ */
+int
+art_path (sp_track *track, char *path, size_t len)
+{
+  char id[ART_ID_LEN];
+  char *p;
+  int ret = -1, known;
+
+  if (!g_art_cache || art_cover_id (track, id))
+    return -1;
+
+  pthread_mutex_lock (&g_art_mutex);
+  if (art_lookup (id))
+    known = 1;
+  else if (!strcmp (id, g_art_disk_id))
+    known = g_art_disk;
+  else
+    known = -1;
+  pthread_mutex_unlock (&g_art_mutex);
+
+  /* Once it is evicted from memory, the thumbnail is still on disk.
+     Look once per cover, not on every publish; an eviction makes us
+     look again. */
+  p = art_thumb_path (id);
+  if (known < 0)
+    {
+      known = g_file_test (p, G_FILE_TEST_EXISTS);
+      pthread_mutex_lock (&g_art_mutex);
+      strcpy (g_art_disk_id, id);
+      g_art_disk = known;
+      pthread_mutex_unlock (&g_art_mutex);
+    }
+  if (known)
+    {
+      g_strlcpy (path, p, len);
+      ret = 0;
+    }
+  g_free (p);
+  return ret;
+}
+
+/**
+ * The decoded thumbnail of the track's cover, with a reference the
+ * caller has to drop, or NULL if it isn't ready.
+ */
+GdkPixbuf *
+art_get (sp_track *track)
+{
+  char id[ART_ID_LEN];
+  struct art_entry *entry;
+  GdkPixbuf *thumb = NULL;
+
+  if (art_cover_id (track, id))
+    return NULL;
+
+  pthread_mutex_lock (&g_art_mutex);
+  if (g_art_cache && (entry = art_lookup (id)))
+    thumb = g_object_ref (entry->thumb);
+  pthread_mutex_unlock (&g_art_mutex);
+  return thumb;
+}
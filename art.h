@@ -0,0 +1,16 @@
+#ifndef _SPOTIFY_ART_H_
+#define _SPOTIFY_ART_H_
+
+#include <stddef.h>
+#include <libspotify/api.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+/// Decoded thumbnails kept in memory
+#define ART_CACHE_ENTRIES 16
+
+void art_init (sp_session *session, const char *cache_dir, int size);
+int art_request (sp_track *track);
+int art_path (sp_track *track, char *path, size_t len);
+GdkPixbuf *art_get (sp_track *track);
+
+#endif /* _SPOTIFY_ART_H_ */
@@ -26,23 +26,77 @@
  */
 
 #include "audio.h"
+#include "trace.h"
 #include <stdlib.h>
+#include <string.h>
+
+/*
+ * Silent chunk in the format of the first pending prompt, so prompts
+ * still play while the music is paused or stopped.
+ */
+static audio_fifo_data_t* audio_silence(audio_fifo_t *af)
+{
+    audio_fifo_data_t *p = TAILQ_FIRST(&af->prompt);
+    audio_fifo_data_t *afd;
+    int n = af->prompt_len;
+
+    if (n > AUDIO_SILENCE_FRAMES)
+	n = AUDIO_SILENCE_FRAMES;
+
+    afd = calloc(1, sizeof(*afd) + n * p->channels * sizeof(int16_t));
+    if (!afd)
+	return NULL;
+    afd->rate = p->rate;
+    afd->channels = p->channels;
+    afd->nsamples = n;
+    afd->epoch = af->epoch;
+    afd->flags = AUDIO_FIFO_SILENCE;
+    return afd;
+}
 
 audio_fifo_data_t* audio_get(audio_fifo_t *af)
 {
     audio_fifo_data_t *afd;
+    int waited = 0;
     pthread_mutex_lock(&af->mutex);
   
-    while (!(afd = TAILQ_FIRST(&af->q)))
+    for (;;) {
+	if ((afd = TAILQ_FIRST(&af->q))) {
+	    if (afd == af->xfade_chunk) {
+		/* Played before the next track could be mixed in */
+		af->xfade_chunk = TAILQ_NEXT(afd, link);
+		af->xfade_off = 0;
+	    }
+	    TAILQ_REMOVE(&af->q, afd, link);
+	    af->qlen -= afd->nsamples;
+	    break;
+	}
+	if (af->prompt_len && (afd = audio_silence(af)))
+	    break;
+	if (!waited++)
+	    af->stats.fifo_waits++;
 	pthread_cond_wait(&af->cond, &af->mutex);
+    }
   
-    TAILQ_REMOVE(&af->q, afd, link);
-    af->qlen -= afd->nsamples;
-  
+    trace(FIFO_GET, afd->nsamples, af->qlen);
     pthread_mutex_unlock(&af->mutex);
     return afd;
 }
 
+/*
+ * Returns 1 if audio_get() has a chunk to hand out right away, so the
+ * output thread can gather more before writing to the device.
+ */
+int audio_pending(audio_fifo_t *af)
+{
+    int pending;
+
+    pthread_mutex_lock(&af->mutex);
+    pending = !TAILQ_EMPTY(&af->q);
+    pthread_mutex_unlock(&af->mutex);
+    return pending;
+}
+
 void audio_fifo_flush(audio_fifo_t *af)
 {
     audio_fifo_data_t *afd;
@@ -56,5 +110,194 @@ void audio_fifo_flush(audio_fifo_t *af)
     }
 
     af->qlen = 0;
+    af->track++;
+    af->pos_ms = 0;
+    af->pos_frames = 0;
+    audio_replay_reset(af, 1);
+    audio_xfade_cancel(af);
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/*
+ * Called right after the player has been asked to seek to pos_ms.
+ *
+ * Every queued chunk predates the seek and is dropped. Chunks delivered
+ * from now on carry the new epoch, which is also how the output thread
+ * knows to throw away the chunk it is holding and what the device has
+ * buffered.
+ */
+void audio_fifo_seek(audio_fifo_t *af, int pos_ms)
+{
+    audio_fifo_data_t *afd, *next;
+
+    pthread_mutex_lock(&af->mutex);
+
+    af->epoch++;
+    clock_gettime(CLOCK_MONOTONIC, &af->seek_time);
+    af->stats.seeks++;
+    audio_xfade_cancel(af);
+    audio_trim_cancel(af);
+
+    for (afd = TAILQ_FIRST(&af->q); afd; afd = next) {
+	next = TAILQ_NEXT(afd, link);
+	if (afd->epoch == af->epoch)
+	    continue;
+	TAILQ_REMOVE(&af->q, afd, link);
+	af->qlen -= afd->nsamples;
+	af->stats.stale_chunks++;
+	free(afd);
+    }
+
+    af->pos_ms = pos_ms;
+    af->pos_frames = af->qlen;
+    audio_replay_reset(af, pos_ms == 0);
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/*
+ * Skip ms forward inside what is already queued, without asking the
+ * player to seek. Only the skipped frames are dropped; the rest of the
+ * queue is kept and moved to a new epoch so the output thread still
+ * discards its stale in-flight chunk.
+ *
+ * Returns -1 when less than ms of audio is queued.
+ */
+int audio_fifo_skip(audio_fifo_t *af, int ms)
+{
+    audio_fifo_data_t *afd;
+    int frames;
+
+    pthread_mutex_lock(&af->mutex);
+
+    frames = (int64_t)ms * af->rate / 1000;
+    if (!af->rate || frames >= af->qlen) {
+	pthread_mutex_unlock(&af->mutex);
+	return -1;
+    }
+
+    af->epoch++;
+    clock_gettime(CLOCK_MONOTONIC, &af->seek_time);
+    af->stats.seeks++;
+    audio_xfade_cancel(af);
+    audio_trim_cancel(af);
+
+    while (frames > 0 && (afd = TAILQ_FIRST(&af->q))) {
+	if (afd->nsamples <= frames) {
+	    TAILQ_REMOVE(&af->q, afd, link);
+	    af->qlen -= afd->nsamples;
+	    frames -= afd->nsamples;
+	    free(afd);
+	    continue;
+	}
+	memmove(afd->samples, afd->samples + frames * afd->channels,
+		(afd->nsamples - frames) * afd->channels * sizeof(int16_t));
+	afd->nsamples -= frames;
+	afd->frame += frames;
+	af->qlen -= frames;
+	frames = 0;
+    }
+
+    TAILQ_FOREACH(afd, &af->q, link)
+	afd->epoch = af->epoch;
+
+    audio_replay_reset(af, 0);
+    pthread_mutex_unlock(&af->mutex);
+    return 0;
+}
+
+/*
+ * Position in the current track of the next frame the output thread
+ * will pick up.
+ */
+int audio_position_ms(audio_fifo_t *af)
+{
+    int ms;
+
+    pthread_mutex_lock(&af->mutex);
+    ms = af->pos_ms;
+    if (af->rate)
+	ms += (af->pos_frames - af->qlen) * 1000 / af->rate;
+    pthread_mutex_unlock(&af->mutex);
+
+    /* Still playing the tail of the previous track */
+    return ms < 0 ? 0 : ms;
+}
+
+/*
+ * Serial of the track being delivered, which tags its chunks. Takes no
+ * lock: it only changes on the player's thread.
+ */
+unsigned int audio_fifo_track(audio_fifo_t *af)
+{
+    return __atomic_load_n(&af->track, __ATOMIC_RELAXED);
+}
+
+/*
+ * Where the first zone's speaker is: the serial of the track it plays and
+ * the position in it, in ms. Between writes the position moves on with
+ * the time, but no further than what the device held. Takes no lock, so
+ * it can be called from any thread at any rate.
+ *
+ * Returns -1 until something was heard.
+ */
+int audio_clock_read(audio_fifo_t *af, unsigned int *track, int *ms)
+{
+    audio_clock_t c;
+    struct timespec ts;
+    int64_t ahead;
+    unsigned int s;
+
+    for (;;) {
+	s = __atomic_load_n(&af->clock.seq, __ATOMIC_ACQUIRE);
+	if (s & 1)
+	    continue;
+	memcpy(&c, &af->clock, sizeof(c));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&af->clock.seq, __ATOMIC_RELAXED) == s)
+	    break;
+    }
+    if (!c.rate)
+	return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ahead = ((int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec - c.ns) *
+	c.rate / 1000000000;
+    if (ahead > c.ahead)
+	ahead = c.ahead;
+    if (ahead < 0)
+	ahead = 0;
+    *track = c.track;
+    *ms = (c.frame + ahead) * 1000 / c.rate;
+    return 0;
+}
+
+int audio_buffered_ms(audio_fifo_t *af)
+{
+    int ms;
+
+    pthread_mutex_lock(&af->mutex);
+    ms = af->rate ? af->qlen * 1000 / af->rate : 0;
+    pthread_mutex_unlock(&af->mutex);
+    return ms;
+}
+
+void audio_get_stats(audio_fifo_t *af, audio_stats_t *stats)
+{
+    pthread_mutex_lock(&af->mutex);
+    *stats = af->stats;
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/*
+ * Hand a new filter chain (or NULL for none) to the output thread, which
+ * swaps it in before its next chunk and frees the old one.
+ */
+void audio_set_dsp(audio_fifo_t *af, dsp_chain_t *chain)
+{
+    pthread_mutex_lock(&af->mutex);
+    if (af->dsp_pending && af->dsp_next)
+	dsp_chain_free(af->dsp_next);
+    af->dsp_next = chain;
+    af->dsp_pending = 1;
     pthread_mutex_unlock(&af->mutex);
 }
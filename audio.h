@@ -29,6 +29,8 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
+#include "dsp.h"
 #include "queue.h"
 
 
@@ -38,20 +40,213 @@ typedef struct audio_fifo_data {
 	int channels;
 	int rate;
 	int nsamples;
+	unsigned int epoch;	/* value of audio_fifo_t.epoch when queued */
+	unsigned int track;	/* value of audio_fifo_t.track when queued */
+	int64_t frame;		/* of the first sample, in its track */
+	unsigned int flags;
+	int refs;		/* output zones still to play it */
+	struct timespec queued;	/* only set for prompts */
 	int16_t samples[0];
 } audio_fifo_data_t;
 
+#define AUDIO_FIFO_SILENCE	0x1	/* filler carrying prompts while music is stopped */
+#define AUDIO_SILENCE_FRAMES	1024
+/* How an output change is going, see audio_output_switched() */
+#define AUDIO_SWITCH_IDLE	0	/* nothing new to report */
+#define AUDIO_SWITCH_PENDING	1
+#define AUDIO_SWITCH_DONE	2
+#define AUDIO_SWITCH_FAILED	3
+/* ALSA period asked for by default, and the range audio_set_output() takes */
+#define AUDIO_PERIOD		1024
+#define AUDIO_PERIOD_MIN	64
+#define AUDIO_PERIOD_MAX	16384
+
+typedef struct audio_stats {
+	unsigned int seeks;
+	unsigned int seek_latency_us;	/* seek request to first write, last seek */
+	unsigned int seek_latency_max_us;
+	unsigned int stale_chunks;	/* chunks dropped because of a seek */
+	unsigned int xruns;
+	unsigned int replays;		/* rewinds served from the replay buffer */
+	unsigned int prompts;
+	unsigned int prompt_latency_us;	/* prompt write to speaker, last prompt */
+	unsigned int prompt_latency_max_us;
+	unsigned int prompts_dropped;
+	unsigned int limited_chunks;	/* chunks the limiter turned down */
+	unsigned int crossfades;
+	uint64_t dsp_ns[DSP_STAGES];	/* time spent in each filter chain stage */
+	uint64_t dsp_audio_us;		/* audio run through the chain */
+	unsigned int pcm_calls;		/* ALSA calls that can enter the kernel */
+	unsigned int pcm_writes;
+	unsigned int wakeups;		/* writer threads woken by a device */
+	unsigned int fifo_waits;	/* output thread found the fifo empty */
+	uint64_t written_us;		/* audio written to the first zone */
+	unsigned int zone_skipped;	/* chunks a lagging zone skipped */
+} audio_stats_t;
+
+/*
+ * Tail of the PCM already handed to the device, kept so short rewinds
+ * don't need a reload. Only covers the track playing since the last
+ * seek: the ring starts over when the output thread gets to the first
+ * chunk of the next track.
+ */
+typedef struct audio_replay {
+	int16_t *buf;
+	size_t budget;		/* bytes */
+	int size;		/* capacity in frames */
+	int channels;
+	int rate;
+	int head;		/* next frame to write */
+	int fill;		/* frames held */
+	int complete;		/* nothing lost since the start of the track */
+	int next_complete;	/* complete, once the next track plays */
+	unsigned int track;	/* the frames held are from */
+	int64_t frame;		/* track frame after the newest held */
+} audio_replay_t;
+
+/*
+ * What the first zone's device is playing: its writer thread publishes
+ * the track and frame being heard after every write, and anyone can read
+ * it without a lock, see audio_clock_read(). seq is odd while it is
+ * written.
+ */
+typedef struct audio_clock {
+	unsigned int seq;
+	unsigned int track;
+	int64_t frame;		/* heard at ns */
+	int64_t ns;		/* CLOCK_MONOTONIC */
+	int rate;		/* 0 until something was heard */
+	int ahead;		/* frames the device still held at ns */
+} audio_clock_t;
+
+/*
+ * Running integrated loudness of the current track: mean square over
+ * 400 ms blocks, absolute gate at -70 dBFS and relative gate 10 dB
+ * below the ungated mean, as in ITU-R BS.1770 minus the K-weighting.
+ * Block energies are binned per dB so the gates can be applied at any
+ * time without keeping every block. The output thread measures what it
+ * plays, so the measurement moves on to the next track on its first
+ * chunk, not when it is delivered.
+ */
+#define AUDIO_LOUDNESS_BINS	70
+
+typedef struct audio_loudness {
+	uint64_t block;			/* sum of squares, current block */
+	int block_frames;
+	double energy[AUDIO_LOUDNESS_BINS];
+	unsigned int count[AUDIO_LOUDNESS_BINS];
+	int64_t frames;			/* frames measured */
+	int rate;
+	unsigned int track;		/* serial measured */
+} audio_loudness_t;
+
+/* Silence trimming state of the track being delivered, see trim.c */
+typedef struct audio_trim {
+	int threshold;			/* silence peak, 0 when off */
+	int lead;			/* still at the start of the track */
+	int lead_ms;			/* known leading silence, -1 to scan */
+	int64_t lead_frames;		/* dropped at the start, -1 after a seek */
+	int end_ms;			/* where the track ends, 0 at its end */
+	int fadein;			/* frames left to fade in */
+	int fadein_len;
+	int64_t tail_frames;		/* silence at the end of what was queued */
+	int ended;			/* end_ms reached */
+	int early;			/* 1 until audio_trim_ended() reports it */
+	int rate;
+} audio_trim_t;
+
 typedef struct audio_fifo {
-	TAILQ_HEAD(, audio_fifo_data) q;
+	TAILQ_HEAD(audio_fifo_q, audio_fifo_data) q;
 	int qlen;
+	unsigned int epoch;		/* bumped by every seek */
+	unsigned int track;		/* bumped for every track delivered */
+	struct timespec seek_time;
+	int rate;			/* format of the last queued chunk */
+	int channels;
+	int pos_ms;			/* track position at the last seek */
+	int64_t pos_frames;		/* frames queued since the last seek */
+	audio_stats_t stats;
+	audio_replay_t replay;
+	TAILQ_HEAD(, audio_fifo_data) prompt;	/* mixed on top of the music */
+	int prompt_len;
+	int prompt_off;			/* frames of the first prompt chunk played */
+	int duck_gain;			/* current music gain, Q12 */
+	int volume;			/* Q12 */
+	int norm_gain;			/* loudness normalization, Q12 */
+	int norm_next;			/* norm_gain from the first chunk of */
+	unsigned int norm_track;	/* this track on */
+	int speed_gain;			/* road noise compensation, Q12 */
+	int out_gain;			/* gain applied to the last chunk */
+	audio_loudness_t loudness;	/* of the track playing */
+	audio_loudness_t heard;		/* of the one before, until taken */
+	audio_fifo_data_t *xfade_chunk;	/* where the next track is mixed in */
+	int xfade_off;			/* frame offset in xfade_chunk */
+	int xfade_len;			/* crossfade length, frames */
+	int xfade_pos;			/* frames of the next track faded in */
+	dsp_chain_t *dsp_next;		/* picked up by the output thread */
+	int dsp_pending;
+	audio_trim_t trim;
+	audio_clock_t clock;
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
 } audio_fifo_t;
 
 
 /* --- Functions --- */
-extern void audio_init(audio_fifo_t *af);
+extern void audio_init(audio_fifo_t *af, const char *zones);
+extern void audio_set_output(audio_fifo_t *af, const char *dev, int period);
+extern int audio_output_switched(audio_fifo_t *af, char *dev, int len,
+                                 int *period);
+extern void audio_get_output(audio_fifo_t *af, char *dev, int len,
+                             int *period, int *buffer);
 extern void audio_fifo_flush(audio_fifo_t *af);
+extern void audio_fifo_seek(audio_fifo_t *af, int pos_ms);
+extern int audio_fifo_skip(audio_fifo_t *af, int ms);
+extern int audio_position_ms(audio_fifo_t *af);
+extern unsigned int audio_fifo_track(audio_fifo_t *af);
+extern int audio_clock_read(audio_fifo_t *af, unsigned int *track, int *ms);
+extern int audio_buffered_ms(audio_fifo_t *af);
+extern void audio_get_stats(audio_fifo_t *af, audio_stats_t *stats);
+extern void audio_set_dsp(audio_fifo_t *af, dsp_chain_t *chain);
 audio_fifo_data_t* audio_get(audio_fifo_t *af);
+extern int audio_pending(audio_fifo_t *af);
+
+/* replay.c, all called with af->mutex held except where noted */
+extern void audio_replay_set_budget(audio_fifo_t *af, size_t bytes); /* locks */
+extern void audio_replay_reset(audio_fifo_t *af, int complete);
+extern void audio_replay_push(audio_fifo_t *af, const audio_fifo_data_t *afd);
+extern int audio_replay_rewind(audio_fifo_t *af, int ms); /* locks */
+
+/* gain.c */
+extern void audio_set_volume(audio_fifo_t *af, int gain);
+extern void audio_set_norm_gain(audio_fifo_t *af, int gain);
+extern void audio_set_speed_gain(audio_fifo_t *af, int gain);
+extern int audio_loudness_get(audio_fifo_t *af, unsigned int *track,
+                              float *db, int *ms);
+extern void audio_gain_process(audio_fifo_t *af, audio_fifo_data_t *afd);
+
+/* xfade.c, all but audio_fifo_boundary called with af->mutex held */
+extern void audio_fifo_boundary(audio_fifo_t *af, int xfade_ms);
+extern void audio_xfade_cancel(audio_fifo_t *af);
+extern int audio_xfade_mix(audio_fifo_t *af, int rate, int channels,
+                           const int16_t *frames, int n);
+extern void audio_xfade_fadein(audio_fifo_t *af, audio_fifo_data_t *afd);
+
+/* trim.c, called with af->mutex held except where noted */
+extern void audio_trim_start(audio_fifo_t *af, int threshold, int lead_ms,
+                             int end_ms); /* locks */
+extern void audio_trim_cancel(audio_fifo_t *af);
+extern int audio_trim_input(audio_fifo_t *af, int rate, int channels,
+                            const int16_t **frames, int *n);
+extern void audio_trim_queued(audio_fifo_t *af, audio_fifo_data_t *afd);
+extern int audio_trim_tail(audio_fifo_t *af);
+extern int audio_trim_lead_ms(audio_fifo_t *af); /* locks */
+extern int audio_trim_ended(audio_fifo_t *af); /* locks */
+
+/* prompt.c */
+extern int audio_prompt_write(audio_fifo_t *af, const int16_t *samples,
+                              int nframes, int rate, int channels);
+extern int audio_prompt_active(audio_fifo_t *af);
+extern void audio_prompt_mix(audio_fifo_t *af, audio_fifo_data_t *afd, long delay);
 
 #endif /* _JUKEBOX_AUDIO_H_ */
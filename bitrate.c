@@ -0,0 +1,156 @@
+/*
+ * Streaming and offline sync bitrate policy, see bitrate.h.
+ */
+
+#include "bitrate.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/statvfs.h>
+
+static const int levels[BITRATE_LEVELS] = { 96, 160, 320 };
+
+static int level_of(int kbps)
+{
+	int i;
+
+	for (i = BITRATE_LEVELS - 1; i > 0; i--)
+		if (kbps >= levels[i])
+			return i;
+	return 0;
+}
+
+void bitrate_policy_init(struct bitrate_policy *p, int fixed_kbps)
+{
+	memset(p, 0, sizeof(*p));
+	p->fixed_kbps = fixed_kbps ? levels[level_of(fixed_kbps)] : 0;
+	p->cpu_busy = -1;
+	/* Nothing applied yet: the first update reports both as changed */
+	p->stream_kbps = p->offline_kbps = -1;
+}
+
+static int stream_level(struct bitrate_policy *p, const struct bitrate_inputs *in)
+{
+	int level = p->stream_kbps < 0 ? BITRATE_LEVELS - 1 :
+		    level_of(p->stream_kbps);
+	int xruns = in->xruns - p->xruns;
+
+	if (xruns > 0 || in->cpu_busy >= BITRATE_CPU_BUSY) {
+		p->calm_tracks = 0;
+		if (level > 0)
+			level--;
+	} else if (in->cpu_busy < BITRATE_CPU_CALM) {
+		if (++p->calm_tracks >= BITRATE_CALM_TRACKS &&
+		    level < BITRATE_LEVELS - 1) {
+			p->calm_tracks = 0;
+			level++;
+		}
+	} else {
+		p->calm_tracks = 0;
+	}
+
+	/* Streamed tracks are cached too */
+	if (in->cache_total &&
+	    in->cache_free * 100 < in->cache_total * BITRATE_CACHE_LOW &&
+	    level > 1)
+		level = 1;
+	return level;
+}
+
+static int offline_level(const struct bitrate_inputs *in)
+{
+	uint64_t reserve, room;
+	int level;
+
+	if (!in->cache_total)
+		return BITRATE_LEVELS - 1;
+
+	reserve = in->cache_total / 10;
+	if (reserve < (uint64_t)BITRATE_RESERVE_MB << 20)
+		reserve = (uint64_t)BITRATE_RESERVE_MB << 20;
+	room = in->cache_free > reserve ? in->cache_free - reserve : 0;
+
+	for (level = BITRATE_LEVELS - 1; level > 0; level--)
+		if (in->offline_ms * levels[level] / 8 <= room)
+			break;
+	return level;
+}
+
+/*
+ * Decide the bitrates from what was measured since the last update,
+ * normally at a track boundary. Returns which of them changed.
+ */
+int bitrate_policy_update(struct bitrate_policy *p,
+			  const struct bitrate_inputs *in)
+{
+	int stream, offline, changed = 0;
+
+	if (p->fixed_kbps) {
+		stream = offline = p->fixed_kbps;
+	} else {
+		stream = levels[stream_level(p, in)];
+		offline = levels[offline_level(in)];
+	}
+
+	if (stream != p->stream_kbps)
+		changed |= BITRATE_STREAM_CHANGED;
+	if (offline != p->offline_kbps)
+		changed |= BITRATE_OFFLINE_CHANGED;
+	if (changed && p->stream_kbps >= 0)
+		p->changes++;
+	p->stream_kbps = stream;
+	p->offline_kbps = offline;
+
+	p->xruns_last = in->xruns - p->xruns;
+	p->audio_us_last = in->audio_us - p->audio_us;
+	p->xruns = in->xruns;
+	p->audio_us = in->audio_us;
+	p->cpu_busy = in->cpu_busy;
+	p->cache_free = in->cache_free;
+	p->cache_total = in->cache_total;
+	p->offline_ms = in->offline_ms;
+	return changed;
+}
+
+/*
+ * Share of the time all CPUs were busy since the last call, in %, from
+ * /proc/stat. Returns -1 the first time, or if it can't be read.
+ */
+int bitrate_cpu_busy(void)
+{
+	static unsigned long long last_busy, last_total;
+	unsigned long long v[8], busy, total;
+	int i, ret = -1;
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) != 8) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	for (total = 0, i = 0; i < 8; i++)
+		total += v[i];
+	busy = total - v[3] - v[4];	/* less idle and iowait */
+	if (last_total && total > last_total)
+		ret = (busy - last_busy) * 100 / (total - last_total);
+	last_busy = busy;
+	last_total = total;
+	return ret;
+}
+
+/* Free and total bytes of the file system holding dir */
+int bitrate_cache_space(const char *dir, uint64_t *free_bytes,
+			uint64_t *total_bytes)
+{
+	struct statvfs s;
+
+	if (statvfs(dir, &s) < 0)
+		return -1;
+	*free_bytes = (uint64_t)s.f_bavail * s.f_frsize;
+	*total_bytes = (uint64_t)s.f_blocks * s.f_frsize;
+	return 0;
+}
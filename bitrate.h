@@ -0,0 +1,56 @@
+/*
+ * Streaming and offline sync bitrate policy.
+ *
+ * The player feeds it what it measured at each track boundary and applies
+ * whatever it decides before the next track loads. Streaming steps down
+ * a level after a track with xruns or a busy CPU, and back up after
+ * BITRATE_CALM_TRACKS calm ones. Offline sync gets the highest bitrate at
+ * which what is still to sync fits in the free cache space, less a
+ * reserve.
+ */
+#ifndef _SPOTIFY_BITRATE_H_
+#define _SPOTIFY_BITRATE_H_
+
+#include <stdint.h>
+
+#define BITRATE_LEVELS		3
+#define BITRATE_CALM_TRACKS	3	/* before streaming steps back up */
+#define BITRATE_CPU_BUSY	90	/* % busy that steps streaming down */
+#define BITRATE_CPU_CALM	70	/* % busy below which a track is calm */
+#define BITRATE_CACHE_LOW	10	/* % free that caps streaming at 160k */
+#define BITRATE_RESERVE_MB	256	/* cache space never planned for sync */
+
+/* Bits returned by bitrate_policy_update() */
+#define BITRATE_STREAM_CHANGED	0x1
+#define BITRATE_OFFLINE_CHANGED	0x2
+
+struct bitrate_inputs {
+	unsigned int xruns;		/* since the start */
+	uint64_t audio_us;		/* played since the start */
+	int cpu_busy;			/* % since the last update, -1 unknown */
+	uint64_t cache_free;		/* bytes, 0 with cache_total unknown */
+	uint64_t cache_total;
+	uint64_t offline_ms;		/* of playlist music still to sync */
+};
+
+struct bitrate_policy {
+	int fixed_kbps;			/* 0 for the adaptive policy */
+	int stream_kbps;
+	int offline_kbps;
+	int calm_tracks;
+	unsigned int changes;
+	/* What the last decision was based on, for the stats */
+	unsigned int xruns, xruns_last;
+	uint64_t audio_us, audio_us_last;
+	int cpu_busy;
+	uint64_t cache_free, cache_total, offline_ms;
+};
+
+extern void bitrate_policy_init(struct bitrate_policy *p, int fixed_kbps);
+extern int bitrate_policy_update(struct bitrate_policy *p,
+				 const struct bitrate_inputs *in);
+extern int bitrate_cpu_busy(void);
+extern int bitrate_cache_space(const char *dir, uint64_t *free_bytes,
+			       uint64_t *total_bytes);
+
+#endif /* _SPOTIFY_BITRATE_H_ */
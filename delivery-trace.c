@@ -0,0 +1,277 @@
+/*
+ * Recording and reading of delivery traces, see delivery-trace.h.
+ *
+ * Records come from libspotify's delivery thread and from the main loop.
+ * They are only copied into a ring under a lock there; a writer thread
+ * of its own takes them out to the file, and flushes it at least once a
+ * second, so neither a slow disk nor a crash costs much. Recording is
+ * opt-in and meant for chasing a problem: a trace with PCM grows by
+ * about 10 MB a minute. Records that don't fit in the ring because the
+ * disk can't keep up are dropped and counted in a DELIVERY_TRACE_LOST
+ * record.
+ */
+
+#include "delivery-trace.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Records on their way to the file, over 20 s of PCM */
+#define TRACE_RING	(4 << 20)
+/* The writer wakes up once this much is in the ring, or every second */
+#define TRACE_WAKE	(256 << 10)
+#define TRACE_FLUSH_MS	1000
+
+int delivery_trace_active;
+
+/* Guards the ring and delivery_trace_active */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_ready = PTHREAD_COND_INITIALIZER;
+/* Held while the file is written */
+static pthread_mutex_t trace_io = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace;
+static int trace_pcm;
+static int64_t trace_start_us;
+static char *ring;
+static uint64_t ring_head, ring_tail;	/* bytes ever put in and taken out */
+static unsigned int ring_lost;		/* records dropped since the last */
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Called with trace_lock held and room for size */
+static void ring_put(const void *p, size_t size)
+{
+	size_t off = ring_head % TRACE_RING;
+	size_t part = TRACE_RING - off < size ? TRACE_RING - off : size;
+
+	memcpy(ring + off, p, part);
+	memcpy(ring, (const char *)p + part, size - part);
+	ring_head += size;
+}
+
+/*
+ * Write what is in the ring, and a DELIVERY_TRACE_LOST record if some
+ * didn't fit, then flush. Called with trace_io held. Returns -1 if the
+ * file can't be written.
+ */
+static int trace_drain(void)
+{
+	struct delivery_trace_record rec = { .type = DELIVERY_TRACE_LOST };
+	uint64_t head, tail;
+	size_t off, len;
+	unsigned int lost;
+
+	pthread_mutex_lock(&trace_lock);
+	head = ring_head;
+	tail = ring_tail;
+	lost = ring_lost;
+	ring_lost = 0;
+	pthread_mutex_unlock(&trace_lock);
+
+	while (tail < head) {
+		off = tail % TRACE_RING;
+		len = TRACE_RING - off < head - tail ? TRACE_RING - off :
+						       head - tail;
+		if (fwrite(ring + off, len, 1, trace) != 1)
+			return -1;
+		tail += len;
+		pthread_mutex_lock(&trace_lock);
+		ring_tail = tail;
+		pthread_mutex_unlock(&trace_lock);
+	}
+	if (lost) {
+		rec.t_us = now_us() - trace_start_us;
+		rec.arg = lost;
+		if (fwrite(&rec, sizeof(rec), 1, trace) != 1)
+			return -1;
+	}
+	return fflush(trace) ? -1 : 0;
+}
+
+static void *trace_writer(void *arg)
+{
+	struct timespec until;
+	int ret;
+
+	for (;;) {
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += TRACE_FLUSH_MS % 1000 * 1000000L;
+		until.tv_sec += TRACE_FLUSH_MS / 1000 + until.tv_nsec / 1000000000;
+		until.tv_nsec %= 1000000000;
+
+		pthread_mutex_lock(&trace_lock);
+		if (ring_head - ring_tail < TRACE_WAKE)
+			pthread_cond_timedwait(&trace_ready, &trace_lock, &until);
+		pthread_mutex_unlock(&trace_lock);
+
+		pthread_mutex_lock(&trace_io);
+		ret = trace_drain();
+		if (ret) {
+			/* Disk full or gone: stop rather than leave a torn trace */
+			pthread_mutex_lock(&trace_lock);
+			delivery_trace_active = 0;
+			pthread_mutex_unlock(&trace_lock);
+			fclose(trace);
+			trace = NULL;
+		}
+		pthread_mutex_unlock(&trace_io);
+		if (ret)
+			return NULL;
+	}
+}
+
+/* Write out what the writer hasn't yet when the process exits */
+static void trace_exit(void)
+{
+	pthread_mutex_lock(&trace_io);
+	if (trace)
+		trace_drain();
+	pthread_mutex_unlock(&trace_io);
+}
+
+/*
+ * Start recording to path, with the delivered frames if pcm is set.
+ * Returns -1 if the file can't be created.
+ */
+int delivery_trace_start(const char *path, int pcm)
+{
+	struct delivery_trace_header h = {
+		.magic = DELIVERY_TRACE_MAGIC,
+		.version = DELIVERY_TRACE_VERSION,
+		.flags = pcm ? DELIVERY_TRACE_PCM : 0,
+	};
+	pthread_t tid;
+
+	ring = malloc(TRACE_RING);
+	if (!ring)
+		return -1;
+	trace = fopen(path, "wb");
+	if (!trace)
+		goto fail;
+	if (fwrite(&h, sizeof(h), 1, trace) != 1)
+		goto fail_close;
+	trace_pcm = pcm;
+	trace_start_us = now_us();
+	if (pthread_create(&tid, NULL, trace_writer, NULL))
+		goto fail_close;
+	pthread_detach(tid);
+	atexit(trace_exit);
+	delivery_trace_active = 1;
+	return 0;
+
+fail_close:
+	fclose(trace);
+	trace = NULL;
+fail:
+	free(ring);
+	ring = NULL;
+	return -1;
+}
+
+/* Copy a record and its frames into the ring, never waiting for the disk */
+static void trace_write(struct delivery_trace_record *rec,
+			const void *pcm, size_t size)
+{
+	int64_t t_us = now_us();
+	uint64_t fill;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!delivery_trace_active) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	fill = ring_head - ring_tail;
+	if (fill + sizeof(*rec) + size > TRACE_RING) {
+		ring_lost++;
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	rec->t_us = t_us - trace_start_us;
+	ring_put(rec, sizeof(*rec));
+	if (size)
+		ring_put(pcm, size);
+	if (fill < TRACE_WAKE && ring_head - ring_tail >= TRACE_WAKE)
+		pthread_cond_signal(&trace_ready);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/* Record a music_delivery call, from libspotify's thread */
+void delivery_trace_music(int rate, int channels, const void *frames,
+			  int num_frames, int accepted)
+{
+	struct delivery_trace_record rec = {
+		.type = DELIVERY_TRACE_MUSIC,
+		.channels = channels,
+		.arg = num_frames,
+		.accepted = accepted,
+		.rate = rate,
+	};
+
+	trace_write(&rec, frames, trace_pcm ?
+		    (size_t)num_frames * channels * sizeof(int16_t) : 0);
+}
+
+void delivery_trace_event(enum delivery_trace_type type, int arg)
+{
+	struct delivery_trace_record rec = {
+		.type = type,
+		.arg = arg,
+	};
+
+	trace_write(&rec, NULL, 0);
+}
+
+/*
+ * Open a trace for reading and return its header flags. Returns NULL if
+ * path isn't a trace we can read.
+ */
+FILE *delivery_trace_open(const char *path, uint32_t *flags)
+{
+	struct delivery_trace_header h;
+	FILE *f = fopen(path, "rb");
+
+	if (!f)
+		return NULL;
+	if (fread(&h, sizeof(h), 1, f) != 1 ||
+	    h.magic != DELIVERY_TRACE_MAGIC ||
+	    h.version != DELIVERY_TRACE_VERSION) {
+		fclose(f);
+		return NULL;
+	}
+	*flags = h.flags;
+	return f;
+}
+
+/*
+ * Read the next record, and its frames into *pcm (grown as needed) if
+ * the trace holds PCM. Returns -1 at the end of the trace.
+ */
+int delivery_trace_read(FILE *f, uint32_t flags,
+			struct delivery_trace_record *rec,
+			void **pcm, size_t *pcm_size)
+{
+	size_t size;
+	void *p;
+
+	if (fread(rec, sizeof(*rec), 1, f) != 1)
+		return -1;
+	if (rec->type != DELIVERY_TRACE_MUSIC || !(flags & DELIVERY_TRACE_PCM))
+		return 0;
+
+	size = (size_t)rec->arg * rec->channels * sizeof(int16_t);
+	if (size > *pcm_size) {
+		p = realloc(*pcm, size);
+		if (!p)
+			return -1;
+		*pcm = p;
+		*pcm_size = size;
+	}
+	return size && fread(*pcm, size, 1, f) != 1 ? -1 : 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Traces of what libspotify delivered, to replay field issues on a dev box.
+ *
+ * A trace is a struct delivery_trace_header followed by records, all in
+ * host byte order. Each music_delivery call is recorded with its time,
+ * format, frame count and how many frames the player took, followed by
+ * the frames themselves when the trace holds PCM. The main loop's own
+ * changes to the fifo (flushes on track changes, seeks, end of track)
+ * are recorded too, so a replay sees the fifo go through the same states.
+ */
+#ifndef _SPOTIFY_DELIVERY_TRACE_H_
+#define _SPOTIFY_DELIVERY_TRACE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DELIVERY_TRACE_MAGIC	0x54445053	/* "SPDT" */
+#define DELIVERY_TRACE_VERSION	1
+#define DELIVERY_TRACE_PCM	0x1		/* header flag */
+
+enum delivery_trace_type {
+	DELIVERY_TRACE_MUSIC,		/* frames offered, accepted taken */
+	DELIVERY_TRACE_FLUSH,		/* fifo flushed for another track */
+	DELIVERY_TRACE_SEEK,		/* to arg ms, through libspotify */
+	DELIVERY_TRACE_SKIP,		/* arg ms forward, within the fifo */
+	DELIVERY_TRACE_END_OF_TRACK,	/* with a crossfade of arg ms */
+	DELIVERY_TRACE_LOST		/* arg records the disk couldn't take */
+};
+
+struct delivery_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct delivery_trace_record {
+	int64_t t_us;			/* since the trace started */
+	uint16_t type;
+	uint16_t channels;		/* only set for music */
+	int32_t arg;			/* frames offered, or per type */
+	int32_t accepted;
+	uint32_t rate;			/* only set for music */
+};
+
+extern int delivery_trace_active;
+
+extern int delivery_trace_start(const char *path, int pcm);
+extern void delivery_trace_music(int rate, int channels, const void *frames,
+				 int num_frames, int accepted);
+extern void delivery_trace_event(enum delivery_trace_type type, int arg);
+
+extern FILE *delivery_trace_open(const char *path, uint32_t *flags);
+extern int delivery_trace_read(FILE *f, uint32_t flags,
+			       struct delivery_trace_record *rec,
+			       void **pcm, size_t *pcm_size);
+
+#endif /* _SPOTIFY_DELIVERY_TRACE_H_ */
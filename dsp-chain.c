@@ -0,0 +1,382 @@
+/*
+ * Output filter chain.
+ *
+ * Samples are converted to float a block at a time into frames padded
+ * to four lanes, so every stage handles all channels of a frame with
+ * one vector operation. The vectors use the GCC vector extension,
+ * which turns into SSE or NEON where available and plain scalar code
+ * elsewhere.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dsp.h"
+
+typedef float v4f __attribute__((vector_size(16)));
+typedef int32_t v4i __attribute__((vector_size(16)));
+
+/* Limiter gain recovery per second, in dB */
+#define LIMITER_RELEASE_DB	20.0f
+/* Filter state below this is flushed to avoid denormals */
+#define DENORMAL_LIMIT		1e-15f
+
+typedef struct dsp_biquad {
+	float b0, b1, b2, a1, a2;
+	v4f z1, z2;
+} dsp_biquad_t;
+
+struct dsp_chain {
+	dsp_chain_cfg_t cfg;
+	int rate;
+	int channels;
+	dsp_biquad_t biquad[DSP_CHAIN_BIQUADS];
+	v4f balance;
+	float limit;		/* ceiling, linear */
+	float lim_gain;
+	float lim_release;	/* per block */
+	v4f buf[DSP_CHAIN_BLOCK];
+};
+
+static const struct {
+	const char *name;
+	enum dsp_filter type;
+} filter_names[] = {
+	{ "peak", DSP_PEAK },
+	{ "lowshelf", DSP_LOWSHELF },
+	{ "highshelf", DSP_HIGHSHELF },
+	{ "lowpass", DSP_LOWPASS },
+	{ "highpass", DSP_HIGHPASS },
+};
+
+/*
+ * Parse ":number" at *p with g_ascii_strtod, which unlike sscanf takes
+ * a decimal point whatever the locale. Returns 1 and moves *p past it,
+ * 0 if there is no field, -1 if it isn't a number.
+ */
+static int eq_field(const char **p, float *v)
+{
+	char *end;
+
+	if (**p != ':')
+		return 0;
+	*v = g_ascii_strtod(*p + 1, &end);
+	if (end == *p + 1)
+		return -1;
+	*p = end;
+	return 1;
+}
+
+/*
+ * Parse "type:freq[:gain[:q]],..." into cfg->biquad, e.g.
+ * "lowshelf:120:4,peak:2500:-3:1.4,highpass:40". Returns -1 on a
+ * malformed entry; entries before it are kept.
+ */
+int dsp_chain_parse_eq(dsp_chain_cfg_t *cfg, const char *spec)
+{
+	char name[16];
+	float freq, gain, q;
+	int i, len;
+
+	cfg->nbiquads = 0;
+
+	while (*spec && cfg->nbiquads < DSP_CHAIN_BIQUADS) {
+		gain = 0;
+		q = 0.707f;
+		len = strspn(spec, "abcdefghijklmnopqrstuvwxyz");
+		if (!len || len >= (int)sizeof(name))
+			return -1;
+		memcpy(name, spec, len);
+		name[len] = 0;
+		spec += len;
+		if (eq_field(&spec, &freq) != 1 ||
+		    (eq_field(&spec, &gain) == 1 && eq_field(&spec, &q) < 0) ||
+		    freq <= 0 || q <= 0)
+			return -1;
+
+		for (i = 0; i < (int)(sizeof(filter_names) / sizeof(filter_names[0])); i++)
+			if (!strcmp(name, filter_names[i].name))
+				break;
+		if (i == sizeof(filter_names) / sizeof(filter_names[0]))
+			return -1;
+
+		cfg->biquad[cfg->nbiquads].type = filter_names[i].type;
+		cfg->biquad[cfg->nbiquads].freq = freq;
+		cfg->biquad[cfg->nbiquads].gain_db = gain;
+		cfg->biquad[cfg->nbiquads].q = q;
+		cfg->nbiquads++;
+
+		if (*spec == ',')
+			spec++;
+		else if (*spec)
+			return -1;
+	}
+	return 0;
+}
+
+/* RBJ audio EQ cookbook coefficients */
+static void biquad_design(dsp_biquad_t *bq, const dsp_biquad_cfg_t *cfg, int rate)
+{
+	double A = pow(10.0, cfg->gain_db / 40.0);
+	double w0 = 2 * M_PI * cfg->freq / rate;
+	double cw = cos(w0);
+	double alpha = sin(w0) / (2 * cfg->q);
+	double sa = 2 * sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+
+	switch (cfg->type) {
+	case DSP_PEAK:
+		b0 = 1 + alpha * A;
+		b1 = -2 * cw;
+		b2 = 1 - alpha * A;
+		a0 = 1 + alpha / A;
+		a1 = -2 * cw;
+		a2 = 1 - alpha / A;
+		break;
+	case DSP_LOWSHELF:
+		b0 = A * ((A + 1) - (A - 1) * cw + sa);
+		b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+		b2 = A * ((A + 1) - (A - 1) * cw - sa);
+		a0 = (A + 1) + (A - 1) * cw + sa;
+		a1 = -2 * ((A - 1) + (A + 1) * cw);
+		a2 = (A + 1) + (A - 1) * cw - sa;
+		break;
+	case DSP_HIGHSHELF:
+		b0 = A * ((A + 1) + (A - 1) * cw + sa);
+		b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+		b2 = A * ((A + 1) + (A - 1) * cw - sa);
+		a0 = (A + 1) - (A - 1) * cw + sa;
+		a1 = 2 * ((A - 1) - (A + 1) * cw);
+		a2 = (A + 1) - (A - 1) * cw - sa;
+		break;
+	case DSP_LOWPASS:
+		b0 = (1 - cw) / 2;
+		b1 = 1 - cw;
+		b2 = (1 - cw) / 2;
+		a0 = 1 + alpha;
+		a1 = -2 * cw;
+		a2 = 1 - alpha;
+		break;
+	case DSP_HIGHPASS:
+	default:
+		b0 = (1 + cw) / 2;
+		b1 = -(1 + cw);
+		b2 = (1 + cw) / 2;
+		a0 = 1 + alpha;
+		a1 = -2 * cw;
+		a2 = 1 - alpha;
+		break;
+	}
+
+	bq->b0 = b0 / a0;
+	bq->b1 = b1 / a0;
+	bq->b2 = b2 / a0;
+	bq->a1 = a1 / a0;
+	bq->a2 = a2 / a0;
+	memset(&bq->z1, 0, sizeof(bq->z1));
+	memset(&bq->z2, 0, sizeof(bq->z2));
+}
+
+/* (Re)derive everything that depends on the stream format */
+static void chain_setup(dsp_chain_t *c, int rate, int channels)
+{
+	float l = 1, r = 1, front = 1, rear = 1;
+	float g[DSP_CHAIN_CHANNELS];
+	int i;
+
+	c->rate = rate;
+	c->channels = channels;
+
+	for (i = 0; i < c->cfg.nbiquads; i++)
+		biquad_design(&c->biquad[i], &c->cfg.biquad[i], rate);
+
+	/* Attenuate the far side only, so the centre setting is unity */
+	if (c->cfg.balance > 0)
+		l = 1 - c->cfg.balance;
+	else
+		r = 1 + c->cfg.balance;
+	if (c->cfg.fader > 0)
+		front = 1 - c->cfg.fader;
+	else
+		rear = 1 + c->cfg.fader;
+
+	/* ALSA channel order: FL FR RL RR */
+	g[0] = l * (channels == 4 ? front : 1);
+	g[1] = r * (channels == 4 ? front : 1);
+	g[2] = l * rear;
+	g[3] = r * rear;
+	if (channels == 1)
+		g[0] = 1;
+	c->balance = (v4f){ g[0], g[1], g[2], g[3] };
+
+	c->limit = c->cfg.limit_db ? powf(10.0f, c->cfg.limit_db / 20.0f) * 32767.0f : 0;
+	c->lim_gain = 1;
+	c->lim_release = powf(10.0f, LIMITER_RELEASE_DB * DSP_CHAIN_BLOCK / rate / 20.0f);
+}
+
+dsp_chain_t *dsp_chain_new(const dsp_chain_cfg_t *cfg)
+{
+	dsp_chain_t *c = calloc(1, sizeof(*c));
+
+	if (!c)
+		return NULL;
+	c->cfg = *cfg;
+	return c;
+}
+
+void dsp_chain_free(dsp_chain_t *c)
+{
+	free(c);
+}
+
+static void block_load(v4f *dst, const int16_t *src, int frames, int channels)
+{
+	int i, k;
+
+	memset(dst, 0, frames * sizeof(*dst));
+	for (i = 0; i < frames; i++)
+		for (k = 0; k < channels; k++)
+			dst[i][k] = src[i * channels + k];
+}
+
+static void block_store(int16_t *dst, const v4f *src, int frames, int channels)
+{
+	float v;
+	int i, k;
+
+	for (i = 0; i < frames; i++) {
+		for (k = 0; k < channels; k++) {
+			v = src[i][k];
+			if (v > INT16_MAX)
+				v = INT16_MAX;
+			if (v < INT16_MIN)
+				v = INT16_MIN;
+			dst[i * channels + k] = lrintf(v);
+		}
+	}
+}
+
+/* Transposed direct form II, one channel per lane */
+static void block_biquad(dsp_biquad_t *bq, v4f *buf, int frames)
+{
+	v4f z1 = bq->z1, z2 = bq->z2, x, y;
+	float b0 = bq->b0, b1 = bq->b1, b2 = bq->b2, a1 = bq->a1, a2 = bq->a2;
+	int i, k;
+
+	for (i = 0; i < frames; i++) {
+		x = buf[i];
+		y = b0 * x + z1;
+		z1 = b1 * x - a1 * y + z2;
+		z2 = b2 * x - a2 * y;
+		buf[i] = y;
+	}
+
+	for (k = 0; k < DSP_CHAIN_CHANNELS; k++) {
+		if (fabsf(z1[k]) < DENORMAL_LIMIT)
+			z1[k] = 0;
+		if (fabsf(z2[k]) < DENORMAL_LIMIT)
+			z2[k] = 0;
+	}
+	bq->z1 = z1;
+	bq->z2 = z2;
+}
+
+static void block_gain(v4f *buf, int frames, v4f g)
+{
+	int i;
+
+	for (i = 0; i < frames; i++)
+		buf[i] *= g;
+}
+
+/*
+ * Block peak limiter: the gain drops at once for a block that would go
+ * over the ceiling and recovers at LIMITER_RELEASE_DB per second,
+ * ramped across each block.
+ */
+static void block_limit(dsp_chain_t *c, v4f *buf, int frames)
+{
+	const v4i abs_mask = { INT32_MAX, INT32_MAX, INT32_MAX, INT32_MAX };
+	v4f m = { 0, 0, 0, 0 }, a;
+	v4i gt;
+	float peak = 0, target, g, step;
+	int i, k;
+
+	for (i = 0; i < frames; i++) {
+		a = (v4f)((v4i)buf[i] & abs_mask);
+		gt = a > m;
+		m = (v4f)((gt & (v4i)a) | (~gt & (v4i)m));
+	}
+	for (k = 0; k < DSP_CHAIN_CHANNELS; k++)
+		if (m[k] > peak)
+			peak = m[k];
+
+	target = c->lim_gain * c->lim_release;
+	if (target > 1)
+		target = 1;
+	if (peak * target > c->limit) {
+		c->lim_gain = target = c->limit / peak;
+		block_gain(buf, frames, (v4f){ target, target, target, target });
+		return;
+	}
+
+	g = c->lim_gain;
+	if (g == 1 && target == 1)
+		return;
+	step = (target - g) / frames;
+	for (i = 0; i < frames; i++, g += step)
+		buf[i] *= (v4f){ g, g, g, g };
+	c->lim_gain = target;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Run the chain over frames in place. Time spent in each stage is added
+ * to ns[]; the conversions count towards the EQ.
+ */
+void dsp_chain_process(dsp_chain_t *c, int16_t *samples, int frames,
+                       int rate, int channels, uint64_t ns[DSP_STAGES])
+{
+	uint64_t t0, t1;
+	int done, len, i;
+
+	if (channels > DSP_CHAIN_CHANNELS)
+		return;
+	if (rate != c->rate || channels != c->channels)
+		chain_setup(c, rate, channels);
+
+	for (done = 0; done < frames; done += len) {
+		len = frames - done;
+		if (len > DSP_CHAIN_BLOCK)
+			len = DSP_CHAIN_BLOCK;
+
+		t0 = now_ns();
+		block_load(c->buf, samples + done * channels, len, channels);
+		for (i = 0; i < c->cfg.nbiquads; i++)
+			block_biquad(&c->biquad[i], c->buf, len);
+
+		t1 = now_ns();
+		ns[DSP_STAGE_EQ] += t1 - t0;
+		t0 = t1;
+		block_gain(c->buf, len, c->balance);
+
+		t1 = now_ns();
+		ns[DSP_STAGE_BALANCE] += t1 - t0;
+		t0 = t1;
+		if (c->limit)
+			block_limit(c, c->buf, len);
+		block_store(samples + done * channels, c->buf, len, channels);
+
+		ns[DSP_STAGE_LIMITER] += now_ns() - t0;
+	}
+}
@@ -0,0 +1,279 @@
+/*
+ * Sample processing kernels, with SSE2 and NEON versions of the inner
+ * loops and a plain C fallback for everything else.
+ */
+
+#include <math.h>
+#include "dsp.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DSP_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DSP_NEON 1
+#endif
+
+static inline int16_t sat16(int32_t v)
+{
+	if (v > INT16_MAX)
+		return INT16_MAX;
+	if (v < INT16_MIN)
+		return INT16_MIN;
+	return v;
+}
+
+int dsp_gain_from_db(float db)
+{
+	float g = powf(10.0f, db / 20.0f) * DSP_UNITY;
+
+	if (g > DSP_GAIN_MAX)
+		return DSP_GAIN_MAX;
+	if (g < 0)
+		return 0;
+	return (int)(g + 0.5f);
+}
+
+/* dst[i] = sat(dst[i] + src[i]) */
+void dsp_mix_s16(int16_t *dst, const int16_t *src, int n)
+{
+	int i = 0;
+
+#if defined(DSP_SSE2)
+	for (; i + 8 <= n; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+	}
+#elif defined(DSP_NEON)
+	for (; i + 8 <= n; i += 8)
+		vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+#endif
+
+	for (; i < n; i++)
+		dst[i] = sat16((int32_t)dst[i] + src[i]);
+}
+
+/* buf[i] = sat(buf[i] * gain), gain in Q12 */
+void dsp_gain_s16(int16_t *buf, int n, int gain)
+{
+	int i = 0;
+
+	if (gain == DSP_UNITY)
+		return;
+
+#if defined(DSP_SSE2)
+	{
+		const __m128i g = _mm_set1_epi16(gain);
+		const __m128i round = _mm_set1_epi32(1 << (DSP_GAIN_SHIFT - 1));
+
+		for (; i + 8 <= n; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+			__m128i lo = _mm_mullo_epi16(x, g);
+			__m128i hi = _mm_mulhi_epi16(x, g);
+			__m128i p0 = _mm_unpacklo_epi16(lo, hi);
+			__m128i p1 = _mm_unpackhi_epi16(lo, hi);
+
+			p0 = _mm_srai_epi32(_mm_add_epi32(p0, round), DSP_GAIN_SHIFT);
+			p1 = _mm_srai_epi32(_mm_add_epi32(p1, round), DSP_GAIN_SHIFT);
+			_mm_storeu_si128((__m128i *)(buf + i), _mm_packs_epi32(p0, p1));
+		}
+	}
+#elif defined(DSP_NEON)
+	{
+		const int16x4_t g = vdup_n_s16(gain);
+
+		for (; i + 8 <= n; i += 8) {
+			int16x8_t x = vld1q_s16(buf + i);
+			int32x4_t p0 = vmull_s16(vget_low_s16(x), g);
+			int32x4_t p1 = vmull_s16(vget_high_s16(x), g);
+
+			vst1q_s16(buf + i, vcombine_s16(vqrshrn_n_s32(p0, DSP_GAIN_SHIFT),
+			                                vqrshrn_n_s32(p1, DSP_GAIN_SHIFT)));
+		}
+	}
+#endif
+
+	for (; i < n; i++)
+		buf[i] = sat16(((int32_t)buf[i] * gain + (1 << (DSP_GAIN_SHIFT - 1))) >> DSP_GAIN_SHIFT);
+}
+
+/*
+ * Linear gain ramp from g0 to g1 over frames. The gain is held for
+ * DSP_RAMP_BLOCK frames at a time, which is inaudible and lets every
+ * block go through dsp_gain_s16.
+ */
+void dsp_ramp_s16(int16_t *buf, int frames, int channels, int g0, int g1)
+{
+	int done, len, g;
+
+	if (g0 == g1) {
+		dsp_gain_s16(buf, frames * channels, g0);
+		return;
+	}
+
+	for (done = 0; done < frames; done += len) {
+		len = frames - done;
+		if (len > DSP_RAMP_BLOCK)
+			len = DSP_RAMP_BLOCK;
+		g = g0 + (int64_t)(g1 - g0) * (done + len) / frames;
+		dsp_gain_s16(buf + done * channels, len * channels, g);
+	}
+}
+
+/* max |buf[i]|, with |INT16_MIN| reported as INT16_MAX */
+int dsp_peak_s16(const int16_t *buf, int n)
+{
+	int i = 0, peak = 0, v;
+
+#if defined(DSP_SSE2)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i m = zero;
+		int16_t lanes[8];
+		int k;
+
+		for (; i + 8 <= n; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+			m = _mm_max_epi16(m, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+		}
+		_mm_storeu_si128((__m128i *)lanes, m);
+		for (k = 0; k < 8; k++)
+			if (lanes[k] > peak)
+				peak = lanes[k];
+	}
+#elif defined(DSP_NEON)
+	{
+		int16x8_t m = vdupq_n_s16(0);
+		int16_t lanes[8];
+		int k;
+
+		for (; i + 8 <= n; i += 8)
+			m = vmaxq_s16(m, vqabsq_s16(vld1q_s16(buf + i)));
+		vst1q_s16(lanes, m);
+		for (k = 0; k < 8; k++)
+			if (lanes[k] > peak)
+				peak = lanes[k];
+	}
+#endif
+
+	for (; i < n; i++) {
+		v = buf[i] < 0 ? -buf[i] : buf[i];
+		if (v > peak)
+			peak = v;
+	}
+	return peak > INT16_MAX ? INT16_MAX : peak;
+}
+
+#if defined(DSP_SSE2)
+/* Nonzero if any |x| in the 8 samples at p exceeds thr */
+static inline int loud8(const int16_t *p, __m128i thr)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i x = _mm_loadu_si128((const __m128i *)p);
+
+	x = _mm_max_epi16(x, _mm_subs_epi16(zero, x));
+	return _mm_movemask_epi8(_mm_cmpgt_epi16(x, thr));
+}
+#elif defined(DSP_NEON)
+static inline int loud8(const int16_t *p, int16x8_t thr)
+{
+	uint16x8_t m = vcgtq_s16(vqabsq_s16(vld1q_s16(p)), thr);
+	uint16x4_t r = vorr_u16(vget_low_u16(m), vget_high_u16(m));
+
+	return vget_lane_u64(vreinterpret_u64_u16(r), 0) != 0;
+}
+#endif
+
+static inline int loud(int16_t v, int thr)
+{
+	return (v < 0 ? -v : v) > thr;
+}
+
+/* Index of the first sample louder than thr, n if there is none */
+int dsp_first_loud_s16(const int16_t *buf, int n, int thr)
+{
+	int i = 0;
+
+#if defined(DSP_SSE2)
+	const __m128i t = _mm_set1_epi16(thr);
+
+	while (i + 8 <= n && !loud8(buf + i, t))
+		i += 8;
+#elif defined(DSP_NEON)
+	const int16x8_t t = vdupq_n_s16(thr);
+
+	while (i + 8 <= n && !loud8(buf + i, t))
+		i += 8;
+#endif
+
+	for (; i < n; i++)
+		if (loud(buf[i], thr))
+			break;
+	return i;
+}
+
+/* One past the last sample louder than thr, 0 if there is none */
+int dsp_last_loud_s16(const int16_t *buf, int n, int thr)
+{
+	int i = n;
+
+#if defined(DSP_SSE2)
+	const __m128i t = _mm_set1_epi16(thr);
+
+	while (i >= 8 && !loud8(buf + i - 8, t))
+		i -= 8;
+#elif defined(DSP_NEON)
+	const int16x8_t t = vdupq_n_s16(thr);
+
+	while (i >= 8 && !loud8(buf + i - 8, t))
+		i -= 8;
+#endif
+
+	for (; i > 0; i--)
+		if (loud(buf[i - 1], thr))
+			break;
+	return i;
+}
+
+/* sum of buf[i]^2 */
+uint64_t dsp_sumsq_s16(const int16_t *buf, int n)
+{
+	uint64_t sum = 0;
+	int i = 0;
+
+#if defined(DSP_SSE2)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i acc = zero;
+		uint64_t lanes[2];
+
+		for (; i + 8 <= n; i += 8) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+			/* pairwise sums fit in 32 bits when read as unsigned */
+			__m128i p = _mm_madd_epi16(x, x);
+
+			acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(p, zero));
+			acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(p, zero));
+		}
+		_mm_storeu_si128((__m128i *)lanes, acc);
+		sum = lanes[0] + lanes[1];
+	}
+#elif defined(DSP_NEON)
+	{
+		int64x2_t acc = vdupq_n_s64(0);
+
+		for (; i + 8 <= n; i += 8) {
+			int16x8_t x = vld1q_s16(buf + i);
+
+			acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(x), vget_low_s16(x)));
+			acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(x), vget_high_s16(x)));
+		}
+		sum = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+	}
+#endif
+
+	for (; i < n; i++)
+		sum += (int32_t)buf[i] * buf[i];
+	return sum;
+}
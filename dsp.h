@@ -0,0 +1,76 @@
+/*
+ * Sample processing kernels.
+ *
+ * All kernels work in place on interleaved native-endian int16 frames
+ * and saturate instead of wrapping. Gains are Q12 fixed point, so
+ * DSP_UNITY is 0 dB and the largest gain is just under +18 dB.
+ */
+#ifndef _SPOTIFY_DSP_H_
+#define _SPOTIFY_DSP_H_
+
+#include <stdint.h>
+
+#define DSP_GAIN_SHIFT	12
+#define DSP_UNITY	(1 << DSP_GAIN_SHIFT)
+#define DSP_GAIN_MAX	INT16_MAX
+
+/* Frames per gain step in dsp_ramp_s16 */
+#define DSP_RAMP_BLOCK	32
+
+extern int dsp_gain_from_db(float db);
+extern void dsp_mix_s16(int16_t *dst, const int16_t *src, int n);
+extern void dsp_gain_s16(int16_t *buf, int n, int gain);
+extern void dsp_ramp_s16(int16_t *buf, int frames, int channels, int g0, int g1);
+extern int dsp_peak_s16(const int16_t *buf, int n);
+extern uint64_t dsp_sumsq_s16(const int16_t *buf, int n);
+extern int dsp_first_loud_s16(const int16_t *buf, int n, int thr);
+extern int dsp_last_loud_s16(const int16_t *buf, int n, int thr);
+
+/*
+ * Filter chain run on the output: biquads, then balance/fader, then a
+ * limiter. It works on blocks of DSP_CHAIN_BLOCK frames converted to
+ * float, with up to four channels processed side by side in one vector.
+ */
+#define DSP_CHAIN_BLOCK		256
+#define DSP_CHAIN_BIQUADS	8
+#define DSP_CHAIN_CHANNELS	4
+
+enum dsp_stage {
+	DSP_STAGE_EQ,
+	DSP_STAGE_BALANCE,
+	DSP_STAGE_LIMITER,
+	DSP_STAGES
+};
+
+enum dsp_filter {
+	DSP_PEAK,
+	DSP_LOWSHELF,
+	DSP_HIGHSHELF,
+	DSP_LOWPASS,
+	DSP_HIGHPASS
+};
+
+typedef struct dsp_biquad_cfg {
+	enum dsp_filter type;
+	float freq;		/* Hz */
+	float gain_db;		/* peak and shelves only */
+	float q;
+} dsp_biquad_cfg_t;
+
+typedef struct dsp_chain_cfg {
+	int nbiquads;
+	dsp_biquad_cfg_t biquad[DSP_CHAIN_BIQUADS];
+	float balance;		/* -1 left .. 1 right */
+	float fader;		/* -1 front .. 1 rear, four channel streams only */
+	float limit_db;		/* ceiling in dBFS, 0 disables the limiter */
+} dsp_chain_cfg_t;
+
+typedef struct dsp_chain dsp_chain_t;
+
+extern int dsp_chain_parse_eq(dsp_chain_cfg_t *cfg, const char *spec);
+extern dsp_chain_t *dsp_chain_new(const dsp_chain_cfg_t *cfg);
+extern void dsp_chain_free(dsp_chain_t *c);
+extern void dsp_chain_process(dsp_chain_t *c, int16_t *samples, int frames,
+                              int rate, int channels, uint64_t ns[DSP_STAGES]);
+
+#endif /* _SPOTIFY_DSP_H_ */
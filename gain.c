@@ -0,0 +1,188 @@
+/*
+ * Output gain stage.
+ *
+ * Applies the user volume times the per-track normalization gain and the
+ * speed-dependent road noise compensation, with a chunk-level peak
+ * limiter on top so loudness boosts never clip. It also measures the
+ * loudness of what is played, which is how the track index learns the
+ * normalization gain of tracks it hasn't seen yet.
+ */
+
+#include "audio.h"
+#include "dsp.h"
+#include <math.h>
+#include <string.h>
+
+/* Limiter ceiling, about -0.3 dBFS */
+#define GAIN_LIMIT		31700
+/* Time the limiter takes to give back 6 dB */
+#define GAIN_RELEASE_MS		500
+#define LOUDNESS_BLOCK_MS	400
+
+void audio_set_volume(audio_fifo_t *af, int gain)
+{
+	pthread_mutex_lock(&af->mutex);
+	af->volume = gain;
+	pthread_mutex_unlock(&af->mutex);
+}
+
+/*
+ * Normalization gain of the track being delivered. The tail of the one
+ * before may still be queued; it keeps its own gain until the output
+ * thread gets to the first chunk of this one.
+ */
+void audio_set_norm_gain(audio_fifo_t *af, int gain)
+{
+	pthread_mutex_lock(&af->mutex);
+	af->norm_next = gain;
+	af->norm_track = af->track;
+	pthread_mutex_unlock(&af->mutex);
+}
+
+void audio_set_speed_gain(audio_fifo_t *af, int gain)
+{
+	pthread_mutex_lock(&af->mutex);
+	af->speed_gain = gain;
+	pthread_mutex_unlock(&af->mutex);
+}
+
+static void loudness_block(audio_loudness_t *l, int channels)
+{
+	double ms = (double)l->block / ((double)l->block_frames * channels * 32768.0 * 32768.0);
+	double db = ms > 0 ? 10 * log10(ms) : -INFINITY;
+	int bin = (int)-db;
+
+	if (bin >= 0 && bin < AUDIO_LOUDNESS_BINS) {
+		l->energy[bin] += ms;
+		l->count[bin]++;
+	}
+	l->block = 0;
+	l->block_frames = 0;
+}
+
+static void loudness_add(audio_fifo_t *af, const audio_fifo_data_t *afd)
+{
+	audio_loudness_t *l = &af->loudness;
+	int block = afd->rate * LOUDNESS_BLOCK_MS / 1000;
+	int off, n;
+
+	if (afd->track != l->track) {
+		/* The track before has played out: hand it to the player */
+		if (l->frames)
+			af->heard = *l;
+		memset(l, 0, sizeof(*l));
+		l->track = afd->track;
+	}
+
+	for (off = 0; off < afd->nsamples; off += n) {
+		n = afd->nsamples - off;
+		if (n > block - l->block_frames)
+			n = block - l->block_frames;
+		l->block += dsp_sumsq_s16(afd->samples + off * afd->channels,
+		                          n * afd->channels);
+		l->block_frames += n;
+		if (l->block_frames == block)
+			loudness_block(l, afd->channels);
+	}
+	l->frames += afd->nsamples;
+	l->rate = afd->rate;
+}
+
+/*
+ * Gated loudness of the last track that played out, in dB relative to
+ * full scale, its serial and how much of it was measured. Each track is
+ * reported once. Returns -1 if there is none new, or no block passed
+ * the gates.
+ */
+int audio_loudness_get(audio_fifo_t *af, unsigned int *track, float *db,
+                       int *ms)
+{
+	audio_loudness_t *l = &af->heard;
+	double sum = 0, gate;
+	unsigned int count = 0;
+	int i, ret = -1;
+
+	pthread_mutex_lock(&af->mutex);
+
+	if (!l->frames) {
+		pthread_mutex_unlock(&af->mutex);
+		return -1;
+	}
+
+	for (i = 0; i < AUDIO_LOUDNESS_BINS; i++) {
+		sum += l->energy[i];
+		count += l->count[i];
+	}
+
+	if (count) {
+		gate = 10 * log10(sum / count) - 10;
+		sum = 0;
+		count = 0;
+		/* bin i holds blocks between -(i + 1) and -i dB */
+		for (i = 0; i < AUDIO_LOUDNESS_BINS && -i > gate; i++) {
+			sum += l->energy[i];
+			count += l->count[i];
+		}
+		if (count) {
+			*db = 10 * log10(sum / count);
+			ret = 0;
+		}
+	}
+	*ms = l->rate ? l->frames * 1000 / l->rate : 0;
+	*track = l->track;
+	memset(l, 0, sizeof(*l));
+
+	pthread_mutex_unlock(&af->mutex);
+	return ret;
+}
+
+/*
+ * Measure afd and apply volume, normalization and limiting to it. The
+ * limiter turns the gain down for the whole chunk at once and gives it
+ * back with a ramp.
+ */
+void audio_gain_process(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	int n = afd->nsamples * afd->channels;
+	int target, prev, peak, step;
+
+	if (afd->flags & AUDIO_FIFO_SILENCE)
+		return;
+
+	pthread_mutex_lock(&af->mutex);
+	if (afd->track == af->norm_track)
+		af->norm_gain = af->norm_next;
+	loudness_add(af, afd);
+	target = (af->volume * af->norm_gain) >> DSP_GAIN_SHIFT;
+	target = (target * af->speed_gain) >> DSP_GAIN_SHIFT;
+	prev = af->out_gain;
+	pthread_mutex_unlock(&af->mutex);
+
+	if (target > DSP_GAIN_MAX)
+		target = DSP_GAIN_MAX;
+
+	if (target == DSP_UNITY && prev == DSP_UNITY)
+		return;
+
+	if (target > prev) {
+		step = (int64_t)prev * afd->nsamples * 1000 /
+		       ((int64_t)afd->rate * GAIN_RELEASE_MS);
+		if (target > prev + step)
+			target = prev + step + 1;
+	}
+
+	peak = dsp_peak_s16(afd->samples, n);
+	if (peak && ((int64_t)peak * target >> DSP_GAIN_SHIFT) > GAIN_LIMIT) {
+		target = ((int64_t)GAIN_LIMIT << DSP_GAIN_SHIFT) / peak;
+		prev = target;
+		pthread_mutex_lock(&af->mutex);
+		af->stats.limited_chunks++;
+		pthread_mutex_unlock(&af->mutex);
+	}
+
+	dsp_ramp_s16(afd->samples, afd->nsamples, afd->channels, prev, target);
+
+	pthread_mutex_lock(&af->mutex);
+	af->out_gain = target;
+	pthread_mutex_unlock(&af->mutex);
+}
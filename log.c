@@ -0,0 +1,31 @@
+/*
+ * Logging for the player core, see log.h.
+ */
+
+#include "log.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+int log_level;
+
+static log_handler_t handler;
+
+void log_set_handler(log_handler_t h)
+{
+	handler = h;
+}
+
+void log_printf(int level, const char *function, const char *fmt, ...)
+{
+	char msg[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	if (handler)
+		handler(level, function, msg);
+	else
+		fprintf(stderr, "%s:%s", function, msg);
+}
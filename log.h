@@ -0,0 +1,26 @@
+/*
+ * Logging for the player core.
+ *
+ * The core is built into the Navit plugin and the spot daemon alike, so
+ * it can't use Navit's debug.h. dbg() here has the same shape: messages
+ * up to log_level are formatted and passed to the front end's handler,
+ * or written to stderr when it installed none.
+ */
+#ifndef _SPOTIFY_LOG_H_
+#define _SPOTIFY_LOG_H_
+
+typedef void (*log_handler_t)(int level, const char *function,
+			      const char *msg);
+
+extern int log_level;
+
+extern void log_set_handler(log_handler_t handler);
+extern void log_printf(int level, const char *function, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+/* The plugin glue keeps using Navit's */
+#ifndef dbg
+#define dbg(level, ...) { if ((level) <= log_level) log_printf(level, __func__, __VA_ARGS__); }
+#endif
+
+#endif /* _SPOTIFY_LOG_H_ */
@@ -0,0 +1,653 @@
+/*
+ * MPRIS2 service on D-Bus.
+ *
+ * Everything D-Bus happens on one thread, which sleeps in poll() on the
+ * connection and on an eventfd. The player state watcher runs on the
+ * main loop: it only records which properties changed and kicks the
+ * eventfd, and the thread sends whatever accumulated as one
+ * PropertiesChanged once MPRIS_BATCH_MS have passed since the last one.
+ * Method calls go the other way through a small command queue, with an
+ * eventfd the main loop watches, so neither side ever waits on the other.
+ */
+
+#include "mpris.h"
+#include "player-state.h"
+#include <dbus/dbus.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define MPRIS_PATH		"/org/mpris/MediaPlayer2"
+#define MPRIS_ROOT		"org.mpris.MediaPlayer2"
+#define MPRIS_PLAYER		"org.mpris.MediaPlayer2.Player"
+#define MPRIS_TRACK_PATH	"/org/navit/spotify/track/"
+#define MPRIS_NO_TRACK		"/org/mpris/MediaPlayer2/TrackList/NoTrack"
+/* A position further than this from where playback should be is a seek */
+#define MPRIS_SEEK_SLACK_MS	1000
+
+/* State changes that show up in properties */
+#define MPRIS_METADATA	(PLAYER_CHANGED_TRACK | PLAYER_CHANGED_ARTIST | \
+			 PLAYER_CHANGED_INDEX | PLAYER_CHANGED_DURATION | \
+			 PLAYER_CHANGED_COVER)
+#define MPRIS_STATUS	PLAYER_CHANGED_PLAYING
+
+static DBusConnection *conn;
+static int wake_fd = -1;	/* state changed */
+static int cmd_fd = -1;		/* commands queued */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int pending;	/* PLAYER_CHANGED_* not signalled yet */
+static int seeked;
+static int64_t seeked_us;
+static struct mpris_command queue[MPRIS_COMMANDS];
+static int qhead, qcount;
+
+/* Watcher state, main loop only */
+static struct player_state last;
+static int64_t last_ns;
+
+static const char introspection[] =
+	DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+	"<node>\n"
+	" <interface name=\"org.freedesktop.DBus.Introspectable\">\n"
+	"  <method name=\"Introspect\"><arg type=\"s\" direction=\"out\"/></method>\n"
+	" </interface>\n"
+	" <interface name=\"org.freedesktop.DBus.Properties\">\n"
+	"  <method name=\"Get\"><arg type=\"s\" direction=\"in\"/>"
+	"<arg type=\"s\" direction=\"in\"/><arg type=\"v\" direction=\"out\"/></method>\n"
+	"  <method name=\"GetAll\"><arg type=\"s\" direction=\"in\"/>"
+	"<arg type=\"a{sv}\" direction=\"out\"/></method>\n"
+	"  <method name=\"Set\"><arg type=\"s\" direction=\"in\"/>"
+	"<arg type=\"s\" direction=\"in\"/><arg type=\"v\" direction=\"in\"/></method>\n"
+	"  <signal name=\"PropertiesChanged\"><arg type=\"s\"/><arg type=\"a{sv}\"/>"
+	"<arg type=\"as\"/></signal>\n"
+	" </interface>\n"
+	" <interface name=\"" MPRIS_ROOT "\">\n"
+	"  <method name=\"Raise\"/><method name=\"Quit\"/>\n"
+	"  <property name=\"CanQuit\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"CanRaise\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"HasTrackList\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"Identity\" type=\"s\" access=\"read\"/>\n"
+	"  <property name=\"SupportedUriSchemes\" type=\"as\" access=\"read\"/>\n"
+	"  <property name=\"SupportedMimeTypes\" type=\"as\" access=\"read\"/>\n"
+	" </interface>\n"
+	" <interface name=\"" MPRIS_PLAYER "\">\n"
+	"  <method name=\"Next\"/><method name=\"Previous\"/>\n"
+	"  <method name=\"Pause\"/><method name=\"PlayPause\"/>\n"
+	"  <method name=\"Stop\"/><method name=\"Play\"/>\n"
+	"  <method name=\"Seek\"><arg type=\"x\" direction=\"in\"/></method>\n"
+	"  <method name=\"SetPosition\"><arg type=\"o\" direction=\"in\"/>"
+	"<arg type=\"x\" direction=\"in\"/></method>\n"
+	"  <method name=\"OpenUri\"><arg type=\"s\" direction=\"in\"/></method>\n"
+	"  <signal name=\"Seeked\"><arg type=\"x\"/></signal>\n"
+	"  <property name=\"PlaybackStatus\" type=\"s\" access=\"read\"/>\n"
+	"  <property name=\"Rate\" type=\"d\" access=\"read\"/>\n"
+	"  <property name=\"Metadata\" type=\"a{sv}\" access=\"read\"/>\n"
+	"  <property name=\"Volume\" type=\"d\" access=\"read\"/>\n"
+	"  <property name=\"Position\" type=\"x\" access=\"read\"/>\n"
+	"  <property name=\"MinimumRate\" type=\"d\" access=\"read\"/>\n"
+	"  <property name=\"MaximumRate\" type=\"d\" access=\"read\"/>\n"
+	"  <property name=\"CanGoNext\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"CanGoPrevious\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"CanPlay\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"CanPause\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"CanSeek\" type=\"b\" access=\"read\"/>\n"
+	"  <property name=\"CanControl\" type=\"b\" access=\"read\"/>\n"
+	" </interface>\n"
+	"</node>\n";
+
+static const char *root_props[] = {
+	"CanQuit", "CanRaise", "HasTrackList", "Identity",
+	"SupportedUriSchemes", "SupportedMimeTypes", NULL
+};
+
+static const char *player_props[] = {
+	"PlaybackStatus", "Rate", "Metadata", "Volume", "Position",
+	"MinimumRate", "MaximumRate", "CanGoNext", "CanGoPrevious",
+	"CanPlay", "CanPause", "CanSeek", "CanControl", NULL
+};
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void kick(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0)
+		return;		/* the counter is far from full */
+}
+
+static void track_path(const struct player_state *st, char *buf, size_t len)
+{
+	if (st->track[0] && st->index < 0)
+		snprintf(buf, len, MPRIS_TRACK_PATH "q%d", -st->index);
+	else if (st->track[0])
+		snprintf(buf, len, MPRIS_TRACK_PATH "%d", st->index);
+	else
+		snprintf(buf, len, MPRIS_NO_TRACK);
+}
+
+static void append_basic(DBusMessageIter *it, int type, const void *val)
+{
+	DBusMessageIter v;
+	char sig[2] = { type, '\0' };
+
+	dbus_message_iter_open_container(it, DBUS_TYPE_VARIANT, sig, &v);
+	dbus_message_iter_append_basic(&v, type, val);
+	dbus_message_iter_close_container(it, &v);
+}
+
+static void append_bool(DBusMessageIter *it, int b)
+{
+	dbus_bool_t v = b;
+
+	append_basic(it, DBUS_TYPE_BOOLEAN, &v);
+}
+
+static void append_double(DBusMessageIter *it, double d)
+{
+	append_basic(it, DBUS_TYPE_DOUBLE, &d);
+}
+
+static void append_strings(DBusMessageIter *it, const char **strs, int n)
+{
+	DBusMessageIter v, a;
+	int i;
+
+	dbus_message_iter_open_container(it, DBUS_TYPE_VARIANT, "as", &v);
+	dbus_message_iter_open_container(&v, DBUS_TYPE_ARRAY, "s", &a);
+	for (i = 0; i < n; i++)
+		dbus_message_iter_append_basic(&a, DBUS_TYPE_STRING, &strs[i]);
+	dbus_message_iter_close_container(&v, &a);
+	dbus_message_iter_close_container(it, &v);
+}
+
+static void metadata_entry(DBusMessageIter *dict, const char *key, int type,
+                           const void *val)
+{
+	DBusMessageIter e;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL, &e);
+	dbus_message_iter_append_basic(&e, DBUS_TYPE_STRING, &key);
+	append_basic(&e, type, val);
+	dbus_message_iter_close_container(dict, &e);
+}
+
+static void append_metadata(DBusMessageIter *it, const struct player_state *st)
+{
+	DBusMessageIter v, dict, e;
+	char path[64], url[PLAYER_STATE_PATH + 8];
+	const char *p = path, *s, *key;
+	int64_t len = (int64_t)st->duration_ms * 1000;
+
+	track_path(st, path, sizeof(path));
+	dbus_message_iter_open_container(it, DBUS_TYPE_VARIANT, "a{sv}", &v);
+	dbus_message_iter_open_container(&v, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	metadata_entry(&dict, "mpris:trackid", DBUS_TYPE_OBJECT_PATH, &p);
+
+	if (st->track[0]) {
+		metadata_entry(&dict, "mpris:length", DBUS_TYPE_INT64, &len);
+		s = st->track;
+		metadata_entry(&dict, "xesam:title", DBUS_TYPE_STRING, &s);
+		if (st->artist[0]) {
+			s = st->artist;
+			key = "xesam:artist";
+			dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+			                                 NULL, &e);
+			dbus_message_iter_append_basic(&e, DBUS_TYPE_STRING, &key);
+			append_strings(&e, &s, 1);
+			dbus_message_iter_close_container(&dict, &e);
+		}
+		if (st->cover[0]) {
+			snprintf(url, sizeof(url), "file://%s", st->cover);
+			s = url;
+			metadata_entry(&dict, "mpris:artUrl", DBUS_TYPE_STRING, &s);
+		}
+	}
+
+	dbus_message_iter_close_container(&v, &dict);
+	dbus_message_iter_close_container(it, &v);
+}
+
+/* Append the value of a property as a variant. Returns -1 if unknown. */
+static int append_prop(DBusMessageIter *it, const char *iface,
+                       const char *name, const struct player_state *st)
+{
+	static const char *schemes[] = { "spotify" };
+	const char *s;
+	int64_t pos;
+
+	if (!strcmp(iface, MPRIS_ROOT)) {
+		if (!strcmp(name, "CanQuit") || !strcmp(name, "CanRaise") ||
+		    !strcmp(name, "HasTrackList"))
+			append_bool(it, 0);
+		else if (!strcmp(name, "Identity")) {
+			s = "Navit Spotify";
+			append_basic(it, DBUS_TYPE_STRING, &s);
+		} else if (!strcmp(name, "SupportedUriSchemes"))
+			append_strings(it, schemes, 1);
+		else if (!strcmp(name, "SupportedMimeTypes"))
+			append_strings(it, NULL, 0);
+		else
+			return -1;
+		return 0;
+	}
+
+	if (strcmp(iface, MPRIS_PLAYER))
+		return -1;
+
+	if (!strcmp(name, "PlaybackStatus")) {
+		s = !st->track[0] ? "Stopped" : st->playing ? "Playing" : "Paused";
+		append_basic(it, DBUS_TYPE_STRING, &s);
+	} else if (!strcmp(name, "Rate") || !strcmp(name, "Volume") ||
+	           !strcmp(name, "MinimumRate") || !strcmp(name, "MaximumRate")) {
+		append_double(it, 1.0);
+	} else if (!strcmp(name, "Metadata")) {
+		append_metadata(it, st);
+	} else if (!strcmp(name, "Position")) {
+		pos = (int64_t)st->position_ms * 1000;
+		append_basic(it, DBUS_TYPE_INT64, &pos);
+	} else if (!strcmp(name, "CanPlay") || !strcmp(name, "CanSeek")) {
+		append_bool(it, st->track[0] != '\0');
+	} else if (!strcmp(name, "CanGoNext") || !strcmp(name, "CanGoPrevious") ||
+	           !strcmp(name, "CanPause") || !strcmp(name, "CanControl")) {
+		append_bool(it, 1);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void append_props(DBusMessageIter *it, const char *iface,
+                         const char **names, const struct player_state *st)
+{
+	DBusMessageIter dict, e;
+
+	dbus_message_iter_open_container(it, DBUS_TYPE_ARRAY, "{sv}", &dict);
+	for (; names && *names; names++) {
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+		                                 NULL, &e);
+		dbus_message_iter_append_basic(&e, DBUS_TYPE_STRING, names);
+		append_prop(&e, iface, *names, st);
+		dbus_message_iter_close_container(&dict, &e);
+	}
+	dbus_message_iter_close_container(it, &dict);
+}
+
+static DBusMessage *props_get(DBusMessage *msg, int all)
+{
+	const char *iface, *name = NULL;
+	struct player_state st;
+	DBusMessageIter it;
+	DBusMessage *reply;
+	int ok;
+
+	if (all)
+		ok = dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &iface,
+		                           DBUS_TYPE_INVALID);
+	else
+		ok = dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &iface,
+		                           DBUS_TYPE_STRING, &name,
+		                           DBUS_TYPE_INVALID);
+	if (!ok)
+		return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS, NULL);
+
+	player_state_read(&st);
+	reply = dbus_message_new_method_return(msg);
+	dbus_message_iter_init_append(reply, &it);
+
+	if (all) {
+		append_props(&it, iface, !strcmp(iface, MPRIS_ROOT) ? root_props :
+		             !strcmp(iface, MPRIS_PLAYER) ? player_props : NULL, &st);
+	} else if (append_prop(&it, iface, name, &st)) {
+		dbus_message_unref(reply);
+		return dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_PROPERTY,
+		                              name);
+	}
+	return reply;
+}
+
+static int queue_command(enum mpris_action action, int64_t us)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	if (qcount < MPRIS_COMMANDS) {
+		queue[(qhead + qcount) % MPRIS_COMMANDS].action = action;
+		queue[(qhead + qcount) % MPRIS_COMMANDS].us = us;
+		qcount++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&lock);
+	if (!ret)
+		kick(cmd_fd);
+	return ret;
+}
+
+static DBusMessage *player_call(DBusMessage *msg, const char *method)
+{
+	static const struct {
+		const char *name;
+		enum mpris_action action;
+	} simple[] = {
+		{ "Play", MPRIS_PLAY },
+		{ "Pause", MPRIS_PAUSE },
+		{ "PlayPause", MPRIS_PLAY_PAUSE },
+		{ "Stop", MPRIS_STOP },
+		{ "Next", MPRIS_NEXT },
+		{ "Previous", MPRIS_PREVIOUS },
+	};
+	struct player_state st;
+	const char *path;
+	char cur[64];
+	dbus_int64_t us;
+	unsigned int i;
+	int ret = 1;
+
+	for (i = 0; i < sizeof(simple) / sizeof(simple[0]); i++)
+		if (!strcmp(method, simple[i].name))
+			ret = queue_command(simple[i].action, 0);
+
+	if (!strcmp(method, "Seek")) {
+		if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_INT64, &us,
+		                           DBUS_TYPE_INVALID))
+			return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS,
+			                              NULL);
+		ret = queue_command(MPRIS_SEEK, us);
+	} else if (!strcmp(method, "SetPosition")) {
+		if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &path,
+		                           DBUS_TYPE_INT64, &us,
+		                           DBUS_TYPE_INVALID))
+			return dbus_message_new_error(msg, DBUS_ERROR_INVALID_ARGS,
+			                              NULL);
+		/* Meant for a track that is gone: ignored, as the spec says */
+		player_state_read(&st);
+		track_path(&st, cur, sizeof(cur));
+		ret = strcmp(path, cur) || us < 0 || us > st.duration_ms * 1000LL ?
+		      0 : queue_command(MPRIS_SET_POSITION, us);
+	}
+
+	if (ret > 0)
+		return dbus_message_new_error(msg, DBUS_ERROR_NOT_SUPPORTED, method);
+	if (ret < 0)
+		return dbus_message_new_error(msg, DBUS_ERROR_LIMITS_EXCEEDED,
+		                              "too many commands queued");
+	return dbus_message_new_method_return(msg);
+}
+
+static DBusHandlerResult mpris_message(DBusConnection *c, DBusMessage *msg,
+                                       void *data)
+{
+	const char *iface = dbus_message_get_interface(msg);
+	const char *method = dbus_message_get_member(msg);
+	DBusMessage *reply = NULL;
+
+	if (dbus_message_get_type(msg) != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+	    !iface || !method)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	if (!strcmp(iface, "org.freedesktop.DBus.Introspectable") &&
+	    !strcmp(method, "Introspect")) {
+		const char *xml = introspection;
+
+		reply = dbus_message_new_method_return(msg);
+		dbus_message_append_args(reply, DBUS_TYPE_STRING, &xml,
+		                         DBUS_TYPE_INVALID);
+	} else if (!strcmp(iface, DBUS_INTERFACE_PROPERTIES)) {
+		if (!strcmp(method, "Get") || !strcmp(method, "GetAll"))
+			reply = props_get(msg, !strcmp(method, "GetAll"));
+		else if (!strcmp(method, "Set"))
+			reply = dbus_message_new_error(msg,
+			                               DBUS_ERROR_PROPERTY_READ_ONLY,
+			                               NULL);
+	} else if (!strcmp(iface, MPRIS_ROOT)) {
+		/* Nothing to raise, and Navit isn't ours to quit */
+		if (!strcmp(method, "Raise") || !strcmp(method, "Quit"))
+			reply = dbus_message_new_method_return(msg);
+	} else if (!strcmp(iface, MPRIS_PLAYER)) {
+		reply = player_call(msg, method);
+	}
+
+	if (!reply)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	dbus_connection_send(c, reply, NULL);
+	dbus_message_unref(reply);
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Send what changed since the last batch */
+static void mpris_signal(unsigned int changed, int seek, int64_t seek_us)
+{
+	static const char *metadata[] = {
+		"Metadata", "CanPlay", "CanSeek", NULL
+	};
+	static const char *status[] = { "PlaybackStatus", NULL };
+	const char *iface = MPRIS_PLAYER;
+	struct player_state st;
+	DBusMessageIter it, dict, e, a;
+	DBusMessage *sig;
+	const char **names;
+	int i;
+
+	player_state_read(&st);
+
+	if (changed & (MPRIS_METADATA | MPRIS_STATUS)) {
+		sig = dbus_message_new_signal(MPRIS_PATH, DBUS_INTERFACE_PROPERTIES,
+		                              "PropertiesChanged");
+		dbus_message_iter_init_append(sig, &it);
+		dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &iface);
+		dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "{sv}",
+		                                 &dict);
+		for (i = 0; i < 2; i++) {
+			names = i ? status : metadata;
+			if (!(changed & (i ? MPRIS_STATUS : MPRIS_METADATA)))
+				continue;
+			for (; *names; names++) {
+				dbus_message_iter_open_container(&dict,
+				                                 DBUS_TYPE_DICT_ENTRY,
+				                                 NULL, &e);
+				dbus_message_iter_append_basic(&e, DBUS_TYPE_STRING,
+				                               names);
+				append_prop(&e, iface, *names, &st);
+				dbus_message_iter_close_container(&dict, &e);
+			}
+		}
+		dbus_message_iter_close_container(&it, &dict);
+		dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "s", &a);
+		dbus_message_iter_close_container(&it, &a);
+		dbus_connection_send(conn, sig, NULL);
+		dbus_message_unref(sig);
+	}
+
+	if (seek) {
+		sig = dbus_message_new_signal(MPRIS_PATH, MPRIS_PLAYER, "Seeked");
+		dbus_message_append_args(sig, DBUS_TYPE_INT64, &seek_us,
+		                         DBUS_TYPE_INVALID);
+		dbus_connection_send(conn, sig, NULL);
+		dbus_message_unref(sig);
+	}
+}
+
+/*
+ * Called on the main loop after each publish: note what changed and
+ * whether the position jumped, and leave the rest to the D-Bus thread.
+ */
+static void mpris_watch(const struct player_state *st, unsigned int changed,
+                        void *data)
+{
+	int64_t now = now_ns();
+	int expected = last.position_ms;
+	int seek = 0;
+
+	if (last.playing)
+		expected += (now - last_ns) / 1000000;
+	if ((changed & PLAYER_CHANGED_POSITION) &&
+	    !(changed & (PLAYER_CHANGED_INDEX | PLAYER_CHANGED_TRACK)) &&
+	    abs(st->position_ms - expected) > MPRIS_SEEK_SLACK_MS)
+		seek = 1;
+	last = *st;
+	last_ns = now;
+
+	changed &= MPRIS_METADATA | MPRIS_STATUS;
+	if (!changed && !seek)
+		return;
+
+	pthread_mutex_lock(&lock);
+	pending |= changed;
+	if (seek) {
+		seeked = 1;
+		seeked_us = (int64_t)st->position_ms * 1000;
+	}
+	pthread_mutex_unlock(&lock);
+	kick(wake_fd);
+}
+
+static void *mpris_thread(void *arg)
+{
+	struct pollfd pfd[2];
+	int64_t last_signal = 0, now;
+	unsigned int changed;
+	int timeout = -1, seek, fd;
+	int64_t seek_us;
+	uint64_t count;
+
+	dbus_connection_get_unix_fd(conn, &fd);
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wake_fd;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
+			;
+		dbus_connection_flush(conn);
+
+		if (poll(pfd, 2, timeout) < 0)
+			continue;
+		if ((pfd[1].revents & POLLIN) &&
+		    read(wake_fd, &count, sizeof(count)) < 0)
+			count = 0;	/* someone else's wakeup */
+		if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR) &&
+		    !dbus_connection_read_write(conn, 0))
+			break;
+
+		now = now_ns();
+		pthread_mutex_lock(&lock);
+		changed = pending;
+		seek = seeked;
+		seek_us = seeked_us;
+		timeout = -1;
+		if ((changed || seek) &&
+		    now - last_signal < MPRIS_BATCH_MS * 1000000LL) {
+			/* Too soon: come back when the batch is due */
+			timeout = MPRIS_BATCH_MS - (now - last_signal) / 1000000;
+			changed = seek = 0;
+		} else {
+			pending = 0;
+			seeked = 0;
+		}
+		pthread_mutex_unlock(&lock);
+
+		if (changed || seek) {
+			mpris_signal(changed, seek, seek_us);
+			last_signal = now;
+		}
+	}
+
+	fprintf(stderr, "mpris: disconnected from the bus\n");
+	return NULL;
+}
+
+static const DBusObjectPathVTable vtable = {
+	.message_function = mpris_message,
+};
+
+/*
+ * Connect to the bus at address, or the session bus if NULL, take the
+ * MPRIS name and start serving. Returns -1 on failure.
+ */
+int mpris_start(const char *address)
+{
+	DBusError err;
+	pthread_t tid;
+
+	dbus_threads_init_default();
+	dbus_error_init(&err);
+
+	if (address) {
+		conn = dbus_connection_open_private(address, &err);
+		if (conn && !dbus_bus_register(conn, &err)) {
+			dbus_connection_close(conn);
+			dbus_connection_unref(conn);
+			conn = NULL;
+		}
+	} else {
+		conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+	}
+	if (!conn) {
+		fprintf(stderr, "mpris: %s\n", err.message);
+		dbus_error_free(&err);
+		return -1;
+	}
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+	if (dbus_bus_request_name(conn, MPRIS_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE,
+	                          &err) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		fprintf(stderr, "mpris: can't own %s\n", MPRIS_NAME);
+		dbus_error_free(&err);
+		return -1;
+	}
+
+	dbus_connection_register_object_path(conn, MPRIS_PATH, &vtable, NULL);
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	cmd_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0 || cmd_fd < 0)
+		return -1;
+
+	player_state_read(&last);
+	last_ns = now_ns();
+	player_state_watch(mpris_watch, NULL);
+
+	return pthread_create(&tid, NULL, mpris_thread, NULL) ? -1 : 0;
+}
+
+/* Turns readable when mpris_poll() has commands to return */
+int mpris_command_fd(void)
+{
+	return cmd_fd;
+}
+
+/*
+ * Take the next command a client sent. Returns -1 when there are none
+ * left.
+ */
+int mpris_poll(struct mpris_command *cmd)
+{
+	uint64_t count;
+	int ret = -1;
+
+	pthread_mutex_lock(&lock);
+	if (qcount) {
+		*cmd = queue[qhead];
+		qhead = (qhead + 1) % MPRIS_COMMANDS;
+		qcount--;
+		ret = 0;
+	}
+	/* Rearm the eventfd once the queue is empty */
+	if (!qcount && read(cmd_fd, &count, sizeof(count)) < 0)
+		count = 0;	/* it already was */
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
@@ -0,0 +1,40 @@
+/*
+ * MPRIS2 service on D-Bus.
+ *
+ * The service runs on a connection thread of its own. It answers
+ * property reads from the published player state and turns method calls
+ * into commands, which the player picks up from its main loop with
+ * mpris_poll() once mpris_command_fd() turns readable. State changes
+ * are watched, coalesced and sent as one PropertiesChanged signal at
+ * most every MPRIS_BATCH_MS.
+ */
+#ifndef _SPOTIFY_MPRIS_H_
+#define _SPOTIFY_MPRIS_H_
+
+#include <stdint.h>
+
+#define MPRIS_NAME		"org.mpris.MediaPlayer2.navit_spotify"
+#define MPRIS_BATCH_MS		200
+#define MPRIS_COMMANDS		16
+
+enum mpris_action {
+	MPRIS_PLAY,
+	MPRIS_PAUSE,
+	MPRIS_PLAY_PAUSE,
+	MPRIS_STOP,
+	MPRIS_NEXT,
+	MPRIS_PREVIOUS,
+	MPRIS_SEEK,		/* by us, relative */
+	MPRIS_SET_POSITION	/* to us */
+};
+
+struct mpris_command {
+	enum mpris_action action;
+	int64_t us;
+};
+
+extern int mpris_start(const char *address);
+extern int mpris_command_fd(void);
+extern int mpris_poll(struct mpris_command *cmd);
+
+#endif /* _SPOTIFY_MPRIS_H_ */
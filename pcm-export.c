@@ -0,0 +1,273 @@
+/*
+ * Shared memory export of the music PCM, see pcm-export.h for the
+ * layout clients see.
+ *
+ * The output thread copies each chunk into the ring and bumps the
+ * clients' eventfds, none of which can block: the eventfds are non
+ * blocking and the client list is only tried, never waited for. Clients
+ * come and go on a thread of their own, and while none is connected
+ * pcm_export_feed() is a load and a branch.
+ */
+
+#define _GNU_SOURCE
+#include "pcm-export.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define RING_FRAMES	(48000 * PCM_EXPORT_SECONDS)
+#define DATA_OFFSET	4096
+
+int pcm_export_active;
+
+static struct pcm_export_header *hdr;
+static int16_t *ring;
+static int memfd = -1;
+static int listen_fd = -1;
+
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	int sock;
+	int efd;
+} clients[PCM_EXPORT_CLIENTS];
+static int nclients;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Copy frames into the ring at frame w, as stereo */
+static void ring_copy(uint64_t w, const int16_t *samples, int frames,
+                      int channels)
+{
+	int16_t *dst;
+	int i, part, pos;
+
+	if (channels == PCM_EXPORT_CHANNELS) {
+		while (frames) {
+			pos = w % RING_FRAMES;
+			part = RING_FRAMES - pos;
+			if (part > frames)
+				part = frames;
+			memcpy(ring + pos * PCM_EXPORT_CHANNELS, samples,
+			       part * PCM_EXPORT_CHANNELS * sizeof(int16_t));
+			samples += part * PCM_EXPORT_CHANNELS;
+			frames -= part;
+			w += part;
+		}
+		return;
+	}
+
+	for (i = 0; i < frames; i++, w++) {
+		dst = ring + (w % RING_FRAMES) * PCM_EXPORT_CHANNELS;
+		dst[0] = samples[i * channels];
+		dst[1] = samples[i * channels + (channels > 1)];
+	}
+}
+
+/*
+ * Called by the output thread with every processed chunk while a client
+ * is connected.
+ */
+void pcm_export_write(const int16_t *samples, int frames, int channels,
+                      int rate, unsigned int epoch)
+{
+	uint64_t w = hdr->write_frames, one = 1;
+	int i;
+
+	ring_copy(w, samples, frames, channels);
+
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (hdr->epoch != epoch) {
+		hdr->epoch = epoch;
+		hdr->epoch_frame = w;
+	}
+	hdr->rate = rate;
+	hdr->write_ns = now_ns();
+	hdr->write_frames = w + frames;
+	__atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+
+	/* A client coming or going can miss a notification instead */
+	if (pthread_mutex_trylock(&clients_lock))
+		return;
+	for (i = 0; i < nclients; i++)
+		if (write(clients[i].efd, &one, sizeof(one)) < 0)
+			continue;	/* hung up, the client thread will see */
+	pthread_mutex_unlock(&clients_lock);
+}
+
+/* Send the memfd and a new eventfd to a client that just connected */
+static void client_add(int sock)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte = PCM_EXPORT_VERSION;
+	int fds[2], efd;
+
+	if (nclients == PCM_EXPORT_CLIENTS) {
+		close(sock);
+		return;
+	}
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		close(sock);
+		return;
+	}
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	fds[0] = memfd;
+	fds[1] = efd;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+		close(efd);
+		close(sock);
+		return;
+	}
+
+	pthread_mutex_lock(&clients_lock);
+	clients[nclients].sock = sock;
+	clients[nclients].efd = efd;
+	nclients++;
+	__atomic_store_n(&pcm_export_active, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&clients_lock);
+}
+
+static void client_remove(int i)
+{
+	pthread_mutex_lock(&clients_lock);
+	close(clients[i].sock);
+	close(clients[i].efd);
+	clients[i] = clients[--nclients];
+	if (!nclients)
+		__atomic_store_n(&pcm_export_active, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&clients_lock);
+}
+
+static void *pcm_export_thread(void *arg)
+{
+	struct pollfd pfd[PCM_EXPORT_CLIENTS + 1];
+	char buf[64];
+	int i, n, sock;
+
+	for (;;) {
+		pfd[0].fd = listen_fd;
+		pfd[0].events = POLLIN;
+		/* Only this thread changes the client list */
+		n = nclients;
+		for (i = 0; i < n; i++) {
+			pfd[i + 1].fd = clients[i].sock;
+			pfd[i + 1].events = POLLIN;
+		}
+
+		if (poll(pfd, n + 1, -1) < 0)
+			continue;
+
+		/* Clients send nothing, so anything readable is a hangup */
+		for (i = n - 1; i >= 0; i--)
+			if (pfd[i + 1].revents &&
+			    read(clients[i].sock, buf, sizeof(buf)) <= 0)
+				client_remove(i);
+
+		if (pfd[0].revents & POLLIN) {
+			sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (sock >= 0)
+				client_add(sock);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Create the ring and start listening for clients on the unix socket at
+ * path. Returns -1 on failure.
+ */
+int pcm_export_start(const char *path)
+{
+	size_t size = DATA_OFFSET +
+	              (size_t)RING_FRAMES * PCM_EXPORT_CHANNELS * sizeof(int16_t);
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+	pthread_t tid;
+	void *map = MAP_FAILED;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		return -1;
+
+	memfd = memfd_create("spotify-pcm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0 || ftruncate(memfd, size) < 0)
+		goto fail;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	/*
+	 * Clients can't resize the ring, nor map it writable where the
+	 * kernel has F_SEAL_FUTURE_WRITE (5.1); older ones refuse the whole
+	 * call for it, so try again with the others.
+	 */
+#ifdef F_SEAL_FUTURE_WRITE
+	if (fcntl(memfd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) < 0)
+#endif
+		if (fcntl(memfd, F_ADD_SEALS, seals) < 0)
+			goto fail;
+
+	hdr = map;
+	ring = (int16_t *)((char *)map + DATA_OFFSET);
+	hdr->magic = PCM_EXPORT_MAGIC;
+	hdr->version = PCM_EXPORT_VERSION;
+	hdr->data_offset = DATA_OFFSET;
+	hdr->ring_frames = RING_FRAMES;
+	hdr->channels = PCM_EXPORT_CHANNELS;
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0)
+		goto fail;
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 ||
+	    listen(listen_fd, PCM_EXPORT_CLIENTS) < 0)
+		goto fail;
+
+	if (!pthread_create(&tid, NULL, pcm_export_thread, NULL))
+		return 0;
+
+fail:
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(path);
+	}
+	if (map != MAP_FAILED)
+		munmap(map, size);
+	if (memfd >= 0)
+		close(memfd);
+	listen_fd = -1;
+	memfd = -1;
+	hdr = NULL;
+	ring = NULL;
+	return -1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Shared memory export of the music PCM for other local processes.
+ *
+ * The exporter listens on a unix socket. A client that connects gets two
+ * file descriptors in an SCM_RIGHTS message along with one byte of data:
+ * a memfd holding a struct pcm_export_header followed by the ring, and
+ * an eventfd of its own, non blocking, that is bumped after every write
+ * and can be polled. The client maps the memfd read only and reads at
+ * its own pace; it is never waited for, so one that falls more than a
+ * ring behind loses audio and has to notice from write_frames.
+ *
+ * The ring holds interleaved signed 16 bit frames, after the filter
+ * chain and before the navigation prompts and the output zone gains.
+ * Frame f is at data_offset + (f % ring_frames) * channels * 2. The
+ * header fields are updated under a sequence counter: it is odd while
+ * they change, so a reader copies the header and retries if seq was odd
+ * or moved. The writer doesn't wait for readers either, so a reader
+ * looks at write_frames again after copying frames out of the ring:
+ * if the writer came within a chunk of them, they may be torn.
+ */
+#ifndef _SPOTIFY_PCM_EXPORT_H_
+#define _SPOTIFY_PCM_EXPORT_H_
+
+#include <stdint.h>
+
+#define PCM_EXPORT_MAGIC	0x4d435053	/* "SPCM" */
+#define PCM_EXPORT_VERSION	1
+#define PCM_EXPORT_CHANNELS	2		/* frames are always stereo */
+#define PCM_EXPORT_SECONDS	4		/* ring size at 48 kHz */
+#define PCM_EXPORT_CLIENTS	8
+
+struct pcm_export_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t data_offset;		/* bytes from the start of the map */
+	uint32_t ring_frames;
+	uint32_t channels;
+	uint32_t seq;			/* odd while the fields below change */
+	uint32_t rate;			/* of the frames last written */
+	uint32_t epoch;			/* bumped by every seek */
+	uint64_t write_frames;		/* frames written since the start */
+	int64_t write_ns;		/* CLOCK_MONOTONIC of the last write */
+	uint64_t epoch_frame;		/* write_frames where epoch started */
+};
+
+extern int pcm_export_active;
+
+extern int pcm_export_start(const char *path);
+extern void pcm_export_write(const int16_t *samples, int frames, int channels,
+                             int rate, unsigned int epoch);
+
+static inline void pcm_export_feed(const int16_t *samples, int frames,
+                                   int channels, int rate, unsigned int epoch)
+{
+	if (__atomic_load_n(&pcm_export_active, __ATOMIC_RELAXED))
+		pcm_export_write(samples, frames, channels, rate, epoch);
+}
+
+#endif /* _SPOTIFY_PCM_EXPORT_H_ */
@@ -0,0 +1,322 @@
+/*
+ * Play order and queue, see play-queue.h.
+ *
+ * pos is -1 before the start of the order, after the track playing was
+ * removed from its head, and length past its end. Tracks appended there
+ * move it back onto the last entry, so advancing picks them up.
+ */
+
+#include "play-queue.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ITEM_MASK	(PLAY_QUEUE_ITEMS - 1)
+
+/* xorshift64*, plenty to shuffle a playlist with */
+static uint64_t next_random(struct play_queue *q)
+{
+	q->rng ^= q->rng >> 12;
+	q->rng ^= q->rng << 25;
+	q->rng ^= q->rng >> 27;
+	return q->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* In [0, n); the modulo bias is nothing next to 2^64 */
+static int random_below(struct play_queue *q, int n)
+{
+	return next_random(q) % n;
+}
+
+static int reserve(struct play_queue *q, int length)
+{
+	int *order, size;
+
+	if (length <= q->size)
+		return 0;
+	for (size = q->size ? q->size : 64; size < length; size *= 2)
+		;
+	order = realloc(q->order, size * sizeof(*order));
+	if (!order)
+		return -1;
+	q->order = order;
+	q->size = size;
+	return 0;
+}
+
+/* Fisher-Yates over order[from..length) */
+static void shuffle_from(struct play_queue *q, int from)
+{
+	int i, j, t;
+
+	for (i = q->length - 1; i > from; i--) {
+		j = from + random_below(q, i - from + 1);
+		t = q->order[i];
+		q->order[i] = q->order[j];
+		q->order[j] = t;
+	}
+}
+
+/* Back to playlist order, carrying on from the track playing */
+static void straighten(struct play_queue *q)
+{
+	int i, current = play_queue_current(q);
+
+	for (i = 0; i < q->length; i++)
+		q->order[i] = i;
+	if (current >= 0)
+		q->pos = current;
+	else if (q->pos >= 0)
+		q->pos = q->length;
+}
+
+/* Put playlist position index at slot, keeping pos on its entry */
+static void insert(struct play_queue *q, int slot, int index)
+{
+	memmove(q->order + slot + 1, q->order + slot,
+		(q->length - slot) * sizeof(*q->order));
+	q->order[slot] = index;
+	if (slot < q->pos || (slot == q->pos && q->pos < q->length))
+		q->pos++;
+	else if (slot == q->pos)
+		q->pos--;	/* appended past the end: play it next */
+	q->length++;
+}
+
+/*
+ * Renumber the order through map, dropping what maps to -1. If that is
+ * the track playing, pos moves back to the entry before it, so the
+ * track that followed is still next.
+ */
+static void remap(struct play_queue *q, const int *map)
+{
+	int i, n = 0, pos = q->pos;
+
+	for (i = 0; i < q->length; i++) {
+		if (i == q->pos)
+			pos = map[q->order[i]] < 0 ? n - 1 : n;
+		if (map[q->order[i]] >= 0)
+			q->order[n++] = map[q->order[i]];
+	}
+	if (q->pos >= q->length)
+		pos = n;
+	q->pos = pos;
+	q->length = n;
+}
+
+void play_queue_init(struct play_queue *q, uint64_t seed)
+{
+	memset(q, 0, sizeof(*q));
+	/* xorshift never leaves 0 */
+	q->rng = seed ? seed : 0x9e3779b97f4a7c15ULL;
+}
+
+/* A new playlist of length tracks, to be played from the start */
+void play_queue_reset(struct play_queue *q, int length)
+{
+	int i;
+
+	q->length = q->pos = 0;
+	if (reserve(q, length))
+		return;
+	for (i = 0; i < length; i++)
+		q->order[i] = i;
+	q->length = length;
+	if (q->shuffle)
+		shuffle_from(q, 0);
+}
+
+/*
+ * Shuffle what is still to play, or go back to playing the playlist in
+ * order from the track playing.
+ */
+void play_queue_set_shuffle(struct play_queue *q, int shuffle)
+{
+	if (!shuffle == !q->shuffle)
+		return;
+	q->shuffle = shuffle;
+	if (shuffle)
+		shuffle_from(q, q->pos + 1);
+	else
+		straighten(q);
+}
+
+/* count tracks were inserted in the playlist at position */
+void play_queue_added(struct play_queue *q, int position, int count)
+{
+	int i, lo;
+
+	if (count <= 0)
+		return;
+	if (!q->length) {
+		/* The playlist loaded: shuffle all of it */
+		play_queue_reset(q, count);
+		return;
+	}
+	if (reserve(q, q->length + count))
+		return;
+
+	for (i = 0; i < q->length; i++)
+		if (q->order[i] >= position)
+			q->order[i] += count;
+	for (i = 0; i < count; i++) {
+		if (!q->shuffle) {
+			insert(q, position + i, position + i);
+			continue;
+		}
+		/* Anywhere among what is still to play */
+		lo = q->pos + 1 < q->length ? q->pos + 1 : q->length;
+		insert(q, lo + random_below(q, q->length - lo + 1),
+		       position + i);
+	}
+}
+
+/* The tracks at these playlist positions were removed */
+void play_queue_removed(struct play_queue *q, const int *positions,
+			int count)
+{
+	int *map, i, n;
+
+	map = calloc(q->length + 1, sizeof(*map));
+	if (!map)
+		return;
+	for (i = 0; i < count; i++)
+		if (positions[i] >= 0 && positions[i] < q->length)
+			map[positions[i]] = -1;
+	for (i = n = 0; i < q->length; i++)
+		if (!map[i])
+			map[i] = n++;
+	remap(q, map);
+	free(map);
+}
+
+/*
+ * The tracks at these playlist positions were moved, in this order, in
+ * front of the one that was at new_position. A shuffled order stays as
+ * it is, only renumbered.
+ */
+void play_queue_moved(struct play_queue *q, const int *positions, int count,
+		      int new_position)
+{
+	int *map, i, n = 0;
+
+	map = calloc(q->length + 1, sizeof(*map));
+	if (!map)
+		return;
+	for (i = 0; i < count; i++)
+		if (positions[i] >= 0 && positions[i] < q->length)
+			map[positions[i]] = -1;
+	for (i = 0; i < new_position && i < q->length; i++)
+		if (!map[i])
+			map[i] = n++ + 1;
+	for (i = 0; i < count; i++)
+		if (positions[i] >= 0 && positions[i] < q->length)
+			map[positions[i]] = n++ + 1;
+	for (i = new_position; i < q->length; i++)
+		if (!map[i])
+			map[i] = n++ + 1;
+	/* Built off by one, so 0 could mean not placed yet */
+	for (i = 0; i < q->length; i++)
+		map[i]--;
+	remap(q, map);
+	free(map);
+	if (!q->shuffle)
+		straighten(q);
+}
+
+/*
+ * Catch up with a playlist that has length tracks now, for changes no
+ * callback told about: tracks are taken to have been added or removed
+ * at the end.
+ */
+void play_queue_sync(struct play_queue *q, int length)
+{
+	int *positions, i, n = q->length - length;
+
+	if (n < 0) {
+		play_queue_added(q, q->length, -n);
+		return;
+	}
+	if (!n)
+		return;
+	positions = malloc(n * sizeof(*positions));
+	if (!positions)
+		return;
+	for (i = 0; i < n; i++)
+		positions[i] = length + i;
+	play_queue_removed(q, positions, n);
+	free(positions);
+}
+
+/* Play item after the track playing; -1 if the queue is full */
+int play_queue_enqueue(struct play_queue *q, void *item)
+{
+	if (play_queue_queued(q) == PLAY_QUEUE_ITEMS)
+		return -1;
+	q->item[q->tail++ & ITEM_MASK] = item;
+	return 0;
+}
+
+/*
+ * Move on to what plays next: the oldest queued item, or the next track
+ * in the order. Returns -1 at the end of the order, unless repeating.
+ */
+int play_queue_advance(struct play_queue *q, struct play_queue_entry *e)
+{
+	if (play_queue_queued(q)) {
+		e->index = -1;
+		e->item = q->item[q->head++ & ITEM_MASK];
+		return 0;
+	}
+	if (q->pos + 1 < q->length) {
+		q->pos++;
+	} else if (q->repeat && q->length) {
+		q->pos = 0;
+	} else {
+		q->pos = q->length;
+		return -1;
+	}
+	e->index = q->order[q->pos];
+	e->item = NULL;
+	return 0;
+}
+
+/* Step back in the order; returns the playlist position now playing */
+int play_queue_back(struct play_queue *q)
+{
+	if (q->pos > 0)
+		q->pos--;
+	else if (q->repeat && q->length)
+		q->pos = q->length - 1;
+	return play_queue_current(q);
+}
+
+/* Playlist position of the track playing, or last played, or -1 */
+int play_queue_current(const struct play_queue *q)
+{
+	return q->pos >= 0 && q->pos < q->length ? q->order[q->pos] : -1;
+}
+
+/*
+ * What plays n entries after the track playing, 0 being next: queued
+ * items first, then the order, up to one pass of it when repeating.
+ * Returns -1 if nothing will.
+ */
+int play_queue_peek(const struct play_queue *q, int n,
+		    struct play_queue_entry *e)
+{
+	int queued = play_queue_queued(q), i;
+
+	if (n < queued) {
+		e->index = -1;
+		e->item = q->item[(q->head + n) & ITEM_MASK];
+		return 0;
+	}
+	n -= queued;
+	/* Past the end, repeating starts over from the first entry */
+	i = q->pos < q->length ? q->pos + 1 + n : q->length + n;
+	if (n >= q->length || (i >= q->length && !q->repeat))
+		return -1;
+	e->index = q->order[i % q->length];
+	e->item = NULL;
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Play order: the playlist, straight or shuffled, with a queue of tracks
+ * to play before it carries on.
+ *
+ * The order is an array of playlist positions with a cursor on the one
+ * playing. Shuffling is a Fisher-Yates shuffle of what is still to play,
+ * from a seeded generator, so the tracks ahead are known for prefetching
+ * and the same seed gives the same order. Playlist edits renumber the
+ * order rather than rebuild it: what is ahead stays ahead, and added
+ * tracks land at random among it when shuffling. The queue is a ring of
+ * opaque items, whose owner keeps them alive.
+ */
+#ifndef _SPOTIFY_PLAY_QUEUE_H_
+#define _SPOTIFY_PLAY_QUEUE_H_
+
+#include <stdint.h>
+
+#define PLAY_QUEUE_ITEMS	64	/* queued tracks, a power of two */
+
+struct play_queue {
+	int *order;			/* playlist positions in play order */
+	int length;			/* of the playlist, and of order */
+	int size;			/* allocated */
+	int pos;			/* in order of the playlist track playing */
+	int shuffle;
+	int repeat;
+	uint64_t rng;
+	void *item[PLAY_QUEUE_ITEMS];
+	unsigned int head, tail;	/* items ever dequeued and enqueued */
+};
+
+/* What plays next: a playlist position, or a queued item */
+struct play_queue_entry {
+	int index;			/* -1 for an item */
+	void *item;
+};
+
+extern void play_queue_init(struct play_queue *q, uint64_t seed);
+extern void play_queue_reset(struct play_queue *q, int length);
+extern void play_queue_set_shuffle(struct play_queue *q, int shuffle);
+extern void play_queue_added(struct play_queue *q, int position, int count);
+extern void play_queue_removed(struct play_queue *q, const int *positions,
+			       int count);
+extern void play_queue_moved(struct play_queue *q, const int *positions,
+			     int count, int new_position);
+extern void play_queue_sync(struct play_queue *q, int length);
+extern int play_queue_enqueue(struct play_queue *q, void *item);
+extern int play_queue_advance(struct play_queue *q,
+			      struct play_queue_entry *e);
+extern int play_queue_back(struct play_queue *q);
+extern int play_queue_current(const struct play_queue *q);
+extern int play_queue_peek(const struct play_queue *q, int n,
+			   struct play_queue_entry *e);
+
+static inline int play_queue_queued(const struct play_queue *q)
+{
+	return q->tail - q->head;
+}
+
+#endif /* _SPOTIFY_PLAY_QUEUE_H_ */
@@ -0,0 +1,119 @@
+/*
+ * Published player state.
+ *
+ * A seqlock: the publisher makes the sequence odd, copies the new state
+ * in and makes it even again. Readers copy the state out and retry if
+ * the sequence was odd or moved while they copied, so they never block
+ * and only loop when they race a publish, which happens a few times a
+ * second at most.
+ */
+
+#include "player-state.h"
+#include <pthread.h>
+#include <string.h>
+
+static struct player_state state;
+static unsigned int seq;
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+	player_state_watch_t fn;
+	void *data;
+} watchers[PLAYER_STATE_WATCHERS];
+static int nwatchers;
+
+static unsigned int state_diff(const struct player_state *a,
+                               const struct player_state *b)
+{
+	unsigned int changed = 0;
+
+	if (strcmp(a->track, b->track))
+		changed |= PLAYER_CHANGED_TRACK;
+	if (strcmp(a->artist, b->artist))
+		changed |= PLAYER_CHANGED_ARTIST;
+	if (a->index != b->index)
+		changed |= PLAYER_CHANGED_INDEX;
+	if (a->duration_ms != b->duration_ms)
+		changed |= PLAYER_CHANGED_DURATION;
+	if (a->position_ms != b->position_ms)
+		changed |= PLAYER_CHANGED_POSITION;
+	if (a->buffer_ms != b->buffer_ms)
+		changed |= PLAYER_CHANGED_BUFFER;
+	if (a->playing != b->playing)
+		changed |= PLAYER_CHANGED_PLAYING;
+	if (a->connection != b->connection)
+		changed |= PLAYER_CHANGED_CONNECTION;
+	if (strcmp(a->cover, b->cover))
+		changed |= PLAYER_CHANGED_COVER;
+	return changed;
+}
+
+/*
+ * Replace the published state with st and tell the watchers what
+ * changed. Returns the changed mask, 0 if st matches what is published.
+ */
+unsigned int player_state_publish(const struct player_state *st)
+{
+	struct player_state snap;
+	unsigned int changed;
+	int i, n;
+
+	pthread_mutex_lock(&publish_lock);
+	changed = state_diff(&state, st);
+	if (!changed) {
+		pthread_mutex_unlock(&publish_lock);
+		return 0;
+	}
+
+	__atomic_store_n(&seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	state = *st;
+	/* Strings are copied whole, make sure a truncated one still ends */
+	state.track[PLAYER_STATE_TEXT - 1] = '\0';
+	state.artist[PLAYER_STATE_TEXT - 1] = '\0';
+	state.cover[PLAYER_STATE_PATH - 1] = '\0';
+	__atomic_store_n(&seq, seq + 1, __ATOMIC_RELEASE);
+
+	snap = state;
+	n = nwatchers;
+	pthread_mutex_unlock(&publish_lock);
+
+	for (i = 0; i < n; i++)
+		watchers[i].fn(&snap, changed, watchers[i].data);
+	return changed;
+}
+
+void player_state_read(struct player_state *st)
+{
+	unsigned int s;
+
+	for (;;) {
+		s = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+		if (s & 1)
+			continue;
+		memcpy(st, &state, sizeof(*st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&seq, __ATOMIC_RELAXED) == s)
+			return;
+	}
+}
+
+/*
+ * Call fn with the new state and changed mask after each publish that
+ * changed something. Watchers run on the publishing thread, so they
+ * should be quick. Returns -1 if all slots are taken.
+ */
+int player_state_watch(player_state_watch_t fn, void *data)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&publish_lock);
+	if (nwatchers < PLAYER_STATE_WATCHERS) {
+		watchers[nwatchers].fn = fn;
+		watchers[nwatchers].data = data;
+		nwatchers++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&publish_lock);
+	return ret;
+}
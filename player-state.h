@@ -0,0 +1,55 @@
+/*
+ * Published player state.
+ *
+ * The player publishes a snapshot of what it is doing from the main loop;
+ * UI code reads it with player_state_read() from any thread, at any rate,
+ * without taking a lock. Watchers are told which fields changed, and are
+ * only called when something did.
+ */
+#ifndef _SPOTIFY_PLAYER_STATE_H_
+#define _SPOTIFY_PLAYER_STATE_H_
+
+#include <stdint.h>
+
+#define PLAYER_STATE_TEXT	128
+#define PLAYER_STATE_PATH	256
+#define PLAYER_STATE_WATCHERS	8
+
+enum player_connection {
+	PLAYER_LOGGED_OUT,
+	PLAYER_ONLINE,
+	PLAYER_DISCONNECTED,
+	PLAYER_OFFLINE
+};
+
+/* Bits of the changed mask passed to watchers */
+#define PLAYER_CHANGED_TRACK		0x01
+#define PLAYER_CHANGED_ARTIST		0x02
+#define PLAYER_CHANGED_INDEX		0x04
+#define PLAYER_CHANGED_DURATION		0x08
+#define PLAYER_CHANGED_POSITION		0x10
+#define PLAYER_CHANGED_BUFFER		0x20
+#define PLAYER_CHANGED_PLAYING		0x40
+#define PLAYER_CHANGED_CONNECTION	0x80
+#define PLAYER_CHANGED_COVER		0x100
+
+struct player_state {
+	char track[PLAYER_STATE_TEXT];	/* empty when nothing is loaded */
+	char artist[PLAYER_STATE_TEXT];
+	int index;			/* in the playlist, < 0 when queued */
+	int duration_ms;
+	int position_ms;
+	int buffer_ms;			/* audio queued ahead of playback */
+	int playing;
+	enum player_connection connection;
+	char cover[PLAYER_STATE_PATH];	/* cover thumbnail, empty until ready */
+};
+
+typedef void (*player_state_watch_t)(const struct player_state *st,
+                                     unsigned int changed, void *data);
+
+extern unsigned int player_state_publish(const struct player_state *st);
+extern void player_state_read(struct player_state *st);
+extern int player_state_watch(player_state_watch_t fn, void *data);
+
+#endif /* _SPOTIFY_PLAYER_STATE_H_ */
@@ -0,0 +1,1752 @@
+/**
+ * The player core, see player.h.
+ *
+ * libspotify calls us back from its own threads for audio delivery and
+ * main thread notification only; everything else here runs on the front
+ * end's main loop.
+ */
+#include "keys.h"
+#include <glib.h>
+#include <libspotify/api.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "art.h"
+#include "bitrate.h"
+#include "delivery-trace.h"
+#include "log.h"
+#include "mpris.h"
+#include "pcm-export.h"
+#include "play-queue.h"
+#include "player.h"
+#include "player-state.h"
+#include "search.h"
+#include "spectrum.h"
+#include "queue.h"
+#include "trace.h"
+#include "track-index.h"
+
+/// Handle to the playlist currently being played
+static sp_playlist *g_jukeboxlist;
+/// Handle to the current track, which we hold a reference to
+static sp_track *g_currenttrack;
+/// Index to the current playlist track, or the last one if g_queued plays
+static int g_track_index;
+/// Play order of the playlist, and the tracks queued ahead of it
+static struct play_queue g_playqueue;
+/// The queued track playing, and how many have been
+static sp_track *g_queued;
+static unsigned int g_queued_count;
+/// The global session handle
+
+static sp_session *g_sess;
+static int g_logged_in;
+static audio_fifo_t g_audiofifo;
+static struct player_config *g_cfg;
+static int g_playing;
+static int g_buffer_ms = PLAYER_BUFFER_MS;
+/// player_seek() is waiting for libspotify, under g_audiofifo.mutex
+static int g_seeking;
+/// Tracks the audio pipeline may still be playing, by their fifo serial
+#define PLAYER_HEARD_TRACKS 4
+static struct
+{
+  unsigned int serial;
+  sp_track *track;
+  int index;
+} g_heard[PLAYER_HEARD_TRACKS];
+/// Our copies of what player_reconfigure() set
+static char *g_playlist;
+static char *g_device;
+/// How the last output change went, until player_reconfigure() tells
+static int g_output_state;
+static sp_track *g_cover_track;
+/// Signalled by libspotify when process_events is due
+static int g_notify_fd = -1;
+/// Set by libspotify's delivery thread, see on_end_of_track()
+static int g_track_ended;
+static struct bitrate_policy g_bitrate;
+/// Navit is busy: see player_load_shed()
+static int g_busy;
+static gint64 g_busy_since;
+static unsigned int g_busy_count;
+static gint64 g_busy_us;
+
+/// player_previous restarts the current track past this point
+#define PLAYER_RESTART_MS 3000
+/// Loudness tracks are normalized to, dB relative to full scale
+#define PLAYER_LOUDNESS_TARGET -16.0f
+#define PLAYER_NORM_MIN_DB -12.0f
+#define PLAYER_NORM_MAX_DB 9.0f
+/// Share of a track that must have been heard to store its loudness
+#define PLAYER_LOUDNESS_COVERAGE 90
+#define PLAYER_VOLUME_MIN_DB -60
+#define PLAYER_VOLUME_MAX_DB 6
+/// Granularity of the published position and buffer fill
+#define PLAYER_STATE_RESOLUTION_MS 250
+/// Upcoming playlist entries whose covers are fetched ahead
+#define PLAYER_COVER_PREFETCH 3
+
+
+static int
+player_track_uri (sp_track * t, char *buf, int len)
+{
+  sp_link *link = sp_link_create_from_track (t, 0);
+  int ret;
+
+  if (!link)
+    return -1;
+  ret = sp_link_as_string (link, buf, len);
+  sp_link_release (link);
+  return ret > 0 && ret < len ? 0 : -1;
+}
+
+/**
+ * Remember the loudness measured while the last track played out, if
+ * enough of it was heard and the index didn't know it yet.
+ */
+static void
+player_loudness_store (void)
+{
+  struct track_info info;
+  unsigned int serial;
+  char uri[256];
+  sp_track *t;
+  float db;
+  int ms;
+
+  if (audio_loudness_get (&g_audiofifo, &serial, &db, &ms) < 0)
+    return;
+  t = g_heard[serial % PLAYER_HEARD_TRACKS].track;
+  if (g_heard[serial % PLAYER_HEARD_TRACKS].serial != serial || !t)
+    return;
+  if ((int64_t) ms * 100 < (int64_t) sp_track_duration (t) * PLAYER_LOUDNESS_COVERAGE)
+    return;
+  if (player_track_uri (t, uri, sizeof (uri)))
+    return;
+  track_index_lookup (uri, &info);
+  if (!isnan (info.loudness))
+    return;
+
+  info.loudness = db;
+  track_index_store (uri, &info);
+  dbg (1, "loudness of %s: %.1f dB\n", uri, db);
+}
+
+/**
+ * Set the normalization gain for t from the index. If it is not known
+ * yet, t is measured as it plays, see player_loudness_store().
+ */
+static void
+player_loudness_apply (sp_track * t)
+{
+  struct track_info info;
+  char uri[256];
+  float db = 0;
+
+  if (!player_track_uri (t, uri, sizeof (uri))
+      && !track_index_lookup (uri, &info) && !isnan (info.loudness))
+    {
+      db = PLAYER_LOUDNESS_TARGET - info.loudness;
+      if (db < PLAYER_NORM_MIN_DB)
+        db = PLAYER_NORM_MIN_DB;
+      if (db > PLAYER_NORM_MAX_DB)
+        db = PLAYER_NORM_MAX_DB;
+    }
+  audio_set_norm_gain (&g_audiofifo, dsp_gain_from_db (db));
+}
+
+/**
+ * Set up silence trimming for t, skipping the scan when an earlier play
+ * has already measured its silent lead and tail.
+ */
+static void
+player_trim_apply (sp_track * t)
+{
+  struct track_info info;
+  char uri[256];
+  int end_ms = 0;
+
+  if (!g_cfg->trim_threshold)
+    {
+      audio_trim_start (&g_audiofifo, 0, -1, 0);
+      return;
+    }
+
+  if (player_track_uri (t, uri, sizeof (uri)))
+    track_info_init (&info);
+  else
+    track_index_lookup (uri, &info);
+  if (info.tail_ms > 0)
+    end_ms = sp_track_duration (t) - info.tail_ms;
+  audio_trim_start (&g_audiofifo, g_cfg->trim_threshold, info.lead_ms,
+                    end_ms > 0 ? end_ms : 0);
+}
+
+/**
+ * Once t has been delivered to its end, trim the trailing silence still
+ * queued and store what was measured for the next play.
+ */
+static void
+player_trim_store (sp_track * t)
+{
+  struct track_info info;
+  char uri[256];
+  int lead, tail;
+
+  pthread_mutex_lock (&g_audiofifo.mutex);
+  tail = audio_trim_tail (&g_audiofifo);
+  pthread_mutex_unlock (&g_audiofifo.mutex);
+  lead = audio_trim_lead_ms (&g_audiofifo);
+
+  if ((lead < 0 && tail < 0) || player_track_uri (t, uri, sizeof (uri)))
+    return;
+  track_index_lookup (uri, &info);
+  if ((lead < 0 || info.lead_ms >= 0) && (tail < 0 || info.tail_ms >= 0))
+    return;
+  if (info.lead_ms < 0)
+    info.lead_ms = lead;
+  if (info.tail_ms < 0)
+    info.tail_ms = tail;
+  track_index_store (uri, &info);
+  dbg (1, "silence of %s: %d ms lead, %d ms tail\n", uri, lead, tail);
+}
+
+static sp_bitrate
+player_sp_bitrate (int kbps)
+{
+  return kbps >= 320 ? SP_BITRATE_320k
+    : kbps >= 160 ? SP_BITRATE_160k : SP_BITRATE_96k;
+}
+
+/**
+ * Music of the playlist still to sync, in ms, for the offline bitrate.
+ */
+static uint64_t
+player_offline_ms (void)
+{
+  uint64_t ms = 0;
+  sp_track *t;
+  int i;
+
+  if (!g_jukeboxlist)
+    return 0;
+  for (i = 0; i < sp_playlist_num_tracks (g_jukeboxlist); i++)
+    {
+      t = sp_playlist_track (g_jukeboxlist, i);
+      if (t && sp_track_offline_get_status (t) != SP_TRACK_OFFLINE_DONE)
+        ms += sp_track_duration (t);
+    }
+  return ms;
+}
+
+/**
+ * Let the bitrate policy look at the last track and apply what it
+ * decides. Called at track boundaries, so a change never cuts into a
+ * track being played.
+ */
+static void
+player_bitrate_update (void)
+{
+  struct bitrate_inputs in;
+  audio_stats_t st;
+  int changed;
+
+  audio_get_stats (&g_audiofifo, &st);
+  in.xruns = st.xruns;
+  in.audio_us = st.written_us;
+  in.cpu_busy = bitrate_cpu_busy ();
+  if (bitrate_cache_space (g_cfg->cache_dir, &in.cache_free, &in.cache_total))
+    in.cache_free = in.cache_total = 0;
+  in.offline_ms = player_offline_ms ();
+
+  changed = bitrate_policy_update (&g_bitrate, &in);
+  if (changed & BITRATE_STREAM_CHANGED)
+    sp_session_preferred_bitrate (g_sess,
+                                  player_sp_bitrate (g_bitrate.stream_kbps));
+  if (changed & BITRATE_OFFLINE_CHANGED)
+    sp_session_preferred_offline_bitrate (g_sess,
+                                          player_sp_bitrate (g_bitrate.offline_kbps),
+                                          0);
+  if (changed)
+    {
+      trace (BITRATE, g_bitrate.stream_kbps, g_bitrate.offline_kbps);
+      dbg (1, "bitrate: streaming %d kbps, offline %d kbps (%u xruns, cpu %d%%, %llu MB free, %llu min to sync)\n",
+           g_bitrate.stream_kbps, g_bitrate.offline_kbps,
+           g_bitrate.xruns_last, g_bitrate.cpu_busy,
+           (unsigned long long) (in.cache_free >> 20),
+           (unsigned long long) (in.offline_ms / 60000));
+    }
+}
+
+/**
+ * Where the current track is from: its position in the playlist, or
+ * minus its count among the queued tracks played.
+ */
+static int
+player_index (void)
+{
+  return g_queued ? -(int) g_queued_count : g_track_index;
+}
+
+/**
+ * Remember that the audio about to be delivered is t's, so it can be
+ * told apart from the previous track's tail still in the pipeline.
+ */
+static void
+player_heard_tag (sp_track * t)
+{
+  unsigned int serial = audio_fifo_track (&g_audiofifo);
+  int i = serial % PLAYER_HEARD_TRACKS;
+
+  sp_track_add_ref (t);
+  if (g_heard[i].track)
+    sp_track_release (g_heard[i].track);
+  g_heard[i].serial = serial;
+  g_heard[i].track = t;
+  g_heard[i].index = player_index ();
+}
+
+/**
+ * The track the speaker is playing and where, if it is one we know.
+ */
+static sp_track *
+player_heard (int *index, int *pos_ms)
+{
+  unsigned int serial;
+  int i;
+
+  if (audio_clock_read (&g_audiofifo, &serial, pos_ms))
+    return NULL;
+  i = serial % PLAYER_HEARD_TRACKS;
+  if (g_heard[i].serial != serial || !g_heard[i].track)
+    return NULL;
+  *index = g_heard[i].index;
+  return g_heard[i].track;
+}
+
+/**
+ * Where the speaker is in the current track, in ms; 0 while it still
+ * plays the previous track's tail. Safe from any thread.
+ */
+int
+player_position_ms (void)
+{
+  unsigned int serial;
+  int ms;
+
+  if (audio_clock_read (&g_audiofifo, &serial, &ms))
+    return audio_position_ms (&g_audiofifo);
+  return serial == audio_fifo_track (&g_audiofifo) ? ms : 0;
+}
+
+static sp_track *
+player_entry_track (const struct play_queue_entry *e)
+{
+  if (e->item)
+    return e->item;
+  return g_jukeboxlist ? sp_playlist_track (g_jukeboxlist, e->index) : NULL;
+}
+
+/**
+ * Fetch the covers of the upcoming tracks, so the OSD can switch right
+ * away. Left for later while Navit is busy.
+ */
+static void
+player_covers_prefetch (void)
+{
+  struct play_queue_entry e;
+  sp_track *t;
+  int i;
+
+  if (g_busy)
+    return;
+  for (i = 0; i < PLAYER_COVER_PREFETCH
+       && !play_queue_peek (&g_playqueue, i, &e); i++)
+    if ((t = player_entry_track (&e)))
+      art_request (t);
+}
+
+/**
+ * Have what plays next ready, so it can start (or fade in) without a
+ * gap, and the covers after it.
+ */
+static void
+player_upcoming_prefetch (void)
+{
+  struct play_queue_entry e;
+  sp_track *t;
+
+  if (!play_queue_peek (&g_playqueue, 0, &e) && (t = player_entry_track (&e))
+      && sp_track_error (t) == SP_ERROR_OK)
+    sp_session_player_prefetch (g_sess, t);
+  player_covers_prefetch ();
+}
+
+static int
+player_online (void)
+{
+  return sp_session_connectionstate (g_sess) == SP_CONNECTION_STATE_LOGGED_IN;
+}
+
+/**
+ * Move on to what plays next in g_playqueue. Without a connection,
+ * playlist tracks that aren't synced are passed over instead of stalling
+ * on them.
+ */
+static void
+player_advance (void)
+{
+  struct play_queue_entry e;
+  int tries = g_playqueue.length, skipped = 0;
+  sp_track *t;
+
+  if (g_queued)
+    {
+      sp_track_release (g_queued);
+      g_queued = NULL;
+    }
+  while (!play_queue_advance (&g_playqueue, &e))
+    {
+      if (e.item)
+        {
+          g_queued = e.item;
+          g_queued_count++;
+          break;
+        }
+      t = sp_playlist_track (g_jukeboxlist, e.index);
+      if (player_online () || !t
+          || sp_track_offline_get_status (t) == SP_TRACK_OFFLINE_DONE
+          || --tries <= 0)
+        break;
+      skipped++;
+    }
+  g_track_index = play_queue_current (&g_playqueue);
+  if (skipped)
+    dbg (1, "offline: passed over %d tracks that aren't synced\n", skipped);
+}
+
+/**
+ * Called on various events to start playback if it hasn't been started already.
+ *
+ * The function simply starts playing the current track of g_playqueue.
+ */
+static void
+try_jukebox_start (void)
+{
+  dbg (1, "Starting the jukebox\n");
+  sp_track *t;
+  g_playing=0;
+
+  if (g_queued)
+    t = g_queued;
+  else
+    {
+      if (!g_jukeboxlist)
+        {
+          dbg (1, "jukebox: No playlist. Waiting\n");
+          return;
+        }
+
+      if (!sp_playlist_num_tracks (g_jukeboxlist))
+        {
+          dbg (1,"jukebox: No tracks in playlist. Waiting\n");
+          return;
+        }
+
+      play_queue_sync (&g_playqueue, sp_playlist_num_tracks (g_jukeboxlist));
+      g_track_index = play_queue_current (&g_playqueue);
+      if (g_track_index < 0)
+        {
+          dbg (1,"jukebox: No more tracks in playlist. Waiting\n");
+          return;
+        }
+
+      t = sp_playlist_track (g_jukeboxlist, g_track_index);
+    }
+
+  if (g_currenttrack && t != g_currenttrack)
+    {
+      /* Someone changed the current track */
+      audio_fifo_flush (&g_audiofifo);
+      trace (FLUSH, g_track_index, 0);
+      if (delivery_trace_active)
+        delivery_trace_event (DELIVERY_TRACE_FLUSH, 0);
+      sp_session_player_unload (g_sess);
+      sp_track_release (g_currenttrack);
+      g_currenttrack = NULL;
+    }
+
+  if (!t)
+    return;
+
+  if (sp_track_error (t) != SP_ERROR_OK)
+    return;
+
+  if (g_currenttrack == t)
+    return;
+
+  g_currenttrack = t;
+  sp_track_add_ref (t);
+  player_heard_tag (t);
+
+  trace (TRACK_START, player_index (), sp_track_duration (t));
+  dbg (1,"jukebox: Now playing \"%s\"...\n", sp_track_name (t));
+
+  player_loudness_apply (t);
+  player_trim_apply (t);
+  player_bitrate_update ();
+
+  /* An end of the track before that is still pending is moot now */
+  __atomic_store_n (&g_track_ended, 0, __ATOMIC_RELEASE);
+  sp_session_player_load (g_sess, t);
+  g_playing=1;
+  sp_session_player_play (g_sess, 1);
+
+  player_upcoming_prefetch ();
+}
+
+/**
+ * Keep the play order in step with edits of the playlist we play.
+ */
+static void
+tracks_added (sp_playlist * pl, sp_track * const *tracks, int num_tracks,
+              int position, void *userdata)
+{
+  int stopped;
+
+  if (pl != g_jukeboxlist)
+    return;
+  /* Played to the end of the order: carry on with what was added */
+  stopped = !g_currenttrack && g_logged_in && g_playqueue.length
+    && play_queue_current (&g_playqueue) < 0;
+  play_queue_added (&g_playqueue, position, num_tracks);
+  if (stopped)
+    {
+      player_advance ();
+      try_jukebox_start ();
+      return;
+    }
+  if (!g_queued)
+    g_track_index = play_queue_current (&g_playqueue);
+  player_upcoming_prefetch ();
+}
+
+static void
+tracks_removed (sp_playlist * pl, const int *tracks, int num_tracks,
+                void *userdata)
+{
+  if (pl != g_jukeboxlist)
+    return;
+  play_queue_removed (&g_playqueue, tracks, num_tracks);
+  if (!g_queued)
+    g_track_index = play_queue_current (&g_playqueue);
+  player_upcoming_prefetch ();
+}
+
+static void
+tracks_moved (sp_playlist * pl, const int *tracks, int num_tracks,
+              int new_position, void *userdata)
+{
+  if (pl != g_jukeboxlist)
+    return;
+  play_queue_moved (&g_playqueue, tracks, num_tracks, new_position);
+  if (!g_queued)
+    g_track_index = play_queue_current (&g_playqueue);
+  player_upcoming_prefetch ();
+}
+
+/**
+ * The callbacks we are interested in for individual playlists.
+ */
+static sp_playlist_callbacks pl_callbacks = {
+  .tracks_added = &tracks_added,
+  .tracks_removed = &tracks_removed,
+  .tracks_moved = &tracks_moved,
+//        .playlist_renamed = &playlist_renamed,
+};
+
+/* --------------------  PLAYLIST CONTAINER CALLBACKS  --------------------- */
+/**
+ * Callback from libspotify, telling us a playlist was added to the playlist container.
+ *
+ * We add our playlist callbacks to the newly added playlist.
+ *
+ * @param  pc            The playlist container handle
+ * @param  pl            The playlist handle
+ * @param  position      Index of the added playlist
+ * @param  userdata      The opaque pointer
+ */
+static void
+playlist_added (sp_playlistcontainer * pc, sp_playlist * pl,
+		int position, void *userdata)
+{
+  sp_playlist_add_callbacks (pl, &pl_callbacks, NULL);
+  dbg (1, "List name: %s\n", sp_playlist_name (pl));
+
+  if (!strcasecmp (sp_playlist_name (pl), g_cfg->playlist))
+    {
+      g_jukeboxlist = pl;
+      try_jukebox_start ();
+    }
+}
+
+
+/**
+ * Callback from libspotify, telling us the rootlist is fully synchronized
+ * We can resume playback
+ *
+ * @param  pc            The playlist container handle
+ * @param  userdata      The opaque pointer
+ */
+static void
+container_loaded (sp_playlistcontainer * pc, void *userdata)
+{
+  dbg (1, "jukebox: Rootlist synchronized (%d playlists)\n",
+	   sp_playlistcontainer_num_playlists (pc));
+  try_jukebox_start ();
+}
+
+/**
+ * The playlist container callbacks
+ */
+static sp_playlistcontainer_callbacks pc_callbacks = {
+  .playlist_added = &playlist_added,
+//        .playlist_removed = &playlist_removed,
+  .container_loaded = &container_loaded,
+};
+
+/**
+ * Make pl the playlist we play, and have it synced for offline use.
+ */
+static void
+player_playlist_select (sp_playlist * pl)
+{
+  trace (PLAYLIST, sp_playlist_num_tracks (pl),
+         sp_playlist_get_offline_status (g_sess, pl));
+  dbg (1,"Found the playlist %s\n", g_cfg->playlist);
+  switch (sp_playlist_get_offline_status (g_sess, pl))
+    {
+    case SP_PLAYLIST_OFFLINE_STATUS_NO:
+      dbg (1, "Playlist is not offline enabled.\n");
+      sp_playlist_set_offline_mode (g_sess, pl, 1);
+      dbg (1, "  %d tracks to sync\n",
+              sp_offline_tracks_to_sync (g_sess));
+      break;
+
+    case SP_PLAYLIST_OFFLINE_STATUS_YES:
+      dbg (1, "Playlist is synchronized to local storage.\n");
+      break;
+
+    case SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING:
+      dbg
+        (1, "This playlist is currently downloading. Only one playlist can be in this state any given time.\n");
+      break;
+
+    case SP_PLAYLIST_OFFLINE_STATUS_WAITING:
+      dbg (1, "Playlist is queued for download.\n");
+      break;
+
+    default:
+      dbg (1, "unknow state\n");
+      break;
+    }
+  g_jukeboxlist = pl;
+  play_queue_reset (&g_playqueue, sp_playlist_num_tracks (pl));
+  g_track_index = play_queue_current (&g_playqueue);
+  /* Before the sync starts, so it starts at a bitrate that fits */
+  player_bitrate_update ();
+}
+
+static void
+on_login (sp_session * session, sp_error error)
+{
+  if (error != SP_ERROR_OK)
+    {
+      dbg (0, "Error: unable to log in: %s\n",
+	       sp_error_message (error));
+      exit (1);
+    }
+
+  g_logged_in = 1;
+  sp_playlistcontainer *pc = sp_session_playlistcontainer (session);
+  int i;
+
+  sp_playlistcontainer_add_callbacks (pc, &pc_callbacks, NULL);
+  trace (LOGIN, error, sp_playlistcontainer_num_playlists (pc));
+
+  for (i = 0; i < sp_playlistcontainer_num_playlists (pc); ++i)
+    {
+      sp_playlist *pl = sp_playlistcontainer_playlist (pc, i);
+
+      sp_playlist_add_callbacks (pl, &pl_callbacks, NULL);
+
+      if (!strcasecmp (sp_playlist_name (pl), g_cfg->playlist))
+        {
+          player_playlist_select (pl);
+          // try_jukebox_start ();
+        }
+    }
+  if (!g_jukeboxlist)
+    {
+      dbg (0, "jukebox: No such playlist. Waiting for one to pop up...\n");
+    }
+  // try_jukebox_start ();
+
+
+}
+
+/**
+ * Queue what libspotify delivered, and tell it how many frames were
+ * taken. Replayed traces come in here too.
+ */
+static int
+player_deliver (const sp_audioformat * format, const void *frames,
+                int num_frames)
+{
+  audio_fifo_t *af = &g_audiofifo;
+  audio_fifo_data_t *afd;
+  size_t s;
+  const int16_t *samples = frames;
+  int mixed = 0, dropped;
+
+  if (num_frames == 0)
+    return 0;                   // Audio discontinuity, do nothing
+
+  pthread_mutex_lock (&af->mutex);
+
+  /*
+   * Still from before the seek player_seek() is making: taking none of
+   * it leaves libspotify to drop it on the seek, instead of counting it
+   * as played from the new position
+   */
+  if (g_seeking)
+    {
+      pthread_mutex_unlock (&af->mutex);
+      return 0;
+    }
+
+  /* Silence trimmed off the start or end is consumed but never queued */
+  dropped = audio_trim_input (af, format->sample_rate, format->channels,
+                              &samples, &num_frames);
+  frames = samples;
+  if (!num_frames)
+    {
+      pthread_mutex_unlock (&af->mutex);
+      return dropped;
+    }
+
+  /* The first frames of a track may overlap the tail of the previous one */
+  if (af->xfade_chunk)
+    {
+      mixed = audio_xfade_mix (af, format->sample_rate, format->channels,
+                               frames, num_frames);
+      af->pos_frames += mixed;
+      frames = (const int16_t *) frames + mixed * format->channels;
+      num_frames -= mixed;
+      if (!num_frames)
+        {
+          pthread_mutex_unlock (&af->mutex);
+          return dropped + mixed;
+        }
+    }
+
+  /*
+   * Buffer a second of audio (more ahead of a coverage gap or while Navit
+   * is busy), plus what a crossfade needs
+   */
+  if (af->qlen > (int64_t) format->sample_rate
+      * (MAX (g_buffer_ms, g_busy ? PLAYER_BUFFER_BUSY_MS : 0)
+         + g_cfg->crossfade_ms) / 1000)
+    {
+      pthread_mutex_unlock (&af->mutex);
+
+      return dropped + mixed;
+    }
+
+  s = num_frames * sizeof (int16_t) * format->channels;
+
+  afd = malloc (sizeof (*afd) + s);
+  memcpy (afd->samples, frames, s);
+
+  afd->nsamples = num_frames;
+
+  afd->rate = format->sample_rate;
+  afd->channels = format->channels;
+  afd->epoch = af->epoch;
+  afd->track = af->track;
+  afd->frame = (int64_t) af->pos_ms * format->sample_rate / 1000
+    + af->pos_frames;
+  afd->flags = 0;
+  audio_xfade_fadein (af, afd);
+  audio_trim_queued (af, afd);
+
+  TAILQ_INSERT_TAIL (&af->q, afd, link);
+  af->qlen += num_frames;
+  af->rate = format->sample_rate;
+  af->channels = format->channels;
+  af->pos_frames += num_frames;
+
+  pthread_cond_signal (&af->cond);
+  pthread_mutex_unlock (&af->mutex);
+
+  return dropped + mixed + num_frames;
+}
+
+static int
+on_music_delivered (sp_session * session, const sp_audioformat * format,
+                    const void *frames, int num_frames)
+{
+  int accepted;
+
+  trace_begin (DELIVERY, num_frames, 0);
+  accepted = player_deliver (format, frames, num_frames);
+  trace_end (DELIVERY, num_frames, accepted);
+  if (delivery_trace_active)
+    delivery_trace_music (format->sample_rate, format->channels, frames,
+                          num_frames, accepted);
+  return accepted;
+}
+
+/**
+ * Called from a libspotify thread when sp_session_process_events() is due
+ * before the timeout it last returned. Wakes up the main loop through
+ * player_notify_fd().
+ */
+static void
+on_main_thread_notified (sp_session * session)
+{
+  uint64_t one = 1;
+
+  if (write (g_notify_fd, &one, sizeof (one)) < 0)
+    return;			/* already pending */
+}
+
+/**
+ * Called from libspotify's delivery thread once the last frame of the
+ * track is delivered. The player state is the main loop's, so all this
+ * does is have player_process() move on.
+ */
+static void
+on_end_of_track (sp_session * session)
+{
+  __atomic_store_n (&g_track_ended, 1, __ATOMIC_RELEASE);
+  on_main_thread_notified (session);
+}
+
+static sp_session_callbacks session_callbacks = {
+  .logged_in = &on_login,
+  .notify_main_thread = &on_main_thread_notified,
+  .music_delivery = &on_music_delivered,
+//  .log_message = &on_log,
+  .end_of_track = &on_end_of_track,
+//  .offline_status_updated = &offline_status_updated,
+//  .play_token_lost = &play_token_lost,
+};
+
+static sp_session_config spconfig = {
+  .api_version = SPOTIFY_API_VERSION,
+  .application_key = g_appkey,
+  .application_key_size = 0,	// set in player_start()
+  .user_agent = "spot",
+  .callbacks = &session_callbacks,
+  NULL
+};
+
+/**
+ * Make sure the music that plays until the end of the next coverage gap
+ * is local before we enter it.
+ *
+ * The rest of a streamed current track is pulled into the fifo, the next
+ * track is prefetched and anything further out has to come from the
+ * playlist's offline copy, whose sync we (re)enable if needed.
+ */
+void
+player_prefetch_apply (const struct prefetch_plan *plan)
+{
+  struct play_queue_entry e;
+  int covered_ms, need_ms, missing = 0, i;
+  sp_track *t;
+
+  g_buffer_ms = g_cfg->buffer_ms;
+  if (plan->gap_start_s < 0)
+    {
+      dbg (1, "prefetch: no coverage gap on the remaining %d s of route\n",
+           plan->duration_s);
+      return;
+    }
+  if (!g_currenttrack || !g_jukeboxlist)
+    return;
+
+  need_ms = plan->need_s * 1000;
+  covered_ms = sp_track_duration (g_currenttrack)
+    - audio_position_ms (&g_audiofifo);
+  if (sp_track_offline_get_status (g_currenttrack) != SP_TRACK_OFFLINE_DONE)
+    g_buffer_ms = CLAMP (covered_ms, g_cfg->buffer_ms, PLAYER_BUFFER_MAX_MS);
+
+  /* In play order, shuffled or queued */
+  for (i = 0; covered_ms < need_ms && !play_queue_peek (&g_playqueue, i, &e);
+       i++)
+    {
+      t = player_entry_track (&e);
+      if (!t || sp_track_error (t) != SP_ERROR_OK)
+        continue;
+      if (sp_track_offline_get_status (t) != SP_TRACK_OFFLINE_DONE)
+        {
+          if (!i)
+            sp_session_player_prefetch (g_sess, t);
+          else
+            missing++;
+        }
+      covered_ms += sp_track_duration (t);
+    }
+
+  if (missing && sp_playlist_get_offline_status (g_sess, g_jukeboxlist)
+      == SP_PLAYLIST_OFFLINE_STATUS_NO)
+    sp_playlist_set_offline_mode (g_sess, g_jukeboxlist, 1);
+
+  dbg (1, "prefetch: no coverage in %d s until %d s, %d tracks still to sync%s\n",
+       plan->gap_start_s, plan->gap_end_s, missing,
+       covered_ms < need_ms ? ", playlist too short to cover it" : "");
+}
+
+/**
+ * Go back to buffering the configured depth ahead, when there is no
+ * route to prefetch for any more.
+ */
+void
+player_buffer_reset (void)
+{
+  g_buffer_ms = g_cfg->buffer_ms;
+}
+
+/**
+ * Find the playlist called name among the user's playlists.
+ */
+static sp_playlist *
+player_playlist_find (const char *name)
+{
+  sp_playlistcontainer *pc = sp_session_playlistcontainer (g_sess);
+  sp_playlist *pl;
+  int i;
+
+  for (i = 0; pc && i < sp_playlistcontainer_num_playlists (pc); i++)
+    {
+      pl = sp_playlistcontainer_playlist (pc, i);
+      if (pl && !strcasecmp (sp_playlist_name (pl), name))
+        return pl;
+    }
+  return NULL;
+}
+
+/**
+ * Pick up how an output change asked of audio_set_output() went: keep
+ * the device and period the zones took, and log what they refused.
+ */
+static void
+player_output_check (void)
+{
+  char dev[64];
+  int period, state;
+
+  state = audio_output_switched (&g_audiofifo, dev, sizeof (dev), &period);
+  if (state == AUDIO_SWITCH_IDLE)
+    return;
+  g_output_state = state;
+  if (state == AUDIO_SWITCH_DONE)
+    {
+      if (*dev)
+        {
+          g_free (g_device);
+          g_cfg->device = g_device = g_strdup (dev);
+        }
+      if (period)
+        g_cfg->period = period;
+    }
+  else if (state == AUDIO_SWITCH_FAILED)
+    dbg (0, "can't play on %s with a period of %d frames\n",
+         *dev ? dev : "the zones", period);
+}
+
+/**
+ * Change a setting while playing, without losing what is buffered:
+ * "device" (the first zone's ALSA device), "period" (the zones' ALSA
+ * period, in frames), "buffer" (ms buffered ahead), "playlist", which
+ * starts over from its first track, "shuffle" or "repeat" (0 or 1). A
+ * device or period change is left to the output threads, which drain
+ * into the old device first: it shows in the report once they are done,
+ * or the next report says the devices refused it.
+ *
+ * @param  name          The setting, or NULL to change nothing
+ * @param  value         Its new value
+ * @param  report        Gets the configuration in effect, after why the
+ *                       change was refused if it was
+ * @return 0, or -1 if the change was refused and the old setting kept
+ */
+int
+player_reconfigure (const char *name, const char *value, char *report,
+                    int len)
+{
+  const char *err = NULL;
+  char dev[64];
+  int period, buffer, n;
+  sp_playlist *pl;
+
+  n = value ? atoi (value) : 0;
+  if (!name)
+    ;
+  else if (!value || !*value)
+    err = "no value";
+  else if (!strcmp (name, "device"))
+    audio_set_output (&g_audiofifo, value, 0);
+  else if (!strcmp (name, "period"))
+    {
+      if (n < AUDIO_PERIOD_MIN || n > AUDIO_PERIOD_MAX)
+        err = "out of range";
+      else
+        audio_set_output (&g_audiofifo, NULL, n);
+    }
+  else if (!strcmp (name, "buffer"))
+    {
+      if (n < PLAYER_BUFFER_MIN_MS || n > PLAYER_BUFFER_MAX_MS)
+        err = "out of range";
+      else
+        {
+          /* A deeper buffer a prefetch plan asked for stays */
+          if (g_buffer_ms == g_cfg->buffer_ms || g_buffer_ms < n)
+            g_buffer_ms = n;
+          g_cfg->buffer_ms = n;
+        }
+    }
+  else if (!strcmp (name, "playlist"))
+    {
+      pl = g_logged_in ? player_playlist_find (value) : NULL;
+      if (g_logged_in && !pl)
+        err = "no such playlist";
+      else
+        {
+          g_free (g_playlist);
+          g_cfg->playlist = g_playlist = g_strdup (value);
+          /* Otherwise on_login() picks it */
+          if (pl && pl != g_jukeboxlist)
+            {
+              player_playlist_select (pl);
+              try_jukebox_start ();
+            }
+        }
+    }
+  else if (!strcmp (name, "shuffle"))
+    {
+      g_cfg->shuffle = n != 0;
+      play_queue_set_shuffle (&g_playqueue, g_cfg->shuffle);
+      player_upcoming_prefetch ();
+    }
+  else if (!strcmp (name, "repeat"))
+    {
+      g_playqueue.repeat = g_cfg->repeat = n != 0;
+      player_upcoming_prefetch ();
+    }
+  else
+    err = "unknown setting";
+
+  /* What the first zone's device actually took */
+  player_output_check ();
+  audio_get_output (&g_audiofifo, dev, sizeof (dev), &period, &buffer);
+  if (err)
+    n = snprintf (report, len, "%s %s: %s; ", name, value ? value : "", err);
+  else
+    n = 0;
+  if (n < len && g_output_state == AUDIO_SWITCH_PENDING)
+    n += snprintf (report + n, len - n, "output switching; ");
+  else if (n < len && g_output_state == AUDIO_SWITCH_FAILED)
+    n += snprintf (report + n, len - n, "the devices refused the last output change; ");
+  if (g_output_state != AUDIO_SWITCH_PENDING)
+    g_output_state = AUDIO_SWITCH_IDLE;
+  if (n < len)
+    snprintf (report + n, len - n,
+              "device %s, period %d frames, device buffer %d frames, buffer %d ms, playlist %s, shuffle %s, repeat %s",
+              dev, period, buffer, g_cfg->buffer_ms,
+              g_cfg->playlist ? g_cfg->playlist : "none",
+              g_cfg->shuffle ? "on" : "off", g_cfg->repeat ? "on" : "off");
+  if (name)
+    dbg (err ? 0 : 1, "config: %s\n", report);
+  return err ? -1 : 0;
+}
+
+/**
+ * Hand the configured filter chain to the output, with the EQ biquads
+ * bypassed while Navit is busy. Balance, fader and limiter always run.
+ */
+static void
+player_dsp_apply (void)
+{
+  dsp_chain_cfg_t dsp = g_cfg->dsp;
+
+  if (!g_cfg->dsp_enabled)
+    return;
+  if (g_busy)
+    dsp.nbiquads = 0;
+  audio_set_dsp (&g_audiofifo, dsp_chain_new (&dsp));
+}
+
+/**
+ * Make room for Navit while it is busy (calculating a route, or its main
+ * loop lagging) and take it back when it is done. While busy we buffer at
+ * least PLAYER_BUFFER_BUSY_MS ahead, so the output rides out a main loop
+ * that doesn't get to process_events, hold the offline sync back, leave
+ * cover prefetching for later and bypass the EQ and the spectrum
+ * analyser. Music playback itself is left alone.
+ *
+ * @param  busy          Whether Navit is busy now
+ * @param  reason        What says so, for the log
+ */
+void
+player_load_shed (int busy, const char *reason)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  busy = !!busy;
+  if (busy == g_busy)
+    return;
+  g_busy = busy;
+  trace (LOAD, busy, 0);
+
+  if (busy)
+    {
+      g_busy_since = now;
+      g_busy_count++;
+      sp_session_set_connection_rules (g_sess, SP_CONNECTION_RULE_NETWORK);
+      player_dsp_apply ();
+      spectrum_pause (1);
+      dbg (1, "load: navit busy (%s), shedding sync, prefetch, eq and spectrum\n",
+           reason);
+      return;
+    }
+
+  g_busy_us += now - g_busy_since;
+  /* libspotify's default rules, which we otherwise leave alone */
+  sp_session_set_connection_rules (g_sess, SP_CONNECTION_RULE_NETWORK
+                                   | SP_CONNECTION_RULE_ALLOW_SYNC_OVER_WIFI);
+  player_dsp_apply ();
+  spectrum_pause (0);
+  player_covers_prefetch ();
+  dbg (1, "load: navit idle again (%s) after %lld ms, restored\n", reason,
+       (long long) (now - g_busy_since) / 1000);
+}
+
+/**
+ * Publish what the player is doing for readers of player_state_read().
+ *
+ * This is the only place the player globals are read for the UI, so the
+ * OSD sees one consistent snapshot instead of fields libspotify callbacks
+ * may be changing under it. Position and buffer fill are rounded to
+ * PLAYER_STATE_RESOLUTION_MS so watchers aren't woken on every idle.
+ */
+static void
+player_publish (void)
+{
+  struct player_state st;
+  sp_track *t;
+  int index, pos_ms;
+
+  /* What is heard, rather than delivered, once the speaker has begun */
+  t = player_heard (&index, &pos_ms);
+  if (!t)
+    {
+      t = g_currenttrack;
+      index = player_index ();
+      pos_ms = audio_position_ms (&g_audiofifo);
+    }
+
+  memset (&st, 0, sizeof (st));
+  if (t)
+    {
+      g_strlcpy (st.track, sp_track_name (t), sizeof (st.track));
+      if (sp_track_num_artists (t) > 0)
+        g_strlcpy (st.artist, sp_artist_name (sp_track_artist (t, 0)),
+                   sizeof (st.artist));
+      st.duration_ms = sp_track_duration (t);
+      st.position_ms = MIN (pos_ms, st.duration_ms)
+        / PLAYER_STATE_RESOLUTION_MS * PLAYER_STATE_RESOLUTION_MS;
+    }
+  st.index = index;
+  st.buffer_ms = audio_buffered_ms (&g_audiofifo)
+    / PLAYER_STATE_RESOLUTION_MS * PLAYER_STATE_RESOLUTION_MS;
+  st.playing = g_playing;
+
+  /* The album may only be known once the track's metadata has loaded */
+  if (t && t != g_cover_track && !art_request (t))
+    g_cover_track = t;
+  if (t)
+    art_path (t, st.cover, sizeof (st.cover));
+
+  switch (sp_session_connectionstate (g_sess))
+    {
+    case SP_CONNECTION_STATE_LOGGED_IN:
+      st.connection = PLAYER_ONLINE;
+      break;
+    case SP_CONNECTION_STATE_DISCONNECTED:
+      st.connection = PLAYER_DISCONNECTED;
+      break;
+    case SP_CONNECTION_STATE_OFFLINE:
+      st.connection = PLAYER_OFFLINE;
+      break;
+    default:
+      st.connection = PLAYER_LOGGED_OUT;
+      break;
+    }
+
+  player_state_publish (&st);
+}
+
+/**
+ * Seek the current track to pos_ms.
+ *
+ * Short forward skips are served from what is already queued; anything
+ * else goes through libspotify and only the stale part of the fifo is
+ * dropped.
+ */
+void
+player_seek (int pos_ms)
+{
+  int duration, cur;
+
+  if (!g_currenttrack)
+    return;
+
+  duration = sp_track_duration (g_currenttrack);
+  if (pos_ms < 0)
+    pos_ms = 0;
+  if (duration > 0 && pos_ms >= duration)
+    pos_ms = duration - 1;
+
+  cur = audio_position_ms (&g_audiofifo);
+  if (pos_ms > cur && !audio_fifo_skip (&g_audiofifo, pos_ms - cur))
+    {
+      if (delivery_trace_active)
+        delivery_trace_event (DELIVERY_TRACE_SKIP, pos_ms - cur);
+      trace (SEEK, pos_ms, 1);
+      return;
+    }
+
+  /*
+   * Deliveries are refused until libspotify has seeked, so the new epoch
+   * only ever tags frames from the new position, and none of those are
+   * taken for stale audio and dropped
+   */
+  pthread_mutex_lock (&g_audiofifo.mutex);
+  g_seeking = 1;
+  pthread_mutex_unlock (&g_audiofifo.mutex);
+  audio_fifo_seek (&g_audiofifo, pos_ms);
+  if (delivery_trace_active)
+    delivery_trace_event (DELIVERY_TRACE_SEEK, pos_ms);
+  sp_session_player_seek (g_sess, pos_ms);
+  pthread_mutex_lock (&g_audiofifo.mutex);
+  g_seeking = 0;
+  pthread_mutex_unlock (&g_audiofifo.mutex);
+  trace (SEEK, pos_ms, 0);
+}
+
+/**
+ * Skip ms forward, or back if negative. Going back is served from the
+ * replay buffer when it still holds the audio.
+ */
+void
+player_skip (int ms)
+{
+  if (ms < 0 && !audio_replay_rewind (&g_audiofifo, -ms))
+    {
+      dbg (1, "rewound %d ms from the replay buffer\n", -ms);
+      return;
+    }
+  player_seek (player_position_ms () + ms);
+}
+
+void
+player_previous (void)
+{
+  if (g_currenttrack && player_position_ms () > PLAYER_RESTART_MS)
+    {
+      trace (PREVIOUS, player_index (), 1);
+      if (!audio_replay_rewind (&g_audiofifo, -1))
+        {
+          dbg (1, "restarting track from the replay buffer\n");
+        }
+      else
+        player_seek (0);
+      return;
+    }
+  if (g_queued)
+    {
+      /* Back to the playlist track it followed */
+      sp_track_release (g_queued);
+      g_queued = NULL;
+    }
+  else
+    play_queue_back (&g_playqueue);
+  g_track_index = play_queue_current (&g_playqueue);
+  trace (PREVIOUS, g_track_index, 0);
+  try_jukebox_start();
+}
+
+void
+player_next (void)
+{
+  player_advance ();
+  trace (NEXT, player_index (), 0);
+  try_jukebox_start();
+}
+
+/**
+ * Play the track at uri after the current one, before the playlist
+ * carries on; right away if the playlist has run out.
+ *
+ * @return 0, or -1 if uri is not a track or the queue is full
+ */
+int
+player_enqueue (const char *uri)
+{
+  sp_link *link = sp_link_create_from_string (uri);
+  sp_track *t = link ? sp_link_as_track (link) : NULL;
+
+  if (t)
+    sp_track_add_ref (t);
+  if (link)
+    sp_link_release (link);
+  if (!t)
+    return -1;
+  if (play_queue_enqueue (&g_playqueue, t))
+    {
+      sp_track_release (t);
+      return -1;
+    }
+  dbg (1, "queued %s, %d tracks queued\n", uri, play_queue_queued (&g_playqueue));
+
+  if (!g_currenttrack && g_logged_in && play_queue_current (&g_playqueue) < 0)
+    {
+      player_advance ();
+      try_jukebox_start ();
+    }
+  else
+    player_upcoming_prefetch ();
+  return 0;
+}
+
+void
+player_stats (void)
+{
+  audio_stats_t st;
+  struct search_stats ss;
+
+  audio_get_stats (&g_audiofifo, &st);
+  dbg (0, "audio: %u seeks (%u from replay buffer), seek latency %u us (max %u us), %u stale chunks, %u xruns\n",
+       st.seeks, st.replays, st.seek_latency_us, st.seek_latency_max_us,
+       st.stale_chunks, st.xruns);
+  dbg (0, "audio: %u prompts (%u dropped), prompt latency %u us (max %u us)\n",
+       st.prompts, st.prompts_dropped, st.prompt_latency_us,
+       st.prompt_latency_max_us);
+  dbg (0, "audio: volume %d dB, %u chunks limited, %u crossfades\n",
+       g_cfg->volume_db, st.limited_chunks, st.crossfades);
+  if (st.written_us)
+    dbg (0, "audio: %.1f alsa calls/s (%.1f writes/s), %.1f wakeups/s of audio\n",
+         st.pcm_calls * 1e6 / st.written_us, st.pcm_writes * 1e6 / st.written_us,
+         st.wakeups * 1e6 / st.written_us);
+  if (st.zone_skipped)
+    dbg (0, "audio: %u chunks skipped by lagging zones\n", st.zone_skipped);
+  if (st.dsp_audio_us)
+    dbg (0, "audio: dsp cpu eq %.2f%%, balance %.2f%%, limiter %.2f%%\n",
+         st.dsp_ns[DSP_STAGE_EQ] / (st.dsp_audio_us * 10.0),
+         st.dsp_ns[DSP_STAGE_BALANCE] / (st.dsp_audio_us * 10.0),
+         st.dsp_ns[DSP_STAGE_LIMITER] / (st.dsp_audio_us * 10.0));
+  dbg (0, "queue: %d tracks queued, %d of %d in the playlist order, shuffle %s, repeat %s\n",
+       play_queue_queued (&g_playqueue), g_playqueue.pos + 1, g_playqueue.length,
+       g_playqueue.shuffle ? "on" : "off", g_playqueue.repeat ? "on" : "off");
+  if (g_currenttrack)
+    dbg (0, "clock: speaker at %d ms, delivery at %d ms\n",
+         player_position_ms (), audio_position_ms (&g_audiofifo));
+  dbg (0, "load: navit %s, busy %u times for %lld s in all\n",
+       g_busy ? "busy" : "idle", g_busy_count,
+       (long long) (g_busy_us + (g_busy ? g_get_monotonic_time ()
+                                 - g_busy_since : 0)) / G_USEC_PER_SEC);
+  if (g_bitrate.stream_kbps > 0)
+    dbg (0, "bitrate: streaming %d kbps, offline %d kbps%s, %u changes; last track %u xruns, cpu %d%%, cache %llu/%llu MB free, %llu min to sync\n",
+         g_bitrate.stream_kbps, g_bitrate.offline_kbps,
+         g_bitrate.fixed_kbps ? " (fixed)" : "", g_bitrate.changes,
+         g_bitrate.xruns_last, g_bitrate.cpu_busy,
+         (unsigned long long) (g_bitrate.cache_free >> 20),
+         (unsigned long long) (g_bitrate.cache_total >> 20),
+         (unsigned long long) (g_bitrate.offline_ms / 60000));
+  search_get_stats (&ss);
+  if (ss.queries)
+    dbg (0, "search: %u queries, %u from the cache, %u from a shorter query, %u pages fetched, %u failed, %u queries cached\n",
+         ss.queries, ss.hits, ss.prefix_hits, ss.pages, ss.failures,
+         ss.entries);
+}
+
+void
+player_volume_step (int db)
+{
+  g_cfg->volume_db += db;
+  if (g_cfg->volume_db < PLAYER_VOLUME_MIN_DB)
+    g_cfg->volume_db = PLAYER_VOLUME_MIN_DB;
+  if (g_cfg->volume_db > PLAYER_VOLUME_MAX_DB)
+    g_cfg->volume_db = PLAYER_VOLUME_MAX_DB;
+  audio_set_volume (&g_audiofifo, dsp_gain_from_db (g_cfg->volume_db));
+  trace (VOLUME, g_cfg->volume_db, 0);
+}
+
+void
+player_toggle (void)
+{
+  if(g_playing){
+  	sp_session_player_play(g_sess,0);
+  } else {
+  	sp_session_player_play(g_sess,1);
+  }
+  g_playing=!g_playing;
+  trace (PLAY, g_playing, 0);
+}
+
+/**
+ * Carry out the commands MPRIS clients sent, on the main loop where
+ * libspotify may be called.
+ */
+void
+player_mpris_commands (void)
+{
+  struct mpris_command cmd;
+
+  while (!mpris_poll (&cmd))
+    switch (cmd.action)
+      {
+      case MPRIS_PLAY:
+        if (!g_playing)
+          player_toggle ();
+        break;
+      case MPRIS_PAUSE:
+        if (g_playing)
+          player_toggle ();
+        break;
+      case MPRIS_PLAY_PAUSE:
+        player_toggle ();
+        break;
+      case MPRIS_STOP:
+        if (g_playing)
+          player_toggle ();
+        player_seek (0);
+        break;
+      case MPRIS_NEXT:
+        player_next ();
+        break;
+      case MPRIS_PREVIOUS:
+        player_previous ();
+        break;
+      case MPRIS_SEEK:
+        player_seek (player_position_ms () + cmd.us / 1000);
+        break;
+      case MPRIS_SET_POSITION:
+        player_seek (cmd.us / 1000);
+        break;
+      }
+}
+
+void
+player_config_init (struct player_config *cfg)
+{
+  memset (cfg, 0, sizeof (*cfg));
+  cfg->cache_dir = "tmp";
+  cfg->replay_kb = PLAYER_REPLAY_KB;
+  cfg->cover_size = PLAYER_COVER_SIZE;
+  cfg->spectrum_fps = PLAYER_SPECTRUM_FPS;
+  cfg->buffer_ms = PLAYER_BUFFER_MS;
+  cfg->search_cache = SEARCH_CACHE_ENTRIES;
+}
+
+audio_fifo_t *
+player_audio (void)
+{
+  return &g_audiofifo;
+}
+
+/**
+ * The current track is delivered to its end, or its trimmed end: let
+ * what is queued play out and have the next track follow it.
+ */
+static void
+player_end_of_track (void)
+{
+  /* Crossfade into the next track, if asked to, rather than flush */
+  if (g_currenttrack)
+    {
+      player_trim_store (g_currenttrack);
+    }
+  audio_fifo_boundary (&g_audiofifo, g_cfg->crossfade_ms);
+  trace (END_OF_TRACK, player_index (), 0);
+  if (delivery_trace_active)
+    delivery_trace_event (DELIVERY_TRACE_END_OF_TRACK, g_cfg->crossfade_ms);
+  if (g_currenttrack)
+    sp_track_release (g_currenttrack);
+  g_currenttrack = NULL;
+
+  player_advance ();
+  try_jukebox_start ();
+}
+
+/**
+ * Readable when libspotify wants player_process() called before the
+ * timeout it last returned.
+ */
+int
+player_notify_fd (void)
+{
+  return g_notify_fd;
+}
+
+/**
+ * Start the audio output, with what cfg asks for around it.
+ */
+static void
+player_audio_start (struct player_config *cfg)
+{
+  char *path;
+
+  g_cfg = cfg;
+  if (cfg->trace)
+    {
+      path = g_build_filename (cfg->cache_dir, "trace.bin", NULL);
+      if (trace_start (trace_parse_mask (cfg->trace), path))
+        dbg (0, "can't trace to %s\n", path);
+      g_free (path);
+    }
+  cfg->buffer_ms = CLAMP (cfg->buffer_ms, PLAYER_BUFFER_MIN_MS,
+                          PLAYER_BUFFER_MAX_MS);
+  g_buffer_ms = cfg->buffer_ms;
+  if (cfg->period
+      && (cfg->period < AUDIO_PERIOD_MIN || cfg->period > AUDIO_PERIOD_MAX))
+    {
+      dbg (0, "bad period %d, using %d\n", cfg->period, AUDIO_PERIOD);
+      cfg->period = 0;
+    }
+  /* A device change frees the one before, so keep a copy of our own */
+  if (cfg->device)
+    cfg->device = g_device = g_strdup (cfg->device);
+  audio_init (&g_audiofifo, cfg->zones);
+  if (cfg->device || cfg->period)
+    audio_set_output (&g_audiofifo, cfg->device, cfg->period);
+  audio_replay_set_budget (&g_audiofifo, (size_t) cfg->replay_kb * 1024);
+  audio_set_volume (&g_audiofifo, dsp_gain_from_db (cfg->volume_db));
+  if (cfg->dsp_enabled)
+    audio_set_dsp (&g_audiofifo, dsp_chain_new (&cfg->dsp));
+  if (cfg->spectrum_fps && spectrum_start (cfg->spectrum_fps))
+    cfg->spectrum_fps = 0;
+  if (cfg->pcm_export && pcm_export_start (cfg->pcm_export))
+    dbg (0, "can't export PCM on %s\n", cfg->pcm_export);
+}
+
+/**
+ * Create the session, log in and start the audio output and the
+ * services cfg asks for.
+ *
+ * @return 0, or -1 if there is no session to play from
+ */
+int
+player_start (struct player_config *cfg)
+{
+  sp_error error;
+  sp_session *session;
+  char *index_path;
+
+  g_notify_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  spconfig.cache_location = cfg->cache_dir;
+  spconfig.settings_location = cfg->cache_dir;
+  spconfig.application_key_size = g_appkey_size;
+  error = sp_session_create (&spconfig, &session);
+  if (error != SP_ERROR_OK)
+    {
+      dbg (0, "Can't create spotify session: %s\n", sp_error_message (error));
+      return -1;
+    }
+  dbg (1, "Session created successfully :)\n");
+  g_sess = session;
+  g_logged_in = 0;
+  play_queue_init (&g_playqueue, g_get_real_time ());
+  g_playqueue.shuffle = cfg->shuffle;
+  g_playqueue.repeat = cfg->repeat;
+  bitrate_policy_init (&g_bitrate, cfg->bitrate_kbps);
+  if (cfg->trace_file
+      && delivery_trace_start (cfg->trace_file, cfg->trace_pcm))
+    dbg (0, "can't record deliveries to %s\n", cfg->trace_file);
+  sp_session_login (session, cfg->login, cfg->password, 0, NULL);
+  player_audio_start (cfg);
+  index_path = g_build_filename (cfg->cache_dir, "tracks.idx", NULL);
+  track_index_open (index_path);
+  g_free (index_path);
+  if (cfg->cover_size <= 0)
+    {
+      dbg (0, "bad cover size %d, using %d\n", cfg->cover_size,
+           PLAYER_COVER_SIZE);
+      cfg->cover_size = PLAYER_COVER_SIZE;
+    }
+  index_path = g_build_filename (cfg->cache_dir, "covers", NULL);
+  art_init (session, index_path, cfg->cover_size);
+  g_free (index_path);
+  index_path = g_build_filename (cfg->cache_dir, "search.idx", NULL);
+  search_init (session, index_path, cfg->search_cache);
+  g_free (index_path);
+  if (cfg->dbus_address
+      && mpris_start (strcmp (cfg->dbus_address, "session")
+                      ? cfg->dbus_address : NULL))
+    {
+      dbg (0, "can't start MPRIS on %s\n", cfg->dbus_address);
+      cfg->dbus_address = NULL;
+    }
+  return 0;
+}
+
+/**
+ * Run whatever libspotify has to do and publish the player state.
+ *
+ * @return the ms until this is due again, unless player_notify_fd()
+ * turns readable first
+ */
+int
+player_process (void)
+{
+  uint64_t count;
+  int next_timeout = 0, ended;
+
+  if (read (g_notify_fd, &count, sizeof (count)) < 0)
+    count = 0;			/* nothing pending */
+  trace_begin (PROCESS, 0, 0);
+  sp_session_process_events (g_sess, &next_timeout);
+  trace_end (PROCESS, next_timeout, 0);
+  player_publish ();
+  player_loudness_store ();
+  player_output_check ();
+
+  /* Delivery reached the (trimmed) end of the track: move on right away */
+  ended = audio_trim_ended (&g_audiofifo);
+  if (__atomic_exchange_n (&g_track_ended, 0, __ATOMIC_ACQ_REL) || ended)
+    player_end_of_track ();
+  return next_timeout;
+}
+
+/**
+ * Replay a delivery trace into the audio pipeline, without a session,
+ * speed times faster than it was recorded (0 for as fast as it takes
+ * the frames), then log how the pipeline coped.
+ *
+ * Frames the pipeline refuses are not offered again, since the trace
+ * already holds libspotify's own retries; calls that took a different
+ * count than when recorded are reported instead. Traces without PCM are
+ * replayed as silence, which silence trimming would drop.
+ *
+ * @return 0, or -1 if the trace can't be read
+ */
+int
+player_replay (struct player_config *cfg, const char *path, double speed)
+{
+  struct delivery_trace_record rec;
+  sp_audioformat format;
+  audio_stats_t st;
+  struct timespec ts;
+  void *pcm = NULL;
+  size_t pcm_size = 0;
+  uint32_t flags;
+  int64_t start, due, now, late_max = 0, call, call_max = 0, call_sum = 0;
+  int calls = 0, refused = 0, recorded_refused = 0, diverged = 0, got, i;
+  int lost = 0;
+  FILE *f;
+
+  f = delivery_trace_open (path, &flags);
+  if (!f)
+    {
+      dbg (0, "%s is not a delivery trace\n", path);
+      return -1;
+    }
+  player_audio_start (cfg);
+
+  start = g_get_monotonic_time ();
+  while (!delivery_trace_read (f, flags, &rec, &pcm, &pcm_size))
+    {
+      if (speed > 0)
+        {
+          due = start + rec.t_us / speed;
+          now = g_get_monotonic_time ();
+          if (due > now)
+            {
+              ts.tv_sec = (due - now) / 1000000;
+              ts.tv_nsec = (due - now) % 1000000 * 1000;
+              nanosleep (&ts, NULL);
+            }
+          else if (now - due > late_max)
+            late_max = now - due;
+        }
+
+      switch (rec.type)
+        {
+        case DELIVERY_TRACE_MUSIC:
+          if (!(flags & DELIVERY_TRACE_PCM))
+            {
+              if (pcm_size < (size_t) rec.arg * rec.channels * sizeof (int16_t))
+                {
+                  pcm_size = (size_t) rec.arg * rec.channels * sizeof (int16_t);
+                  free (pcm);
+                  pcm = calloc (1, pcm_size);
+                }
+            }
+          format.sample_type = SP_SAMPLETYPE_INT16_NATIVE_ENDIAN;
+          format.sample_rate = rec.rate;
+          format.channels = rec.channels;
+          call = g_get_monotonic_time ();
+          got = player_deliver (&format, pcm, rec.arg);
+          call = g_get_monotonic_time () - call;
+          call_sum += call;
+          if (call > call_max)
+            call_max = call;
+          calls++;
+          refused += rec.arg - got;
+          recorded_refused += rec.arg - rec.accepted;
+          if (got != rec.accepted)
+            diverged++;
+          break;
+        case DELIVERY_TRACE_FLUSH:
+          audio_fifo_flush (&g_audiofifo);
+          break;
+        case DELIVERY_TRACE_SEEK:
+          audio_fifo_seek (&g_audiofifo, rec.arg);
+          break;
+        case DELIVERY_TRACE_SKIP:
+          audio_fifo_skip (&g_audiofifo, rec.arg);
+          break;
+        case DELIVERY_TRACE_END_OF_TRACK:
+          audio_fifo_boundary (&g_audiofifo, rec.arg);
+          break;
+        case DELIVERY_TRACE_LOST:
+          lost += rec.arg;
+          break;
+        }
+    }
+  fclose (f);
+  free (pcm);
+
+  /* Let the output play out what is still queued, if it can */
+  for (i = 0; i < 100 && audio_buffered_ms (&g_audiofifo) > 0; i++)
+    g_usleep (100000);
+
+  audio_get_stats (&g_audiofifo, &st);
+  dbg (0, "replay: %d deliveries, call time %lld us average, %lld us max, up to %lld us late\n",
+       calls, calls ? (long long) (call_sum / calls) : 0LL,
+       (long long) call_max, (long long) late_max);
+  dbg (0, "replay: %d frames refused (%d when recorded), %d calls took a different count\n",
+       refused, recorded_refused, diverged);
+  dbg (0, "replay: %u xruns, the output waited for the fifo %u times\n",
+       st.xruns, st.fifo_waits);
+  if (lost)
+    dbg (0, "replay: the trace lost %d records while recording, the disk was too slow\n",
+         lost);
+  return 0;
+}
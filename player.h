@@ -0,0 +1,85 @@
+/*
+ * The player core: libspotify session, playlist, audio fifo and output,
+ * with no tie to Navit. It is shared by the Navit plugin and the headless
+ * spot daemon, each of which runs it from its own main loop: all player_*
+ * calls, like every libspotify call, have to come from that loop.
+ */
+#ifndef _SPOTIFY_PLAYER_H_
+#define _SPOTIFY_PLAYER_H_
+
+#include "audio.h"
+#include "dsp.h"
+#include "prefetch.h"
+
+/// Default memory budget of the replay buffer, in KiB (~12s of CD audio)
+#define PLAYER_REPLAY_KB 2048
+/// Default largest side of cover thumbnails, in pixels
+#define PLAYER_COVER_SIZE 128
+/// Default spectrum analyser rate, frames per second
+#define PLAYER_SPECTRUM_FPS 15
+/// Audio buffered ahead of playback by default, and the least allowed, in ms
+#define PLAYER_BUFFER_MS 1000
+#define PLAYER_BUFFER_MIN_MS 200
+/// Most we buffer ahead to get a streamed track through a coverage gap (~20MB)
+#define PLAYER_BUFFER_MAX_MS 120000
+/// Least we buffer ahead while Navit is busy, see player_load_shed()
+#define PLAYER_BUFFER_BUSY_MS 10000
+
+/**
+ * What the front end configured. The player keeps the pointer it is
+ * started with, changes volume_db as the volume is stepped and keeps
+ * what player_reconfigure() applied in it.
+ */
+struct player_config
+{
+  char *login;
+  char *password;
+  char *playlist;
+  char *cache_dir;		/* libspotify cache, indexes and covers */
+  int replay_kb;
+  int volume_db;
+  int crossfade_ms;
+  dsp_chain_cfg_t dsp;
+  int dsp_enabled;
+  int cover_size;
+  int spectrum_fps;		/* 0 once the analyser failed to start */
+  int trim_threshold;		/* sample level of silence, 0 to not trim */
+  char *zones;
+  char *pcm_export;
+  char *dbus_address;		/* bus, "session" or NULL for none */
+  char *trace_file;		/* record deliveries here */
+  int trace_pcm;		/* with the frames */
+  char *trace;			/* trace categories, see trace_parse_mask() */
+  int bitrate_kbps;		/* 96, 160 or 320, 0 for the adaptive policy */
+  char *device;			/* first zone's ALSA device, NULL for the zones' */
+  int period;			/* ALSA period in frames, 0 for AUDIO_PERIOD */
+  int buffer_ms;		/* buffered ahead of playback */
+  int search_cache;		/* queries whose results are kept, 0 for none */
+  int shuffle;
+  int repeat;
+};
+
+void player_config_init (struct player_config *cfg);
+int player_start (struct player_config *cfg);
+int player_replay (struct player_config *cfg, const char *path, double speed);
+int player_process (void);
+int player_notify_fd (void);
+audio_fifo_t *player_audio (void);
+
+void player_toggle (void);
+void player_next (void);
+int player_enqueue (const char *uri);
+void player_previous (void);
+void player_seek (int pos_ms);
+int player_position_ms (void);
+void player_skip (int ms);
+void player_volume_step (int db);
+void player_stats (void);
+void player_mpris_commands (void);
+void player_prefetch_apply (const struct prefetch_plan *plan);
+void player_buffer_reset (void);
+void player_load_shed (int busy, const char *reason);
+int player_reconfigure (const char *name, const char *value, char *report,
+                        int len);
+
+#endif /* _SPOTIFY_PLAYER_H_ */
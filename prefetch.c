@@ -0,0 +1,173 @@
+/*
+ * Route-aware prefetch planning.
+ *
+ * The route is walked in steps of at most PREFETCH_STEP_M, interpolating
+ * the arrival time, and each step is checked against the no-coverage
+ * areas. Both files are plain text with one entry per line and '#'
+ * comments: "lat lng radius_m" for coverage gaps, "lat lng seconds" for
+ * route points.
+ */
+
+#include "prefetch.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PREFETCH_STEP_M		100.0
+#define EARTH_RADIUS_M		6371000.0
+
+static double distance_m(double lat1, double lng1, double lat2, double lng2)
+{
+	double rad = M_PI / 180;
+	double x = (lng2 - lng1) * rad * cos((lat1 + lat2) / 2 * rad);
+	double y = (lat2 - lat1) * rad;
+
+	return sqrt(x * x + y * y) * EARTH_RADIUS_M;
+}
+
+static int covered(const struct prefetch_coverage *cov, double lat, double lng)
+{
+	int i;
+
+	for (i = 0; i < cov->nareas; i++)
+		if (distance_m(lat, lng, cov->areas[i].lat, cov->areas[i].lng) <
+		    cov->areas[i].radius_m)
+			return 0;
+	return 1;
+}
+
+/* Read lines of three numbers from path, calling add for each */
+static int load_triples(const char *path, void *dst,
+                        int (*add)(void *, double, double, double))
+{
+	char line[256];
+	double a, b, c;
+	FILE *f;
+	int n = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lf %lf %lf", &a, &b, &c) != 3)
+			continue;
+		if (add(dst, a, b, c))
+			break;
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+static int add_area(void *dst, double lat, double lng, double radius_m)
+{
+	struct prefetch_coverage *cov = dst;
+	struct prefetch_area *areas;
+
+	areas = realloc(cov->areas, (cov->nareas + 1) * sizeof(*areas));
+	if (!areas)
+		return -1;
+	cov->areas = areas;
+	areas[cov->nareas].lat = lat;
+	areas[cov->nareas].lng = lng;
+	areas[cov->nareas].radius_m = radius_m;
+	cov->nareas++;
+	return 0;
+}
+
+/*
+ * Load the no-coverage areas from path, replacing any loaded before.
+ * Returns the number of areas, or -1 if the file can't be read.
+ */
+int prefetch_coverage_load(struct prefetch_coverage *cov, const char *path)
+{
+	free(cov->areas);
+	cov->areas = NULL;
+	cov->nareas = 0;
+	return load_triples(path, cov, add_area);
+}
+
+int prefetch_route_add(struct prefetch_route *route, double lat, double lng,
+                       int time_s)
+{
+	struct prefetch_point *points;
+
+	points = realloc(route->points, (route->npoints + 1) * sizeof(*points));
+	if (!points)
+		return -1;
+	route->points = points;
+	points[route->npoints].lat = lat;
+	points[route->npoints].lng = lng;
+	points[route->npoints].time_s = time_s;
+	route->npoints++;
+	return 0;
+}
+
+static int add_point(void *dst, double lat, double lng, double time_s)
+{
+	return prefetch_route_add(dst, lat, lng, (int)time_s);
+}
+
+void prefetch_route_clear(struct prefetch_route *route)
+{
+	free(route->points);
+	route->points = NULL;
+	route->npoints = 0;
+}
+
+/* Load a canned route, replacing the points in route */
+int prefetch_route_load(struct prefetch_route *route, const char *path)
+{
+	prefetch_route_clear(route);
+	return load_triples(path, route, add_point);
+}
+
+void prefetch_plan(const struct prefetch_route *route,
+                   const struct prefetch_coverage *cov,
+                   struct prefetch_plan *plan)
+{
+	const struct prefetch_point *p, *q;
+	double d, f, lat, lng;
+	int i, k, steps, t;
+
+	plan->duration_s = route->npoints ?
+	                   route->points[route->npoints - 1].time_s : 0;
+	plan->gap_start_s = -1;
+	plan->gap_end_s = -1;
+	plan->need_s = 0;
+
+	for (i = 0; i < route->npoints; i++) {
+		p = &route->points[i];
+		q = i + 1 < route->npoints ? p + 1 : p;
+		d = distance_m(p->lat, p->lng, q->lat, q->lng);
+		steps = (int)ceil(d / PREFETCH_STEP_M);
+		if (steps < 1)
+			steps = 1;
+
+		for (k = 0; k < steps; k++) {
+			f = (double)k / steps;
+			lat = p->lat + (q->lat - p->lat) * f;
+			lng = p->lng + (q->lng - p->lng) * f;
+			t = p->time_s + (int)((q->time_s - p->time_s) * f);
+
+			if (!covered(cov, lat, lng)) {
+				if (plan->gap_start_s < 0)
+					plan->gap_start_s = t;
+				plan->gap_end_s = -1;
+			} else if (plan->gap_start_s >= 0) {
+				if (plan->gap_end_s < 0)
+					plan->gap_end_s = t;
+				else if (t - plan->gap_end_s > PREFETCH_MERGE_S)
+					goto done;
+			}
+		}
+	}
+
+done:
+	if (plan->gap_start_s < 0)
+		return;
+	/* Still without coverage when we arrive */
+	if (plan->gap_end_s < 0)
+		plan->gap_end_s = plan->duration_s;
+	plan->need_s = plan->gap_end_s;
+}
@@ -0,0 +1,53 @@
+/*
+ * Route-aware prefetch planning.
+ *
+ * Given the rest of the route as points with the time we expect to reach
+ * them, and a coverage map listing areas without mobile data, work out
+ * when we lose connectivity next and how much music has to be on the
+ * device by then. This knows nothing about Navit or libspotify, so it can
+ * be run on a canned route and coverage file.
+ */
+#ifndef _SPOTIFY_PREFETCH_H_
+#define _SPOTIFY_PREFETCH_H_
+
+/* Gaps separated by less coverage than this are treated as one */
+#define PREFETCH_MERGE_S	120
+
+struct prefetch_point {
+	double lat, lng;
+	int time_s;		/* from now */
+};
+
+struct prefetch_route {
+	int npoints;
+	struct prefetch_point *points;
+};
+
+/* A circular area without coverage */
+struct prefetch_area {
+	double lat, lng;
+	double radius_m;
+};
+
+struct prefetch_coverage {
+	int nareas;
+	struct prefetch_area *areas;
+};
+
+struct prefetch_plan {
+	int duration_s;		/* time left on the route */
+	int gap_start_s;	/* next loss of coverage, -1 if none */
+	int gap_end_s;		/* coverage back, or end of route */
+	int need_s;		/* music that must be local by gap_start_s */
+};
+
+extern int prefetch_coverage_load(struct prefetch_coverage *cov, const char *path);
+extern int prefetch_route_load(struct prefetch_route *route, const char *path);
+extern int prefetch_route_add(struct prefetch_route *route, double lat,
+                              double lng, int time_s);
+extern void prefetch_route_clear(struct prefetch_route *route);
+extern void prefetch_plan(const struct prefetch_route *route,
+                          const struct prefetch_coverage *cov,
+                          struct prefetch_plan *plan);
+
+#endif /* _SPOTIFY_PREFETCH_H_ */
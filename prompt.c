@@ -0,0 +1,195 @@
+/*
+ * Navigation prompts.
+ *
+ * Prompts are queued next to the music and mixed into it by the output
+ * thread, right before the write. The music is ducked with a short gain
+ * ramp for as long as prompt audio is pending. A prompt lands behind at
+ * most what the device has already buffered (alsa_open asks for four
+ * periods) plus the chunk being written; when the music is stopped the
+ * output thread plays it on top of generated silence.
+ */
+
+#include "audio.h"
+#include "dsp.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PROMPT_DUCK_DB		-12.0f
+#define PROMPT_ATTACK_MS	30
+#define PROMPT_RELEASE_MS	250
+#define PROMPT_MAX_SECONDS	30
+
+/*
+ * Sample for output channel c of input frame i. Missing channels repeat
+ * the last input channel, a mono output gets the average of all inputs.
+ */
+static inline int prompt_sample(const int16_t *src, int i, int in_ch,
+                                int out_ch, int c)
+{
+	int k, sum;
+
+	if (out_ch == 1 && in_ch > 1) {
+		for (k = 0, sum = 0; k < in_ch; k++)
+			sum += src[i * in_ch + k];
+		return sum / in_ch;
+	}
+	return src[i * in_ch + (c < in_ch ? c : in_ch - 1)];
+}
+
+/*
+ * Queue a prompt for mixing. It is converted to the format of the music
+ * (linear interpolation for the rate) here, on the caller's thread, so
+ * the output thread only has to add it in.
+ *
+ * Returns 0 on success, -1 if the prompt can't be queued.
+ */
+int audio_prompt_write(audio_fifo_t *af, const int16_t *samples,
+                       int nframes, int rate, int channels)
+{
+	audio_fifo_data_t *afd;
+	int out_rate, out_ch, n, i, c;
+	int64_t pos, step;
+
+	if (nframes <= 0 || rate <= 0 || channels <= 0)
+		return -1;
+
+	pthread_mutex_lock(&af->mutex);
+	out_rate = af->rate ? af->rate : rate;
+	out_ch = af->channels ? af->channels : channels;
+	pthread_mutex_unlock(&af->mutex);
+
+	n = (int64_t)nframes * out_rate / rate;
+	if (n <= 0 || n > PROMPT_MAX_SECONDS * out_rate)
+		return -1;
+
+	afd = malloc(sizeof(*afd) + n * out_ch * sizeof(int16_t));
+	if (!afd)
+		return -1;
+
+	/* 16.16 fixed point read position */
+	step = ((int64_t)rate << 16) / out_rate;
+	for (i = 0, pos = 0; i < n; i++, pos += step) {
+		int j = pos >> 16;
+		int frac = pos & 0xffff;
+
+		for (c = 0; c < out_ch; c++) {
+			int a = prompt_sample(samples, j, channels, out_ch, c);
+			int b = j + 1 < nframes ?
+			        prompt_sample(samples, j + 1, channels, out_ch, c) : a;
+
+			afd->samples[i * out_ch + c] = a +
+				(int)(((int64_t)(b - a) * frac) >> 16);
+		}
+	}
+
+	afd->rate = out_rate;
+	afd->channels = out_ch;
+	afd->nsamples = n;
+	afd->epoch = 0;
+	afd->flags = 0;
+	clock_gettime(CLOCK_MONOTONIC, &afd->queued);
+
+	pthread_mutex_lock(&af->mutex);
+	TAILQ_INSERT_TAIL(&af->prompt, afd, link);
+	af->prompt_len += n;
+	af->stats.prompts++;
+	pthread_cond_signal(&af->cond);
+	pthread_mutex_unlock(&af->mutex);
+
+	return 0;
+}
+
+/*
+ * True while there is prompt audio to mix or the music is still ducked,
+ * i.e. whenever audio_prompt_mix has work to do.
+ */
+int audio_prompt_active(audio_fifo_t *af)
+{
+	int active;
+
+	pthread_mutex_lock(&af->mutex);
+	active = af->prompt_len || af->duck_gain != DSP_UNITY;
+	pthread_mutex_unlock(&af->mutex);
+	return active;
+}
+
+static int prompt_ramp_target(audio_fifo_t *af, const audio_fifo_data_t *afd)
+{
+	int duck = dsp_gain_from_db(PROMPT_DUCK_DB);
+	int target = af->prompt_len ? duck : DSP_UNITY;
+	int ms = af->prompt_len ? PROMPT_ATTACK_MS : PROMPT_RELEASE_MS;
+	int step = (int64_t)(DSP_UNITY - duck) * afd->nsamples * 1000 /
+	           ((int64_t)afd->rate * ms);
+
+	if (af->duck_gain > target)
+		return af->duck_gain - step > target ? af->duck_gain - step : target;
+	return af->duck_gain + step < target ? af->duck_gain + step : target;
+}
+
+/*
+ * Duck the music in afd and mix pending prompt audio into it. delay is
+ * what the device has buffered ahead of afd, in frames, and only used
+ * to report the prompt-to-speaker latency.
+ */
+void audio_prompt_mix(audio_fifo_t *af, audio_fifo_data_t *afd, long delay)
+{
+	audio_fifo_data_t *p;
+	struct timespec now;
+	int gain, off, n;
+	unsigned int us;
+
+	pthread_mutex_lock(&af->mutex);
+
+	if (!af->prompt_len && af->duck_gain == DSP_UNITY) {
+		pthread_mutex_unlock(&af->mutex);
+		return;
+	}
+
+	gain = prompt_ramp_target(af, afd);
+	if (!(afd->flags & AUDIO_FIFO_SILENCE))
+		dsp_ramp_s16(afd->samples, afd->nsamples, afd->channels,
+		             af->duck_gain, gain);
+	af->duck_gain = gain;
+
+	for (off = 0; off < afd->nsamples && (p = TAILQ_FIRST(&af->prompt)); ) {
+		if (p->rate != afd->rate || p->channels != afd->channels) {
+			/* The music changed format after the prompt was queued */
+			TAILQ_REMOVE(&af->prompt, p, link);
+			af->prompt_len -= p->nsamples - af->prompt_off;
+			af->prompt_off = 0;
+			af->stats.prompts_dropped++;
+			free(p);
+			continue;
+		}
+
+		if (!af->prompt_off) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			us = (now.tv_sec - p->queued.tv_sec) * 1000000 +
+			     (now.tv_nsec - p->queued.tv_nsec) / 1000 +
+			     (int64_t)(delay + off) * 1000000 / afd->rate;
+			af->stats.prompt_latency_us = us;
+			if (us > af->stats.prompt_latency_max_us)
+				af->stats.prompt_latency_max_us = us;
+		}
+
+		n = p->nsamples - af->prompt_off;
+		if (n > afd->nsamples - off)
+			n = afd->nsamples - off;
+
+		dsp_mix_s16(afd->samples + off * afd->channels,
+		            p->samples + af->prompt_off * p->channels,
+		            n * afd->channels);
+
+		off += n;
+		af->prompt_off += n;
+		af->prompt_len -= n;
+
+		if (af->prompt_off == p->nsamples) {
+			TAILQ_REMOVE(&af->prompt, p, link);
+			af->prompt_off = 0;
+			free(p);
+		}
+	}
+
+	pthread_mutex_unlock(&af->mutex);
+}
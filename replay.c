@@ -0,0 +1,179 @@
+/*
+ * Replay buffer.
+ *
+ * The output thread copies every chunk it is about to play into a ring
+ * sized by a memory budget. A rewind takes the last frames back out of
+ * the ring and puts them in front of the fifo, so going back a few
+ * seconds or restarting a song that just began never reloads the track.
+ */
+
+#include "audio.h"
+#include <stdlib.h>
+#include <string.h>
+
+void audio_replay_set_budget(audio_fifo_t *af, size_t bytes)
+{
+    pthread_mutex_lock(&af->mutex);
+    free(af->replay.buf);
+    af->replay.buf = NULL;
+    af->replay.budget = bytes;
+    af->replay.size = 0;
+    af->replay.rate = 0;
+    af->replay.channels = 0;
+    audio_replay_reset(af, af->pos_frames == 0);
+    pthread_mutex_unlock(&af->mutex);
+}
+
+/* Start the ring over for the track being delivered */
+void audio_replay_reset(audio_fifo_t *af, int complete)
+{
+    af->replay.head = 0;
+    af->replay.fill = 0;
+    af->replay.complete = complete;
+    af->replay.track = af->track;
+}
+
+static void replay_realloc(audio_replay_t *r, int rate, int channels)
+{
+    free(r->buf);
+    r->size = r->budget / (channels * sizeof(int16_t));
+    r->buf = r->size ? malloc(r->size * channels * sizeof(int16_t)) : NULL;
+    if (!r->buf)
+	r->size = 0;
+    r->rate = rate;
+    r->channels = channels;
+    r->head = 0;
+    r->fill = 0;
+}
+
+/*
+ * Chunks of an older epoch are about to be dropped by the output thread
+ * and are not added, nor is the filler played under prompts. The first
+ * chunk of the next track starts the ring over, so the tail of the one
+ * before that was still queued at the boundary is not replayed in it.
+ */
+void audio_replay_push(audio_fifo_t *af, const audio_fifo_data_t *afd)
+{
+    audio_replay_t *r = &af->replay;
+    const int16_t *src = afd->samples;
+    int n = afd->nsamples;
+    int part;
+
+    if (!r->budget || afd->epoch != af->epoch ||
+	(afd->flags & AUDIO_FIFO_SILENCE))
+	return;
+
+    if (afd->track != r->track) {
+	r->head = 0;
+	r->fill = 0;
+	r->complete = r->next_complete;
+	r->next_complete = 1;
+    }
+
+    if (r->rate != afd->rate || r->channels != afd->channels)
+	replay_realloc(r, afd->rate, afd->channels);
+
+    if (!r->size)
+	return;
+
+    if (n > r->size) {
+	src += (n - r->size) * r->channels;
+	n = r->size;
+    }
+
+    if (r->fill + n > r->size)
+	r->complete = 0;
+
+    while (n > 0) {
+	part = r->size - r->head;
+	if (part > n)
+	    part = n;
+	memcpy(r->buf + r->head * r->channels, src,
+	       part * r->channels * sizeof(int16_t));
+	r->head = (r->head + part) % r->size;
+	src += part * r->channels;
+	n -= part;
+	r->fill += part;
+    }
+
+    if (r->fill > r->size)
+	r->fill = r->size;
+    r->track = afd->track;
+    r->frame = afd->frame + afd->nsamples;
+}
+
+/*
+ * Put the last ms of played audio back in front of the fifo. A negative
+ * ms rewinds to the start of the track, which only works if the ring
+ * still holds all of it.
+ *
+ * Returns -1 when the ring doesn't hold enough audio; the caller should
+ * fall back to a seek.
+ */
+int audio_replay_rewind(audio_fifo_t *af, int ms)
+{
+    audio_replay_t *r = &af->replay;
+    audio_fifo_data_t *afd;
+    int frames, start, part;
+
+    pthread_mutex_lock(&af->mutex);
+
+    if (ms < 0)
+	frames = r->complete ? r->fill : -1;
+    else
+	frames = (int64_t)ms * r->rate / 1000;
+
+    /* The ring may still hold the tail of the track before */
+    if (!r->size || frames <= 0 || frames > r->fill ||
+	r->rate != af->rate || r->track != af->track) {
+	pthread_mutex_unlock(&af->mutex);
+	return -1;
+    }
+
+    afd = malloc(sizeof(*afd) + frames * r->channels * sizeof(int16_t));
+    if (!afd) {
+	pthread_mutex_unlock(&af->mutex);
+	return -1;
+    }
+
+    start = (r->head - frames + r->size) % r->size;
+    part = r->size - start;
+    if (part > frames)
+	part = frames;
+    memcpy(afd->samples, r->buf + start * r->channels,
+	   part * r->channels * sizeof(int16_t));
+    memcpy(afd->samples + part * r->channels, r->buf,
+	   (frames - part) * r->channels * sizeof(int16_t));
+
+    afd->rate = r->rate;
+    afd->channels = r->channels;
+    afd->nsamples = frames;
+    afd->flags = 0;
+    afd->track = r->track;
+    afd->frame = r->frame - frames;
+
+    /* The frames come back through audio_replay_push when played */
+    r->head = start;
+    r->fill -= frames;
+    r->frame -= frames;
+
+    /*
+     * Move to a new epoch so the output thread drops what the device
+     * and its in-flight chunk hold; all of that is in the ring already.
+     */
+    af->epoch++;
+    clock_gettime(CLOCK_MONOTONIC, &af->seek_time);
+    af->stats.seeks++;
+    af->stats.replays++;
+
+    afd->epoch = af->epoch;
+    TAILQ_INSERT_HEAD(&af->q, afd, link);
+    af->qlen += frames;
+
+    TAILQ_FOREACH(afd, &af->q, link)
+	afd->epoch = af->epoch;
+
+    pthread_cond_signal(&af->cond);
+    pthread_mutex_unlock(&af->mutex);
+    return 0;
+}
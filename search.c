@@ -0,0 +1,568 @@
+/**
+ * Catalog search, with a cache of what was found.
+ *
+ * A search is a libspotify search run one page at a time. Its callback
+ * comes from sp_session_process_events() on the main loop, and each page
+ * is added to the results as it arrives, so the first tracks can be shown
+ * before the rest are asked for. Starting a search drops the one before.
+ *
+ * The results of the last g_search_entries queries are kept, so asking
+ * again is answered without Spotify until they are SEARCH_CACHE_TTL_S
+ * old. While typing, a query that isn't cached is answered at once from
+ * the longest query it starts with that is, filtered to the results
+ * still matching every word, until Spotify's own answer replaces them.
+ *
+ * The cache is kept in an append-only log: a "q <time> <query>" line per
+ * search, then a tab separated line per result. The last block for a
+ * query wins, and the log is rewritten with the live blocks only when it
+ * is opened.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "search.h"
+#include "log.h"
+
+struct search_entry
+{
+  char *query;			/* normalized, see search_normalize() */
+  gint64 time;			/* when Spotify answered, in s since the epoch */
+  GArray *results;		/* of struct search_result, tracks first */
+};
+
+static sp_session *g_search_session;
+static char *g_search_path;
+static int g_search_entries;
+/// query -> link in g_search_lru, whose head is the most recently used entry
+static GHashTable *g_search_cache;
+static GQueue *g_search_lru;
+static struct search_stats g_search_stats;
+
+/// The current search
+static struct
+{
+  char *query;
+  sp_search *pending;		/* page in flight */
+  GArray *results;
+  int tracks;			/* at the start of results */
+  int offset;			/* tracks Spotify returned so far */
+  int complete;
+  int provisional;		/* results are from the cache, not for query */
+} g_search;
+
+/**
+ * Case folded, with words separated by a single space, so queries that
+ * only differ in case or spacing share their cache entry.
+ */
+static char *
+search_normalize (const char *query)
+{
+  char *folded = g_utf8_casefold (query, -1);
+  char **words = g_strsplit_set (folded, " \t\r\n", 0);
+  GString *s = g_string_new (NULL);
+  int i;
+
+  for (i = 0; words[i]; i++)
+    if (words[i][0])
+      {
+        if (s->len)
+          g_string_append_c (s, ' ');
+        g_string_append (s, words[i]);
+      }
+  g_strfreev (words);
+  g_free (folded);
+  return g_string_free (s, FALSE);
+}
+
+/* Copy src to dst, cut at a character boundary and without tabs or newlines */
+static void
+search_copy (char *dst, const char *src, size_t len)
+{
+  size_t i, n = src ? strlen (src) : 0;
+
+  if (n >= len)
+    {
+      n = len - 1;
+      while (n && (src[n] & 0xc0) == 0x80)
+        n--;
+    }
+  for (i = 0; i < n; i++)
+    dst[i] = src[i] == '\t' || src[i] == '\n' ? ' ' : src[i];
+  dst[n] = 0;
+}
+
+static struct search_entry *
+search_entry_new (const char *query, gint64 time)
+{
+  struct search_entry *entry = g_new0 (struct search_entry, 1);
+
+  entry->query = g_strdup (query);
+  entry->time = time;
+  entry->results = g_array_new (FALSE, FALSE, sizeof (struct search_result));
+  return entry;
+}
+
+static void
+search_entry_free (struct search_entry *entry)
+{
+  g_free (entry->query);
+  g_array_free (entry->results, TRUE);
+  g_free (entry);
+}
+
+/* Moves the entry to the head of the LRU */
+static struct search_entry *
+search_lookup (const char *query)
+{
+  GList *link = g_hash_table_lookup (g_search_cache, query);
+
+  if (!link)
+    return NULL;
+  g_queue_unlink (g_search_lru, link);
+  g_queue_push_head_link (g_search_lru, link);
+  return link->data;
+}
+
+/* Takes over entry, replacing any for the same query */
+static void
+search_insert (struct search_entry *entry)
+{
+  GList *link = g_hash_table_lookup (g_search_cache, entry->query);
+
+  if (link)
+    {
+      g_hash_table_remove (g_search_cache, entry->query);
+      g_queue_unlink (g_search_lru, link);
+      search_entry_free (link->data);
+      g_list_free_1 (link);
+    }
+
+  link = g_list_alloc ();
+  link->data = entry;
+  g_queue_push_head_link (g_search_lru, link);
+  g_hash_table_insert (g_search_cache, entry->query, link);
+
+  while (g_queue_get_length (g_search_lru) > g_search_entries)
+    {
+      link = g_queue_pop_tail_link (g_search_lru);
+      entry = link->data;
+      g_hash_table_remove (g_search_cache, entry->query);
+      search_entry_free (entry);
+      g_list_free_1 (link);
+    }
+}
+
+/**
+ * The cached entry for the longest query that query starts with, if
+ * any. Lookups are by hash, but there are few enough entries to walk.
+ */
+static struct search_entry *
+search_prefix (const char *query)
+{
+  struct search_entry *entry, *best = NULL;
+  size_t len, best_len = 0, query_len = strlen (query);
+  GList *link;
+
+  for (link = g_search_lru->head; link; link = link->next)
+    {
+      entry = link->data;
+      len = strlen (entry->query);
+      if (len < query_len && len > best_len
+          && !strncmp (entry->query, query, len))
+        {
+          best = entry;
+          best_len = len;
+        }
+    }
+  return best;
+}
+
+static int
+search_matches (const struct search_result *r, char **words)
+{
+  char *text = g_strdup_printf ("%s %s %s", r->name, r->artist, r->album);
+  char *folded = g_utf8_casefold (text, -1);
+  int i, match = 1;
+
+  for (i = 0; match && words[i]; i++)
+    match = strstr (folded, words[i]) != NULL;
+  g_free (folded);
+  g_free (text);
+  return match;
+}
+
+static void
+search_write_entry (FILE *f, const struct search_entry *entry)
+{
+  const struct search_result *r;
+  unsigned int i;
+
+  fprintf (f, "q %lld %s\n", (long long) entry->time, entry->query);
+  for (i = 0; i < entry->results->len; i++)
+    {
+      r = &g_array_index (entry->results, struct search_result, i);
+      fprintf (f, "%c %s\t%s\t%s\t%s\t%d\n", r->kind, r->uri, r->name,
+               r->artist, r->album, r->duration_ms);
+    }
+}
+
+static struct search_entry *
+search_parse_query (const char *line)
+{
+  char *end;
+  gint64 time = g_ascii_strtoll (line, &end, 10);
+
+  if (end == line || *end != ' ' || !end[1])
+    return NULL;
+  return search_entry_new (end + 1, time);
+}
+
+static int
+search_parse_result (const char *line, struct search_result *r)
+{
+  char **fields;
+  int ok;
+
+  if ((line[0] != SEARCH_TRACK && line[0] != SEARCH_ALBUM
+       && line[0] != SEARCH_ARTIST) || line[1] != ' ')
+    return -1;
+  fields = g_strsplit (line + 2, "\t", 0);
+  ok = g_strv_length (fields) == 5;
+  if (ok)
+    {
+      memset (r, 0, sizeof (*r));
+      r->kind = line[0];
+      search_copy (r->uri, fields[0], sizeof (r->uri));
+      search_copy (r->name, fields[1], sizeof (r->name));
+      search_copy (r->artist, fields[2], sizeof (r->artist));
+      search_copy (r->album, fields[3], sizeof (r->album));
+      r->duration_ms = atoi (fields[4]);
+    }
+  g_strfreev (fields);
+  return ok ? 0 : -1;
+}
+
+static void
+search_store (const struct search_entry *entry)
+{
+  FILE *f = fopen (g_search_path, "a");
+
+  if (!f)
+    {
+      dbg (0, "can't write the search cache %s\n", g_search_path);
+      return;
+    }
+  search_write_entry (f, entry);
+  fclose (f);
+}
+
+/**
+ * Search with session, keeping the results of the last entries queries
+ * in the log at path. With no entries nothing is cached.
+ */
+void
+search_init (sp_session *session, const char *path, int entries)
+{
+  struct search_entry *entry = NULL;
+  struct search_result r;
+  gchar *contents, **lines, *tmp;
+  unsigned int nlines = 0, live = 0;
+  GList *link;
+  FILE *f;
+  int i;
+
+  g_search_session = session;
+  g_search_path = g_strdup (path);
+  g_search_entries = MAX (entries, 0);
+  g_search_cache = g_hash_table_new (g_str_hash, g_str_equal);
+  g_search_lru = g_queue_new ();
+  g_search.results = g_array_new (FALSE, FALSE, sizeof (struct search_result));
+  if (!g_search_entries
+      || !g_file_get_contents (path, &contents, NULL, NULL))
+    return;
+
+  lines = g_strsplit (contents, "\n", 0);
+  for (i = 0; lines[i]; i++)
+    {
+      if (!lines[i][0])
+        continue;
+      nlines++;
+      if (g_str_has_prefix (lines[i], "q "))
+        {
+          if (entry)
+            search_insert (entry);
+          entry = search_parse_query (lines[i] + 2);
+        }
+      else if (entry && !search_parse_result (lines[i], &r))
+        g_array_append_val (entry->results, r);
+    }
+  if (entry)
+    search_insert (entry);
+  g_strfreev (lines);
+  g_free (contents);
+
+  for (link = g_search_lru->head; link; link = link->next)
+    live += 1 + ((struct search_entry *) link->data)->results->len;
+
+  /* Compact the log once it carries more dead lines than live ones */
+  if (nlines > 2 * live)
+    {
+      tmp = g_strdup_printf ("%s.tmp", path);
+      if ((f = fopen (tmp, "w")))
+        {
+          /* Oldest first, so reading it back keeps the order */
+          for (link = g_search_lru->tail; link; link = link->prev)
+            search_write_entry (f, link->data);
+          if (!fclose (f))
+            rename (tmp, path);
+        }
+      g_free (tmp);
+    }
+
+  dbg (1, "search cache %s: %u queries\n", path,
+       g_queue_get_length (g_search_lru));
+}
+
+static void
+search_uri (sp_link *link, char *uri)
+{
+  uri[0] = 0;
+  if (!link)
+    return;
+  sp_link_as_string (link, uri, SEARCH_URI_LEN);
+  sp_link_release (link);
+}
+
+static void
+search_track (sp_track *track, struct search_result *r)
+{
+  sp_artist *artist =
+    sp_track_num_artists (track) ? sp_track_artist (track, 0) : NULL;
+  sp_album *album = sp_track_album (track);
+
+  memset (r, 0, sizeof (*r));
+  r->kind = SEARCH_TRACK;
+  search_uri (sp_link_create_from_track (track, 0), r->uri);
+  search_copy (r->name, sp_track_name (track), sizeof (r->name));
+  if (artist)
+    search_copy (r->artist, sp_artist_name (artist), sizeof (r->artist));
+  if (album)
+    search_copy (r->album, sp_album_name (album), sizeof (r->album));
+  r->duration_ms = sp_track_duration (track);
+}
+
+static void
+search_album (sp_album *album, struct search_result *r)
+{
+  sp_artist *artist = sp_album_artist (album);
+
+  memset (r, 0, sizeof (*r));
+  r->kind = SEARCH_ALBUM;
+  search_uri (sp_link_create_from_album (album), r->uri);
+  search_copy (r->name, sp_album_name (album), sizeof (r->name));
+  if (artist)
+    search_copy (r->artist, sp_artist_name (artist), sizeof (r->artist));
+}
+
+static void
+search_artist (sp_artist *artist, struct search_result *r)
+{
+  memset (r, 0, sizeof (*r));
+  r->kind = SEARCH_ARTIST;
+  search_uri (sp_link_create_from_artist (artist), r->uri);
+  search_copy (r->name, sp_artist_name (artist), sizeof (r->name));
+}
+
+/* Ask for the page of tracks after those we have, albums and artists first */
+static void
+search_page (search_complete_cb *cb)
+{
+  int first = !g_search.offset;
+
+  g_search.pending =
+    sp_search_create (g_search_session, g_search.query, g_search.offset,
+                      first ? SEARCH_FIRST_PAGE
+                      : MIN (SEARCH_PAGE, SEARCH_MAX_TRACKS - g_search.offset),
+                      0, first ? SEARCH_MAX_ALBUMS : 0,
+                      0, first ? SEARCH_MAX_ARTISTS : 0,
+                      0, 0, SP_SEARCH_STANDARD, cb, NULL);
+  if (!g_search.pending)
+    g_search.complete = 1;
+}
+
+/**
+ * A page came back: add it to the results, then ask for the next one or
+ * cache the lot.
+ */
+static void
+search_complete (sp_search *search, void *userdata)
+{
+  struct search_entry *entry;
+  struct search_result r;
+  sp_error error = sp_search_error (search);
+  int i, n, total;
+
+  if (search != g_search.pending)
+    {
+      /* Started before the current search */
+      sp_search_release (search);
+      return;
+    }
+  g_search.pending = NULL;
+
+  if (error != SP_ERROR_OK)
+    {
+      /* Whatever the cache gave stays */
+      g_search_stats.failures++;
+      dbg (0, "search for \"%s\" failed: %s\n", g_search.query,
+           sp_error_message (error));
+      g_search.complete = 1;
+      sp_search_release (search);
+      return;
+    }
+
+  g_search_stats.pages++;
+  if (g_search.provisional)
+    {
+      g_array_set_size (g_search.results, 0);
+      g_search.tracks = 0;
+      g_search.provisional = 0;
+    }
+  n = sp_search_num_tracks (search);
+  for (i = 0; i < n; i++)
+    {
+      search_track (sp_search_track (search, i), &r);
+      g_array_insert_val (g_search.results, g_search.tracks++, r);
+    }
+  for (i = 0; i < sp_search_num_albums (search); i++)
+    {
+      search_album (sp_search_album (search, i), &r);
+      g_array_append_val (g_search.results, r);
+    }
+  for (i = 0; i < sp_search_num_artists (search); i++)
+    {
+      search_artist (sp_search_artist (search, i), &r);
+      g_array_append_val (g_search.results, r);
+    }
+  g_search.offset += n;
+  total = MIN (sp_search_total_tracks (search), SEARCH_MAX_TRACKS);
+  sp_search_release (search);
+  dbg (1, "search for \"%s\": %d of %d tracks\n", g_search.query,
+       g_search.offset, total);
+
+  if (n && g_search.offset < total)
+    {
+      search_page (search_complete);
+      return;
+    }
+  g_search.complete = 1;
+  if (!g_search_entries)
+    return;
+  entry = search_entry_new (g_search.query, time (NULL));
+  g_array_append_vals (entry->results, g_search.results->data,
+                       g_search.results->len);
+  search_store (entry);
+  search_insert (entry);
+}
+
+/**
+ * Search for query, unless it is the current search. Whatever the cache
+ * has for it is in the results right away, see search_results().
+ *
+ * @return the number of results so far
+ */
+int
+search_start (const char *query)
+{
+  struct search_entry *entry = NULL, *prefix;
+  GArray *results, *from = NULL;
+  char *q = search_normalize (query), **words;
+  const struct search_result *r;
+  unsigned int i;
+
+  if (!g_search.results)
+    {
+      g_free (q);
+      return 0;
+    }
+  if (g_search.query && !strcmp (q, g_search.query))
+    {
+      g_free (q);
+      return g_search.results->len;
+    }
+
+  g_search_stats.queries++;
+  results = g_array_new (FALSE, FALSE, sizeof (struct search_result));
+  if (*q && (entry = search_lookup (q)))
+    {
+      g_search_stats.hits++;
+      from = entry->results;
+    }
+  else if (*q)
+    {
+      /* The search this one grew from counts, even if unfinished */
+      prefix = search_prefix (q);
+      if (prefix)
+        from = prefix->results;
+      if (g_search.query && !g_search.provisional && g_search.results->len
+          && g_str_has_prefix (q, g_search.query)
+          && (!prefix || strlen (g_search.query) > strlen (prefix->query)))
+        from = g_search.results;
+      if (from)
+        g_search_stats.prefix_hits++;
+    }
+
+  g_search.tracks = 0;
+  words = g_strsplit (q, " ", 0);
+  for (i = 0; from && i < from->len; i++)
+    {
+      r = &g_array_index (from, struct search_result, i);
+      if (entry || search_matches (r, words))
+        {
+          g_array_append_val (results, *r);
+          if (r->kind == SEARCH_TRACK)
+            g_search.tracks++;
+        }
+    }
+  g_strfreev (words);
+
+  g_array_free (g_search.results, TRUE);
+  g_search.results = results;
+  g_free (g_search.query);
+  g_search.query = q;
+  /* A page still in flight is released when it comes back */
+  g_search.pending = NULL;
+  g_search.offset = 0;
+  g_search.complete = !*q
+    || (entry && time (NULL) - entry->time < SEARCH_CACHE_TTL_S);
+  g_search.provisional = !g_search.complete;
+  if (!g_search.complete)
+    search_page (search_complete);
+  return g_search.results->len;
+}
+
+/**
+ * The results of the current search so far, tracks first, valid until
+ * the next call into the search.
+ *
+ * @return the number of results
+ */
+int
+search_results (const struct search_result **results, int *complete)
+{
+  *results = g_search.results
+    ? (const struct search_result *) g_search.results->data : NULL;
+  if (complete)
+    *complete = g_search.complete;
+  return g_search.results ? g_search.results->len : 0;
+}
+
+void
+search_get_stats (struct search_stats *st)
+{
+  *st = g_search_stats;
+  st->entries = g_search_lru ? g_queue_get_length (g_search_lru) : 0;
+}
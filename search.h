@@ -0,0 +1,58 @@
+#ifndef _SPOTIFY_SEARCH_H_
+#define _SPOTIFY_SEARCH_H_
+
+#include <libspotify/api.h>
+
+/// Queries whose results are kept by default, in memory and on disk
+#define SEARCH_CACHE_ENTRIES 64
+/// Cached results older than this are served, then searched again
+#define SEARCH_CACHE_TTL_S (7 * 24 * 3600)
+/// Tracks in the first page, which is what type-ahead waits for
+#define SEARCH_FIRST_PAGE 10
+/// Tracks in each page after it, up to SEARCH_MAX_TRACKS
+#define SEARCH_PAGE 20
+#define SEARCH_MAX_TRACKS 50
+/// Albums and artists, all in the first page
+#define SEARCH_MAX_ALBUMS 5
+#define SEARCH_MAX_ARTISTS 5
+
+#define SEARCH_URI_LEN 48
+#define SEARCH_NAME_LEN 80
+
+enum search_kind
+{
+  SEARCH_TRACK = 't',
+  SEARCH_ALBUM = 'a',
+  SEARCH_ARTIST = 'r'
+};
+
+/**
+ * A track, album or artist found, with what it takes to show it without
+ * loading it from libspotify. Albums have no album, artists only a name.
+ */
+struct search_result
+{
+  char kind;
+  char uri[SEARCH_URI_LEN];
+  char name[SEARCH_NAME_LEN];
+  char artist[SEARCH_NAME_LEN];
+  char album[SEARCH_NAME_LEN];
+  int duration_ms;
+};
+
+struct search_stats
+{
+  unsigned int queries;
+  unsigned int hits;		/* answered from the cache */
+  unsigned int prefix_hits;	/* answered from a shorter cached query */
+  unsigned int pages;		/* fetched from Spotify */
+  unsigned int failures;
+  unsigned int entries;		/* queries in the cache */
+};
+
+void search_init (sp_session *session, const char *path, int entries);
+int search_start (const char *query);
+int search_results (const struct search_result **results, int *complete);
+void search_get_stats (struct search_stats *st);
+
+#endif /* _SPOTIFY_SEARCH_H_ */
@@ -0,0 +1,349 @@
+/*
+ * Spectrum analyser feed for visualizers.
+ *
+ * The tap downmixes to mono and decimates by averaging into a float
+ * ring, which is all the output thread pays. The worker windows the
+ * newest SPECTRUM_FFT samples, runs a real FFT as a half-size complex
+ * FFT on split real/imaginary arrays (so butterflies go four at a time
+ * through the GCC vector extension), sums the bins into log-spaced bands
+ * and publishes the result through a double buffer. Readers never block:
+ * each slot carries a sequence number that is odd while it is written,
+ * and a reader that raced the writer just copies again.
+ *
+ * The worker sleeps on a condition variable while nobody is subscribed
+ * and no spectrum_read() lease is running, or while it is paused, and it
+ * clears spectrum_active so the tap turns back into a no-op.
+ */
+
+#include "spectrum.h"
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+typedef float v4f __attribute__((vector_size(16)));
+
+#define SPECTRUM_RING	4096
+#define RING_MASK	(SPECTRUM_RING - 1)
+#define FFT_HALF	(SPECTRUM_FFT / 2)
+
+int spectrum_active;
+
+/* Written by the output thread only */
+static float ring[SPECTRUM_RING];
+static unsigned int ring_w;
+static int ring_rate;
+static float acc;
+static int acc_n;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int subscribers;
+static int64_t lease_until;
+static int64_t period_ns;
+static int paused;
+
+static struct {
+	unsigned int seq;
+	struct spectrum_frame f;
+} slot[2];
+static unsigned int latest;
+
+/* Worker state */
+static float window[SPECTRUM_FFT];
+static float re[FFT_HALF] __attribute__((aligned(16)));
+static float im[FFT_HALF] __attribute__((aligned(16)));
+/* Twiddles of the butterflies spanning h are at [h, 2h) */
+static float tw_re[FFT_HALF] __attribute__((aligned(16)));
+static float tw_im[FFT_HALF] __attribute__((aligned(16)));
+static float post_re[FFT_HALF + 1], post_im[FFT_HALF + 1];
+static unsigned short bitrev[FFT_HALF];
+static int band_lo[SPECTRUM_BANDS], band_hi[SPECTRUM_BANDS];
+static int band_rate;
+static unsigned int frames_done;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void spectrum_tap(const int16_t *samples, int frames, int channels, int rate)
+{
+	float scale = 1.0f / (32768.0f * channels * SPECTRUM_DECIMATE);
+	unsigned int w = ring_w;
+	int i, k, s;
+
+	for (i = 0; i < frames; i++) {
+		s = 0;
+		for (k = 0; k < channels; k++)
+			s += samples[i * channels + k];
+		acc += s;
+		if (++acc_n == SPECTRUM_DECIMATE) {
+			ring[w++ & RING_MASK] = acc * scale;
+			acc = 0;
+			acc_n = 0;
+		}
+	}
+
+	__atomic_store_n(&ring_rate, rate, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring_w, w, __ATOMIC_RELEASE);
+}
+
+static void fft_init(void)
+{
+	int h, j, i, r, b;
+
+	for (i = 0; i < SPECTRUM_FFT; i++)
+		window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / SPECTRUM_FFT);
+
+	for (h = 1; h < FFT_HALF; h <<= 1)
+		for (j = 0; j < h; j++) {
+			tw_re[h + j] = cosf(M_PI * j / h);
+			tw_im[h + j] = -sinf(M_PI * j / h);
+		}
+
+	for (i = 0; i <= FFT_HALF; i++) {
+		post_re[i] = cosf(2 * M_PI * i / SPECTRUM_FFT);
+		post_im[i] = -sinf(2 * M_PI * i / SPECTRUM_FFT);
+	}
+
+	for (i = 0; i < FFT_HALF; i++) {
+		for (r = 0, b = 1; b < FFT_HALF; b <<= 1)
+			r = (r << 1) | !!(i & b);
+		bitrev[i] = r;
+	}
+}
+
+/* In-place radix-2 FFT of re/im, which are in bit-reversed order */
+static void fft(void)
+{
+	v4f ar, ai, br, bi, wr, wi, tr, ti;
+	float sr, si, xr, xi;
+	int h, g, j;
+
+	for (h = 1; h < FFT_HALF; h <<= 1) {
+		for (g = 0; g < FFT_HALF; g += 2 * h) {
+			if (h >= 4) {
+				for (j = 0; j < h; j += 4) {
+					ar = *(v4f *)&re[g + j];
+					ai = *(v4f *)&im[g + j];
+					br = *(v4f *)&re[g + h + j];
+					bi = *(v4f *)&im[g + h + j];
+					wr = *(v4f *)&tw_re[h + j];
+					wi = *(v4f *)&tw_im[h + j];
+					tr = br * wr - bi * wi;
+					ti = br * wi + bi * wr;
+					*(v4f *)&re[g + j] = ar + tr;
+					*(v4f *)&im[g + j] = ai + ti;
+					*(v4f *)&re[g + h + j] = ar - tr;
+					*(v4f *)&im[g + h + j] = ai - ti;
+				}
+				continue;
+			}
+			for (j = 0; j < h; j++) {
+				xr = re[g + h + j];
+				xi = im[g + h + j];
+				sr = xr * tw_re[h + j] - xi * tw_im[h + j];
+				si = xr * tw_im[h + j] + xi * tw_re[h + j];
+				re[g + h + j] = re[g + j] - sr;
+				im[g + h + j] = im[g + j] - si;
+				re[g + j] += sr;
+				im[g + j] += si;
+			}
+		}
+	}
+}
+
+static void bands_setup(int rate)
+{
+	float nyquist = rate / 2.0f, f;
+	int b, k = 1;
+
+	for (b = 0; b < SPECTRUM_BANDS; b++) {
+		f = SPECTRUM_LOW_HZ * powf(nyquist / SPECTRUM_LOW_HZ,
+		                           (b + 1.0f) / SPECTRUM_BANDS);
+		band_lo[b] = k;
+		k = (int)(f * SPECTRUM_FFT / rate);
+		if (k <= band_lo[b])
+			k = band_lo[b] + 1;
+		if (k > FFT_HALF + 1)
+			k = FFT_HALF + 1;
+		band_hi[b] = k;
+	}
+	band_rate = rate;
+}
+
+static void publish(const struct spectrum_frame *f)
+{
+	unsigned int s = latest ^ 1;
+
+	__atomic_store_n(&slot[s].seq, slot[s].seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot[s].f = *f;
+	__atomic_store_n(&slot[s].seq, slot[s].seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&latest, s, __ATOMIC_RELEASE);
+}
+
+static void analyse(void)
+{
+	static unsigned int last_w;
+	struct spectrum_frame f;
+	float x, peak = 0, sum = 0, zr, zi, cr, ci, er, ei, or_, oi, p;
+	unsigned int w = __atomic_load_n(&ring_w, __ATOMIC_ACQUIRE);
+	int rate = __atomic_load_n(&ring_rate, __ATOMIC_RELAXED) / SPECTRUM_DECIMATE;
+	int i, k, b;
+
+	/* Nothing new, e.g. paused */
+	if (w == last_w || w < SPECTRUM_FFT || !rate)
+		return;
+	last_w = w;
+	if (rate != band_rate)
+		bands_setup(rate);
+
+	/* Even samples go to the real part, odd ones to the imaginary part */
+	for (i = 0; i < FFT_HALF; i++) {
+		x = ring[(w - SPECTRUM_FFT + 2 * i) & RING_MASK];
+		peak = fmaxf(peak, fabsf(x));
+		sum += x * x;
+		re[bitrev[i]] = x * window[2 * i];
+		x = ring[(w - SPECTRUM_FFT + 2 * i + 1) & RING_MASK];
+		peak = fmaxf(peak, fabsf(x));
+		sum += x * x;
+		im[bitrev[i]] = x * window[2 * i + 1];
+	}
+	fft();
+
+	memset(&f, 0, sizeof(f));
+	for (b = 0, k = band_lo[0]; b < SPECTRUM_BANDS; b++) {
+		for (p = 0; k < band_hi[b]; k++) {
+			/* Split the half-size transform into the real one */
+			zr = re[k % FFT_HALF];
+			zi = im[k % FFT_HALF];
+			cr = re[(FFT_HALF - k) % FFT_HALF];
+			ci = -im[(FFT_HALF - k) % FFT_HALF];
+			er = (zr + cr) / 2;
+			ei = (zi + ci) / 2;
+			or_ = (zi - ci) / 2;
+			oi = -(zr - cr) / 2;
+			zr = er + or_ * post_re[k] - oi * post_im[k];
+			zi = ei + or_ * post_im[k] + oi * post_re[k];
+			p += zr * zr + zi * zi;
+		}
+		/*
+		 * Scaled by the Hann window's energy, so a full scale sine
+		 * reads 0 dB wherever it falls between bins
+		 */
+		f.band[b] = 10 * log10f(p * 32 / (3.0f * SPECTRUM_FFT * SPECTRUM_FFT) + 1e-12f);
+	}
+	f.peak = 20 * log10f(peak + 1e-6f);
+	f.rms = 10 * log10f(sum / SPECTRUM_FFT + 1e-12f);
+	f.count = ++frames_done;
+	publish(&f);
+}
+
+static int running(int64_t now)
+{
+	return !paused && (subscribers > 0 || now < lease_until);
+}
+
+static void *spectrum_worker(void *arg)
+{
+	struct timespec ts;
+
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (!running(now_ns())) {
+			__atomic_store_n(&spectrum_active, 0, __ATOMIC_RELAXED);
+			pthread_cond_wait(&cond, &lock);
+		}
+		pthread_mutex_unlock(&lock);
+
+		ts.tv_sec = period_ns / 1000000000;
+		ts.tv_nsec = period_ns % 1000000000;
+		nanosleep(&ts, NULL);
+		analyse();
+	}
+	return NULL;
+}
+
+/*
+ * Start the analyser worker, producing at most fps frames a second.
+ * Returns -1 if the thread can't be created.
+ */
+int spectrum_start(int fps)
+{
+	pthread_t tid;
+
+	if (fps <= 0)
+		return -1;
+	period_ns = 1000000000 / fps;
+	fft_init();
+	return pthread_create(&tid, NULL, spectrum_worker, NULL) ? -1 : 0;
+}
+
+static void wake(void)
+{
+	__atomic_store_n(&spectrum_active, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&cond);
+}
+
+void spectrum_subscribe(void)
+{
+	pthread_mutex_lock(&lock);
+	subscribers++;
+	if (!paused)
+		wake();
+	pthread_mutex_unlock(&lock);
+}
+
+void spectrum_unsubscribe(void)
+{
+	pthread_mutex_lock(&lock);
+	if (subscribers > 0)
+		subscribers--;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Stop the analyser, and the tap, whoever is watching, until unpaused.
+ * Readers keep getting the last frame meanwhile.
+ */
+void spectrum_pause(int pause)
+{
+	pthread_mutex_lock(&lock);
+	paused = pause;
+	if (!paused && running(now_ns()))
+		wake();
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Copy the newest frame to f. Polling also keeps the analyser running
+ * for SPECTRUM_LEASE_MS, so a periodic reader needn't subscribe.
+ * Returns -1 if no frame has been produced yet.
+ */
+int spectrum_read(struct spectrum_frame *f)
+{
+	unsigned int i, s;
+
+	pthread_mutex_lock(&lock);
+	lease_until = now_ns() + (int64_t)SPECTRUM_LEASE_MS * 1000000;
+	if (!paused && !__atomic_load_n(&spectrum_active, __ATOMIC_RELAXED))
+		wake();
+	pthread_mutex_unlock(&lock);
+
+	for (;;) {
+		i = __atomic_load_n(&latest, __ATOMIC_ACQUIRE);
+		s = __atomic_load_n(&slot[i].seq, __ATOMIC_ACQUIRE);
+		if (s & 1)
+			continue;
+		memcpy(f, &slot[i].f, sizeof(*f));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot[i].seq, __ATOMIC_RELAXED) == s)
+			break;
+	}
+	return f->count ? 0 : -1;
+}
@@ -0,0 +1,45 @@
+/*
+ * Spectrum analyser feed for visualizers.
+ *
+ * The output thread hands every chunk to spectrum_feed(), which costs one
+ * load and a branch unless someone is watching. While someone is, chunks
+ * are downmixed and decimated into a ring, and a worker thread analyses
+ * the newest window at a fixed frame rate.
+ */
+#ifndef _SPOTIFY_SPECTRUM_H_
+#define _SPOTIFY_SPECTRUM_H_
+
+#include <stdint.h>
+
+#define SPECTRUM_BANDS		16
+#define SPECTRUM_FFT		1024	/* analysis window, decimated samples */
+#define SPECTRUM_DECIMATE	2
+#define SPECTRUM_LOW_HZ		40.0f	/* lower edge of the first band */
+/* How long a spectrum_read() keeps the analyser running */
+#define SPECTRUM_LEASE_MS	2000
+
+struct spectrum_frame {
+	float band[SPECTRUM_BANDS];	/* dBFS, log spaced up to Nyquist */
+	float peak;			/* dBFS of the window */
+	float rms;
+	unsigned int count;		/* frames analysed so far */
+};
+
+extern int spectrum_active;
+
+extern int spectrum_start(int fps);
+extern void spectrum_tap(const int16_t *samples, int frames, int channels,
+                         int rate);
+extern void spectrum_subscribe(void);
+extern void spectrum_unsubscribe(void);
+extern void spectrum_pause(int pause);
+extern int spectrum_read(struct spectrum_frame *f);
+
+static inline void spectrum_feed(const int16_t *samples, int frames,
+                                 int channels, int rate)
+{
+	if (__atomic_load_n(&spectrum_active, __ATOMIC_RELAXED))
+		spectrum_tap(samples, frames, channels, rate);
+}
+
+#endif /* _SPOTIFY_SPECTRUM_H_ */
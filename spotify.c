@@ -1,4 +1,3 @@
-#include "keys.h"
 #include <glib.h>
 #include <navit/main.h>
 #include <navit/debug.h>
@@ -9,27 +8,54 @@
 #include <navit/event.h>
 #include <navit/command.h>
 #include <navit/config_.h>
-
-#include <libspotify/api.h>
-#include "audio.h"
-#include "queue.h"
-
-extern const uint8_t g_appkey[];
-extern const size_t g_appkey_size;
-
-/// Handle to the playlist currently being played
-static sp_playlist *g_jukeboxlist;
-/// Handle to the current track 
-static sp_track *g_currenttrack;
-/// Index to the next track
-static int g_track_index;
-/// The global session handle
-
-static sp_session *g_sess;
-int g_logged_in;
-static audio_fifo_t g_audiofifo;
-
-int next_timeout = 0;
+#include <navit/vehicle.h>
+#include <navit/route.h>
+#include <navit/map.h>
+#include <navit/item.h>
+#include <navit/projection.h>
+#include <navit/transform.h>
+#include <navit/speech.h>
+#include <navit/plugin.h>
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dsp.h"
+#include "log.h"
+#include "mpris.h"
+#include "player.h"
+#include "player-state.h"
+#include "prefetch.h"
+#include "search.h"
+#include "spectrum.h"
+#include "trace.h"
+
+/// Default step of spotify_skip_forward and spotify_skip_back
+#define SPOTIFY_SKIP_SECONDS 10
+#define SPOTIFY_VOLUME_STEP_DB 2
+/// Vehicle speed updates closer together than this are ignored
+#define SPOTIFY_SPEED_INTERVAL_MS 500
+/// Time constant of the speed smoothing
+#define SPOTIFY_SPEED_SMOOTH_MS 4000.0
+/// Speed below which there is no boost, and above which it stops growing (km/h)
+#define SPOTIFY_SPEED_MIN 30.0
+#define SPOTIFY_SPEED_MAX 130.0
+/// Speed at which the boost reaches spotify_speed_volume (km/h)
+#define SPOTIFY_SPEED_REF 100.0
+/// How often the prefetch plan is redone while a route is active
+#define SPOTIFY_PLAN_INTERVAL_S 30
+/// Level shown as an empty spectrum bar, dBFS
+#define SPOTIFY_SPECTRUM_FLOOR_DB -60
+/// Period of the main loop lag probe
+#define SPOTIFY_LAG_PERIOD_MS 200
+/// Lateness of the probe that says Navit's main loop is busy
+#define SPOTIFY_LAG_MS 300
+/// How long the main loop has to keep up before we take the load back
+#define SPOTIFY_LAG_HOLD_MS 3000
+/// Text to speech command of the spotify speech type, %s is the text
+#define SPOTIFY_SPEECH_CMD "espeak --stdout %s"
 
 struct attr initial_layout, main_layout;
 
@@ -39,337 +65,591 @@ struct spotify
   struct callback *callback;
   struct event_idle *idle;
   struct attr **attrs;
-  char *login;
-  char *password;
-  char *playlist;
-  gboolean playing;
+  struct player_config player;
+  int speed_volume_db;
+  struct vehicle *vehicle;
+  struct callback *vehicle_cb;
+  double speed;
+  gint64 speed_time;
+  int speed_gain;
+  struct prefetch_coverage coverage;
+  gint64 plan_time;
+  struct route *route;
+  struct callback *route_cb;
+  int route_busy;
+  struct callback *lag_cb;
+  gint64 lag_time;
+  gint64 lag_until;
 } *spotify;
 
 /**
- * The callbacks we are interested in for individual playlists.
+ * Hand the player core's log messages on to navit's debug output, which
+ * decides what is shown.
  */
-static sp_playlist_callbacks pl_callbacks = {
-//        .tracks_added = &tracks_added,
-//        .tracks_removed = &tracks_removed,
-//        .tracks_moved = &tracks_moved,
-//        .playlist_renamed = &playlist_renamed,
-};
-
+static void
+spotify_log (int level, const char *function, const char *msg)
+{
+  dbg (level, "%s: %s", function, msg);
+}
 
 /**
- * Called on various events to start playback if it hasn't been started already.
+ * Vehicle position callback: smooth the reported speed and turn it into
+ * the road noise part of the output gain.
  *
- * The function simply starts playing the first track of the playlist.
+ * Updates are rate limited to SPOTIFY_SPEED_INTERVAL_MS and the gain is
+ * only handed on when it moves by a quarter dB, so a fast position source
+ * costs next to nothing; the gain stage ramps between the values.
  */
 static void
-try_jukebox_start (void)
+spotify_speed_update (struct spotify *spotify)
 {
-  dbg (0, "Starting the jukebox\n");
-  sp_track *t;
-  spotify->playing=0;
-
-  if (!g_jukeboxlist)
-    dbg (0, "jukebox: No playlist. Waiting\n");
-    // Fixme : g_jukeboxlist is never set to the right value
-    // return;
+  struct attr attr;
+  gint64 now = g_get_monotonic_time ();
+  double dt, speed, db;
+  int gain;
 
-  if (!sp_playlist_num_tracks (g_jukeboxlist))
-    {
-      dbg (0,"jukebox: No tracks in playlist. Waiting\n");
-      return;
-    }
+  dt = (now - spotify->speed_time) / 1000.0;
+  if (spotify->speed_time && dt < SPOTIFY_SPEED_INTERVAL_MS)
+    return;
+  if (!vehicle_get_attr (spotify->vehicle, attr_position_speed, &attr, NULL))
+    return;
 
-  if (sp_playlist_num_tracks (g_jukeboxlist) < g_track_index)
+  if (spotify->speed_time)
+    spotify->speed += (*attr.u.numd - spotify->speed) *
+      (1 - exp (-dt / SPOTIFY_SPEED_SMOOTH_MS));
+  else
+    spotify->speed = *attr.u.numd;
+  spotify->speed_time = now;
+
+  speed = CLAMP (spotify->speed, SPOTIFY_SPEED_MIN, SPOTIFY_SPEED_MAX);
+  db = spotify->speed_volume_db * (speed - SPOTIFY_SPEED_MIN) /
+    (SPOTIFY_SPEED_REF - SPOTIFY_SPEED_MIN);
+  gain = dsp_gain_from_db (floor (db * 4) / 4);
+  if (gain != spotify->speed_gain)
     {
-      dbg (0,"jukebox: No more tracks in playlist. Waiting\n");
-      return;
+      spotify->speed_gain = gain;
+      audio_set_speed_gain (player_audio (), gain);
+      dbg (1, "speed %.0f km/h, boost %.2f dB\n", spotify->speed, db);
     }
-  
-  t = sp_playlist_track (g_jukeboxlist, g_track_index);
+}
 
-  if (g_currenttrack && t != g_currenttrack)
-    {
-      /* Someone changed the current track */
-      audio_fifo_flush (&g_audiofifo);
-      sp_session_player_unload (g_sess);
-      g_currenttrack = NULL;
-    }
+/**
+ * Follow the speed of the navit's vehicle, if speed dependent volume is
+ * enabled. The vehicle may not exist yet when we are initialized, so
+ * this is retried from the idle callback until it succeeds.
+ */
+static void
+spotify_speed_attach (struct spotify *spotify)
+{
+  struct attr attr;
 
-  if (!t)
+  if (!spotify->speed_volume_db || spotify->vehicle)
     return;
-
-  if (sp_track_error (t) != SP_ERROR_OK)
+  if (!navit_get_attr (spotify->navit, attr_vehicle, &attr, NULL)
+      || !attr.u.vehicle)
     return;
 
-  if (g_currenttrack == t)
-    return;
+  spotify->vehicle = attr.u.vehicle;
+  spotify->speed_gain = DSP_UNITY;
+  spotify->vehicle_cb =
+    callback_new_attr_1 (callback_cast (spotify_speed_update),
+                         attr_position_coord_geo, spotify);
+  attr.type = attr_callback;
+  attr.u.callback = spotify->vehicle_cb;
+  vehicle_add_attr (spotify->vehicle, &attr);
+  dbg (1, "following vehicle speed, +%d dB at %.0f km/h\n",
+       spotify->speed_volume_db, SPOTIFY_SPEED_REF);
+}
 
-  g_currenttrack = t;
+/**
+ * Tell the player whether Navit is busy, from its route calculation and
+ * the lag of its main loop.
+ */
+static void
+spotify_load_update (struct spotify *spotify, const char *reason)
+{
+  int busy = spotify->route_busy
+    || g_get_monotonic_time () < spotify->lag_until;
+
+  player_load_shed (busy, reason);
+  /* Replan what was held back as soon as the idle callback runs */
+  if (!busy)
+    spotify->plan_time = 0;
+}
 
-  dbg (0,"jukebox: Now playing \"%s\"...\n", sp_track_name (t));
+/**
+ * Route status callback: Navit is busy while it builds the route graph
+ * and path.
+ */
+static void
+spotify_route_status (struct spotify *spotify, struct route *route,
+                      struct attr *attr)
+{
+  int busy = (attr->u.num & route_status_building_path)
+    == route_status_building_path;
 
-  sp_session_player_load (g_sess, t);
-  spotify->playing=1;
-  sp_session_player_play (g_sess, 1);
+  if (busy == spotify->route_busy)
+    return;
+  spotify->route_busy = busy;
+  spotify_load_update (spotify, "route calculation");
 }
 
-/* --------------------  PLAYLIST CONTAINER CALLBACKS  --------------------- */
 /**
- * Callback from libspotify, telling us a playlist was added to the playlist container.
- *
- * We add our playlist callbacks to the newly added playlist.
- *
- * @param  pc            The playlist container handle
- * @param  pl            The playlist handle
- * @param  position      Index of the added playlist
- * @param  userdata      The opaque pointer
+ * Main loop lag probe: a timeout that fires much later than asked means
+ * Navit kept the main loop for itself, drawing or calculating.
  */
 static void
-playlist_added (sp_playlistcontainer * pc, sp_playlist * pl,
-		int position, void *userdata)
+spotify_lag_probe (struct spotify *spotify)
 {
-  sp_playlist_add_callbacks (pl, &pl_callbacks, NULL);
-  dbg (0, "List name: %s\n", sp_playlist_name (pl));
+  gint64 now = g_get_monotonic_time ();
+  gint64 late = now - spotify->lag_time - SPOTIFY_LAG_PERIOD_MS * 1000;
+  int was_busy = spotify->lag_time < spotify->lag_until;
 
-  if (!strcasecmp (sp_playlist_name (pl), spotify->playlist))
+  spotify->lag_time = now;
+  if (late > SPOTIFY_LAG_MS * 1000)
     {
-      g_jukeboxlist = pl;
-      try_jukebox_start ();
+      spotify->lag_until = now + SPOTIFY_LAG_HOLD_MS * 1000;
+      if (!was_busy)
+        dbg (1, "load: main loop %lld ms late\n", (long long) late / 1000);
     }
+  if (was_busy != (now < spotify->lag_until))
+    spotify_load_update (spotify, "main loop lag");
 }
 
-
 /**
- * Callback from libspotify, telling us the rootlist is fully synchronized
- * We can resume playback
- *
- * @param  pc            The playlist container handle
- * @param  userdata      The opaque pointer
+ * Follow the status of the navit's route, retried from the idle callback
+ * until the route exists.
  */
 static void
-container_loaded (sp_playlistcontainer * pc, void *userdata)
+spotify_route_attach (struct spotify *spotify)
 {
-  dbg (0, "jukebox: Rootlist synchronized (%d playlists)\n",
-	   sp_playlistcontainer_num_playlists (pc));
-  try_jukebox_start ();
+  struct attr attr;
+
+  if (spotify->route)
+    return;
+  if (!navit_get_attr (spotify->navit, attr_route, &attr, NULL)
+      || !attr.u.route)
+    return;
+
+  spotify->route = attr.u.route;
+  spotify->route_cb =
+    callback_new_attr_1 (callback_cast (spotify_route_status),
+                         attr_route_status, spotify);
+  attr.type = attr_callback;
+  attr.u.callback = spotify->route_cb;
+  route_add_attr (spotify->route, &attr);
 }
 
 /**
- * The playlist container callbacks
+ * Turn the navit's current route into prefetch points, using the travel
+ * time Navit estimated for each segment.
+ *
+ * @return the number of points, or -1 if there is no route
  */
-static sp_playlistcontainer_callbacks pc_callbacks = {
-  .playlist_added = &playlist_added,
-//        .playlist_removed = &playlist_removed,
-  .container_loaded = &container_loaded,
-};
-
-static void
-on_login (sp_session * session, sp_error error)
+static int
+spotify_route_get (struct spotify *spotify, struct prefetch_route *route)
 {
-  dbg (0, "spotify login\n");
-  if (error != SP_ERROR_OK)
+  struct attr attr;
+  struct map *map;
+  struct map_rect *mr;
+  struct item *item;
+  struct coord c;
+  struct coord_geo g;
+  int time = 0, n;
+
+  if (!navit_get_attr (spotify->navit, attr_route, &attr, NULL))
+    return -1;
+  map = route_get_map (attr.u.route);
+  if (!map)
+    return -1;
+
+  prefetch_route_clear (route);
+  mr = map_rect_new (map, NULL);
+  while ((item = map_rect_get_item (mr)))
     {
-      dbg (0, "Error: unable to log in: %s\n",
-	       sp_error_message (error));
-      exit (1);
+      if (item->type != type_street_route)
+        continue;
+      for (n = 0; item_coord_get (item, &c, 1); n++)
+        if (!n)
+          {
+            transform_to_geo (projection_mg, &c, &g);
+            prefetch_route_add (route, g.lat, g.lng, time / 10);
+          }
+      /* Segment travel time, in tenths of a second */
+      if (item_attr_get (item, attr_time, &attr))
+        time += attr.u.num;
     }
+  map_rect_destroy (mr);
 
-  g_logged_in = 1;
-  sp_playlistcontainer *pc = sp_session_playlistcontainer (session);
-  int i;
-
-  sp_playlistcontainer_add_callbacks (pc, &pc_callbacks, NULL);
-  dbg (0, "Got %d playlists\n", sp_playlistcontainer_num_playlists (pc))
-
-  for (i = 0; i < sp_playlistcontainer_num_playlists (pc); ++i)
+  /* The end of the last segment is the destination */
+  if (route->npoints)
     {
-      sp_playlist *pl = sp_playlistcontainer_playlist (pc, i);
+      transform_to_geo (projection_mg, &c, &g);
+      prefetch_route_add (route, g.lat, g.lng, time / 10);
+    }
+  return route->npoints;
+}
 
-      sp_playlist_add_callbacks (pl, &pl_callbacks, NULL);
 
-      if (!strcasecmp (sp_playlist_name (pl), spotify->playlist))
-        {
-          dbg (0,"Found the playlist %s\n", spotify->playlist);
-          switch (sp_playlist_get_offline_status (session, pl))
-            {
-            case SP_PLAYLIST_OFFLINE_STATUS_NO:
-              dbg (0, "Playlist is not offline enabled.\n");
-              sp_playlist_set_offline_mode (session, pl, 1);
-              dbg (0, "  %d tracks to sync\n",
-                      sp_offline_tracks_to_sync (session));
-              break;
-
-            case SP_PLAYLIST_OFFLINE_STATUS_YES:
-              dbg (0, "Playlist is synchronized to local storage.\n");
-              break;
-
-            case SP_PLAYLIST_OFFLINE_STATUS_DOWNLOADING:
-              dbg
-                (0, "This playlist is currently downloading. Only one playlist can be in this state any given time.\n");
-              break;
-
-            case SP_PLAYLIST_OFFLINE_STATUS_WAITING:
-              dbg (0, "Playlist is queued for download.\n");
-              break;
-
-            default:
-              dbg (0, "unknow state\n");
-              break;
-            }
-          g_jukeboxlist = pl;
-          // try_jukebox_start ();
-        }
-    }
-  if (!g_jukeboxlist)
+/**
+ * Redo the prefetch plan from the navit's route, at most every
+ * SPOTIFY_PLAN_INTERVAL_S.
+ */
+static void
+spotify_prefetch_update (struct spotify *spotify)
+{
+  struct prefetch_route route = { 0 };
+  struct prefetch_plan plan;
+  gint64 now = g_get_monotonic_time ();
+
+  /* Walking the route is left for when Navit is done with it */
+  if (!spotify->coverage.nareas || spotify->route_busy
+      || now < spotify->lag_until
+      || now - spotify->plan_time < SPOTIFY_PLAN_INTERVAL_S * G_USEC_PER_SEC)
+    return;
+  spotify->plan_time = now;
+
+  if (spotify_route_get (spotify, &route) > 0)
     {
-      dbg (0, "jukebox: No such playlist. Waiting for one to pop up...\n");
+      prefetch_plan (&route, &spotify->coverage, &plan);
+      player_prefetch_apply (&plan);
     }
-  // try_jukebox_start ();
+  else
+    player_buffer_reset ();
+  prefetch_route_clear (&route);
+}
 
+static void
+spotify_spotify_idle (struct spotify *spotify)
+{
+  player_process ();
+  spotify_speed_attach (spotify);
+  spotify_route_attach (spotify);
+  spotify_prefetch_update (spotify);
+}
+
+static void
+spotify_cmd_spotify_previous_track(struct spotify *spotify)
+{
+  player_previous ();
+}
 
+static void
+spotify_cmd_spotify_next_track(struct spotify *spotify)
+{
+  player_next ();
 }
 
 static int
-on_music_delivered (sp_session * session, const sp_audioformat * format,
-                    const void *frames, int num_frames)
+spotify_cmd_arg_seconds (struct attr **in, int def)
 {
-  audio_fifo_t *af = &g_audiofifo;
-  audio_fifo_data_t *afd;
-  size_t s;
+  if (in && in[0] && ATTR_IS_INT (in[0]->type))
+    return in[0]->u.num;
+  return def;
+}
 
-  if (num_frames == 0)
-    return 0;                   // Audio discontinuity, do nothing
+static void
+spotify_cmd_spotify_seek(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  player_seek (spotify_cmd_arg_seconds (in, 0) * 1000);
+}
 
-  pthread_mutex_lock (&af->mutex);
+static void
+spotify_cmd_spotify_skip_forward(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  int secs = spotify_cmd_arg_seconds (in, SPOTIFY_SKIP_SECONDS);
 
-  /* Buffer one second of audio */
-  if (af->qlen > format->sample_rate)
-    {
-      pthread_mutex_unlock (&af->mutex);
+  player_skip (secs * 1000);
+}
+
+static void
+spotify_cmd_spotify_skip_back(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  int secs = spotify_cmd_arg_seconds (in, SPOTIFY_SKIP_SECONDS);
+
+  player_skip (-secs * 1000);
+}
 
-      return 0;
+/**
+ * Plan and apply prefetching for a canned route file (see prefetch.c),
+ * or for the current route when no file is given.
+ */
+static void
+spotify_cmd_spotify_prefetch_plan(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  struct prefetch_route route = { 0 };
+  struct prefetch_plan plan;
+  int n;
+
+  if (in && in[0] && ATTR_IS_STRING (in[0]->type))
+    n = prefetch_route_load (&route, in[0]->u.str);
+  else
+    n = spotify_route_get (spotify, &route);
+  if (n <= 0)
+    {
+      dbg (0, "prefetch: no route to plan for\n");
+      prefetch_route_clear (&route);
+      return;
     }
 
-  s = num_frames * sizeof (int16_t) * format->channels;
+  prefetch_plan (&route, &spotify->coverage, &plan);
+  dbg (0, "prefetch: %d points, %d s of route, gap %d..%d s, %d s of music needed\n",
+       route.npoints, plan.duration_s, plan.gap_start_s, plan.gap_end_s,
+       plan.need_s);
+  player_prefetch_apply (&plan);
+  prefetch_route_clear (&route);
+}
 
-  afd = malloc (sizeof (*afd) + s);
-  memcpy (afd->samples, frames, s);
+/**
+ * "Artist - Track  m:ss / m:ss" for an OSD, e.g.
+ * <osd type="cmd_interface" command="spotify_now_playing()" update_period="1"/>
+ */
+static void
+spotify_cmd_spotify_now_playing(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  struct player_state st;
+  struct attr attr;
 
-  afd->nsamples = num_frames;
+  player_state_read (&st);
+  attr.type = attr_label;
+  if (st.track[0])
+    attr.u.str = g_strdup_printf ("%s%s%s  %d:%02d / %d:%02d", st.artist,
+                                  st.artist[0] ? " - " : "", st.track,
+                                  st.position_ms / 60000,
+                                  st.position_ms / 1000 % 60,
+                                  st.duration_ms / 60000,
+                                  st.duration_ms / 1000 % 60);
+  else
+    attr.u.str = g_strdup ("");
+  *out = attr_generic_add_attr (*out, &attr);
+  g_free (attr.u.str);
+}
 
-  afd->rate = format->sample_rate;
-  afd->channels = format->channels;
+/**
+ * The spectrum as a row of block characters for a cmd_interface OSD.
+ * Polling this keeps the analyser running; it stops by itself a couple
+ * of seconds after the OSD goes away.
+ */
+static void
+spotify_cmd_spotify_spectrum(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  static const char *bars[] = { " ", "\u2581", "\u2582", "\u2583",
+    "\u2584", "\u2585", "\u2586", "\u2587", "\u2588" };
+  struct spectrum_frame f;
+  struct attr attr;
+  char text[SPECTRUM_BANDS * 4 + 1] = "";
+  int b, level;
 
-  TAILQ_INSERT_TAIL (&af->q, afd, link);
-  af->qlen += num_frames;
+  if (!spotify->player.spectrum_fps || spectrum_read (&f))
+    return;
+  for (b = 0; b < SPECTRUM_BANDS; b++)
+    {
+      level = (f.band[b] - SPOTIFY_SPECTRUM_FLOOR_DB) * 8
+        / -SPOTIFY_SPECTRUM_FLOOR_DB;
+      strcat (text, bars[CLAMP (level, 0, 8)]);
+    }
+  attr.type = attr_label;
+  attr.u.str = text;
+  *out = attr_generic_add_attr (*out, &attr);
+}
 
-  pthread_cond_signal (&af->cond);
-  pthread_mutex_unlock (&af->mutex);
+static void
+spotify_cmd_spotify_stats(struct spotify *spotify)
+{
+  player_stats ();
+}
 
-  return num_frames;
+/**
+ * Dump the trace rings, to the given file or to trace.bin in the
+ * libspotify cache.
+ */
+static void
+spotify_cmd_spotify_trace_dump(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  const char *path = NULL;
+
+  if (in && in[0] && ATTR_IS_STRING (in[0]->type))
+    path = in[0]->u.str;
+  if (trace_dump (path))
+    dbg (0, "can't dump the trace to %s\n", path ? path : "trace.bin");
 }
 
+/**
+ * Change a setting live, e.g. spotify_config("device", "hw:1"), see
+ * player_reconfigure(). Without arguments nothing changes. Returns, and
+ * logs, the configuration in effect.
+ */
 static void
-on_end_of_track (sp_session * session)
+spotify_cmd_spotify_config(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
 {
-  
-  ++g_track_index;
-  try_jukebox_start ();
+  char report[256], num[16];
+  const char *name = NULL, *value = NULL;
+  struct attr attr;
+
+  if (in && in[0] && ATTR_IS_STRING (in[0]->type))
+    {
+      name = in[0]->u.str;
+      if (in[1] && ATTR_IS_STRING (in[1]->type))
+        value = in[1]->u.str;
+      else if (in[1] && ATTR_IS_INT (in[1]->type))
+        {
+          g_snprintf (num, sizeof (num), "%ld", (long) in[1]->u.num);
+          value = num;
+        }
+    }
+  player_reconfigure (name, value, report, sizeof (report));
+  dbg (0, "spotify: %s\n", report);
+
+  attr.type = attr_label;
+  attr.u.str = report;
+  *out = attr_generic_add_attr (*out, &attr);
 }
 
-static sp_session_callbacks session_callbacks = {
-  .logged_in = &on_login,
-//  .notify_main_thread = &on_main_thread_notified,
-  .music_delivery = &on_music_delivered,
-//  .log_message = &on_log,
-  .end_of_track = &on_end_of_track,
-//  .offline_status_updated = &offline_status_updated,
-//  .play_token_lost = &play_token_lost,
-};
+/**
+ * A label per result of the current search, tracks first, then "..."
+ * while more are coming.
+ */
+static void
+spotify_search_labels (struct attr ***out)
+{
+  const struct search_result *r;
+  struct attr attr;
+  int i, n, complete;
 
-static sp_session_config spconfig = {
-  .api_version = SPOTIFY_API_VERSION,
-  .cache_location = "tmp",
-  .settings_location = "tmp",
-  .application_key = g_appkey,
-  .application_key_size = 0,	// set in main()
-  .user_agent = "spot",
-  .callbacks = &session_callbacks,
-  NULL
-};
+  n = search_results (&r, &complete);
+  attr.type = attr_label;
+  for (i = 0; i < n; i++)
+    {
+      if (r[i].kind == SEARCH_TRACK)
+        attr.u.str = g_strdup_printf ("%s - %s  %d:%02d", r[i].name,
+                                      r[i].artist, r[i].duration_ms / 60000,
+                                      r[i].duration_ms / 1000 % 60);
+      else if (r[i].kind == SEARCH_ALBUM)
+        attr.u.str = g_strdup_printf ("%s - %s (album)", r[i].name,
+                                      r[i].artist);
+      else
+        attr.u.str = g_strdup_printf ("%s (artist)", r[i].name);
+      *out = attr_generic_add_attr (*out, &attr);
+      g_free (attr.u.str);
+    }
+  if (!complete)
+    {
+      attr.u.str = "...";
+      *out = attr_generic_add_attr (*out, &attr);
+    }
+}
 
+/**
+ * Search the catalog, e.g. spotify_search("beatles yel") on every key of
+ * the on-screen keyboard. Returns what is known right away: the cached
+ * results, or those of a shorter query that still match.
+ */
 static void
-spotify_spotify_idle (struct spotify *spotify)
+spotify_cmd_spotify_search(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
+{
+  if (in && in[0] && ATTR_IS_STRING (in[0]->type))
+    search_start (in[0]->u.str);
+  spotify_search_labels (out);
+}
+
+/**
+ * The results of the last spotify_search() so far, as Spotify sends
+ * them, for a cmd_interface OSD.
+ */
+static void
+spotify_cmd_spotify_search_results(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
 {
-  sp_session_process_events (g_sess, &next_timeout);
+  spotify_search_labels (out);
 }
 
+/**
+ * Queue a track to play after the current one: the nth result of the
+ * last spotify_search(), counting from 1, or a track URI.
+ */
 static void
-spotify_cmd_spotify_previous_track(struct spotify *spotify)
+spotify_cmd_spotify_queue(struct spotify *spotify, char *function, struct attr **in, struct attr ***out, int *valid)
 {
-  if(g_track_index>0) {
-  	--g_track_index;
-  }
-  try_jukebox_start();
-  dbg (0,"rewinding to previous track\n");
+  const struct search_result *r;
+  const char *uri = NULL;
+  int n;
+
+  if (in && in[0] && ATTR_IS_STRING (in[0]->type))
+    uri = in[0]->u.str;
+  else if (in && in[0] && ATTR_IS_INT (in[0]->type))
+    {
+      n = in[0]->u.num;
+      if (n >= 1 && n <= search_results (&r, NULL)
+          && r[n - 1].kind == SEARCH_TRACK)
+        uri = r[n - 1].uri;
+    }
+  if (!uri || player_enqueue (uri))
+    dbg (0, "spotify: can't queue %s\n", uri ? uri : "that");
 }
 
 static void
-spotify_cmd_spotify_next_track(struct spotify *spotify)
+spotify_cmd_spotify_volume_up(struct spotify *spotify)
+{
+  player_volume_step (SPOTIFY_VOLUME_STEP_DB);
+}
+
+static void
+spotify_cmd_spotify_volume_down(struct spotify *spotify)
 {
-  ++g_track_index;
-  try_jukebox_start();
-  dbg (0,"skipping to next track\n");
+  player_volume_step (-SPOTIFY_VOLUME_STEP_DB);
 }
 
 static void
 spotify_cmd_spotify_toggle(struct spotify *spotify)
 {
-  if(spotify->playing){
-  	dbg (0,"pausing playback\n");
-  	sp_session_player_play(g_sess,0);
-  } else {
-  	dbg (0,"resuming playback\n");
-  	sp_session_player_play(g_sess,1);
-  }
-  spotify->playing=!spotify->playing;
+  player_toggle ();
 }
 
 static struct command_table commands[] = {
 	{"spotify_toggle", command_cast(spotify_cmd_spotify_toggle)},
 	{"spotify_next_track", command_cast(spotify_cmd_spotify_next_track)},
 	{"spotify_previous_track", command_cast(spotify_cmd_spotify_previous_track)},
+	{"spotify_seek", command_cast(spotify_cmd_spotify_seek)},
+	{"spotify_skip_forward", command_cast(spotify_cmd_spotify_skip_forward)},
+	{"spotify_skip_back", command_cast(spotify_cmd_spotify_skip_back)},
+	{"spotify_stats", command_cast(spotify_cmd_spotify_stats)},
+	{"spotify_prefetch_plan", command_cast(spotify_cmd_spotify_prefetch_plan)},
+	{"spotify_now_playing", command_cast(spotify_cmd_spotify_now_playing)},
+	{"spotify_spectrum", command_cast(spotify_cmd_spotify_spectrum)},
+	{"spotify_volume_up", command_cast(spotify_cmd_spotify_volume_up)},
+	{"spotify_volume_down", command_cast(spotify_cmd_spotify_volume_down)},
+	{"spotify_trace_dump", command_cast(spotify_cmd_spotify_trace_dump)},
+	{"spotify_config", command_cast(spotify_cmd_spotify_config)},
+	{"spotify_search", command_cast(spotify_cmd_spotify_search)},
+	{"spotify_search_results", command_cast(spotify_cmd_spotify_search_results)},
+	{"spotify_queue", command_cast(spotify_cmd_spotify_queue)},
 };
 
 static void
 spotify_navit_init (struct navit *nav)
 {
-  dbg (0, "spotify_navit_init\n");
-  sp_error error;
-  sp_session *session;
+  dbg (1, "spotify_navit_init\n");
 
-  spconfig.application_key_size = g_appkey_size;
-  error = sp_session_create (&spconfig, &session);
-  if (error != SP_ERROR_OK)
-    {
-      dbg (0, "Can't create spotify session :(\n");
-      return;
-    }
-  dbg (0, "Session created successfully :)\n");
-  g_sess = session;
-  g_logged_in = 0;
-  sp_session_login (session, spotify->login, spotify->password, 0, NULL);
-  audio_init (&g_audiofifo);
+  log_set_handler (spotify_log);
+  log_level = 1;
+  if (player_start (&spotify->player))
+    return;
+  if (spotify->player.dbus_address)
+    event_add_watch (mpris_command_fd (), event_watch_cond_read,
+                     callback_new_0 (callback_cast (player_mpris_commands)));
   spotify->navit = nav;
   spotify->callback =
     callback_new_1 (callback_cast (spotify_spotify_idle), spotify);
   event_add_idle (500, spotify->callback);
-  dbg (0, "Callback created successfully\n");
+  spotify->lag_time = g_get_monotonic_time ();
+  spotify->lag_cb =
+    callback_new_1 (callback_cast (spotify_lag_probe), spotify);
+  event_add_timeout (SPOTIFY_LAG_PERIOD_MS, 1, spotify->lag_cb);
+  dbg (1, "Callback created successfully\n");
   struct attr attr;
   spotify->navit=nav;
 
   if (navit_get_attr(nav, attr_callback_list, &attr, NULL)) {
-  	dbg(0,"Adding command\n");
+  	dbg(1,"Adding command\n");
 	command_add_table(attr.u.callback_list, commands, sizeof(commands)/sizeof(struct command_table), spotify);
   }
 
@@ -381,7 +661,7 @@ spotify_navit (struct navit *nav, int add)
   struct attr callback;
   if (add)
     {
-      dbg (0, "adding callback\n");
+      dbg (1, "adding callback\n");
       callback.type = attr_callback;
       callback.u.callback =
 	callback_new_attr_0 (callback_cast (spotify_navit_init), attr_navit);
@@ -389,6 +669,144 @@ spotify_navit (struct navit *nav, int add)
     }
 }
 
+struct speech_priv
+{
+  char *cmdline;
+};
+
+/**
+ * Feed a WAV file (16 bit PCM) to the prompt mixer. Walks the chunks
+ * for the format and the data; a streamed WAV has a bogus data size,
+ * so the data runs to the end of what was read at most.
+ */
+static int
+spotify_speech_wav (const guchar *buf, gsize len)
+{
+  int format = 0, channels = 0, rate = 0, bits = 0, ret;
+  gsize off = 12, size, i, n;
+  int16_t *samples;
+
+  if (len < 12 || memcmp (buf, "RIFF", 4) || memcmp (buf + 8, "WAVE", 4))
+    return -1;
+  while (off + 8 <= len)
+    {
+      const guchar *chunk = buf + off + 8;
+      size = chunk[-4] | chunk[-3] << 8 | chunk[-2] << 16 | (gsize) chunk[-1] << 24;
+      if (!memcmp (buf + off, "fmt ", 4) && size >= 16 && off + 8 + 16 <= len)
+	{
+	  format = chunk[0] | chunk[1] << 8;
+	  channels = chunk[2] | chunk[3] << 8;
+	  rate = chunk[4] | chunk[5] << 8 | chunk[6] << 16 | chunk[7] << 24;
+	  bits = chunk[14] | chunk[15] << 8;
+	}
+      else if (!memcmp (buf + off, "data", 4))
+	{
+	  if (format != 1 || bits != 16 || channels <= 0)
+	    return -1;
+	  n = MIN (size, len - off - 8) / (2 * channels);
+	  samples = g_new (int16_t, n * channels);
+	  for (i = 0; i < n * channels; i++)
+	    samples[i] = (int16_t) (chunk[2 * i] | chunk[2 * i + 1] << 8);
+	  ret = audio_prompt_write (player_audio (), samples, n, rate, channels);
+	  g_free (samples);
+	  return ret;
+	}
+      if (size > len - off - 8)
+	break;
+      off += 8 + size + (size & 1);
+    }
+  return -1;
+}
+
+/**
+ * Speak on a thread of its own: run the command, read the WAV it
+ * writes to stdout and queue it on the prompt mixer.
+ */
+static void *
+spotify_speech_run (void *data)
+{
+  char **argv = data;
+  GByteArray *wav = g_byte_array_new ();
+  GError *error = NULL;
+  guchar buf[4096];
+  ssize_t n;
+  int out;
+
+  if (!g_spawn_async_with_pipes (NULL, argv, NULL,
+				 G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+				 NULL, NULL, NULL, NULL, &out, NULL, &error))
+    {
+      dbg (0, "can't run %s: %s\n", argv[0], error->message);
+      g_error_free (error);
+    }
+  else
+    {
+      while ((n = read (out, buf, sizeof (buf))) > 0)
+	g_byte_array_append (wav, buf, n);
+      close (out);
+      if (spotify_speech_wav (wav->data, wav->len))
+	dbg (0, "no prompt from %s\n", argv[0]);
+    }
+  g_byte_array_free (wav, TRUE);
+  g_strfreev (argv);
+  return NULL;
+}
+
+static int
+spotify_speech_say (struct speech_priv *this, const char *text)
+{
+  char **argv, **parts;
+  pthread_t thread;
+  int i;
+
+  if (!g_shell_parse_argv (this->cmdline, NULL, &argv, NULL))
+    return 1;
+  for (i = 0; argv[i]; i++)
+    {
+      parts = g_strsplit (argv[i], "%s", -1);
+      g_free (argv[i]);
+      argv[i] = g_strjoinv (text, parts);
+      g_strfreev (parts);
+    }
+  if (pthread_create (&thread, NULL, spotify_speech_run, argv))
+    {
+      g_strfreev (argv);
+      return 1;
+    }
+  pthread_detach (thread);
+  return 0;
+}
+
+static void
+spotify_speech_destroy (struct speech_priv *this)
+{
+  g_free (this->cmdline);
+  g_free (this);
+}
+
+static struct speech_methods spotify_speech_meth = {
+  spotify_speech_destroy,
+  spotify_speech_say,
+};
+
+/**
+ * The spotify speech type: Navit's prompts, spoken by a text to speech
+ * command, are mixed into the music instead of fighting it for the
+ * device.
+ */
+static struct speech_priv *
+spotify_speech_new (struct speech_methods *meth, struct attr **attrs,
+		    struct attr *parent)
+{
+  struct speech_priv *this;
+  struct attr *data = attr_search (attrs, NULL, attr_data);
+  this = g_new0 (struct speech_priv, 1);
+  this->cmdline = g_strdup (data ? data->u.str : SPOTIFY_SPEECH_CMD);
+  dbg (1, "spotify speech command %s\n", this->cmdline);
+  *meth = spotify_speech_meth;
+  return this;
+}
+
 struct marker {
         struct cursor *cursor;
 };
@@ -397,20 +815,123 @@ void
 plugin_set_attr (struct attr *attrs)
 {
 	struct attr *attr;
-	dbg(0, "** got attrs of size %lu\n", sizeof(attrs));
         if ( (attr=attr_search(attrs, NULL, attr_spotify_login))) {
-		spotify->login=attr->u.str;
-                dbg(0, "found spotify_login attr %s\n", attr->u.str);
+		spotify->player.login=attr->u.str;
+                dbg(1, "found spotify_login attr %s\n", attr->u.str);
         }
         if ( (attr=attr_search(attrs, NULL, attr_spotify_password))) {
-		spotify->password=attr->u.str;
-                dbg(0, "found spotify_password attr %s\n", attr->u.str);
+		spotify->player.password=attr->u.str;
+                dbg(1, "found spotify_password attr\n");
         } else {
 		dbg(0, "SPOTIFY PASSWORD NOT FOUND!\n");
 	}
         if ( (attr=attr_search(attrs, NULL, attr_spotify_playlist))) {
-		spotify->playlist=attr->u.str;
-                dbg(0, "found spotify_playlist attr %s\n", attr->u.str);
+		spotify->player.playlist=attr->u.str;
+                dbg(1, "found spotify_playlist attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_crossfade))) {
+		spotify->player.crossfade_ms=atoi(attr->u.str);
+                dbg(1, "found spotify_crossfade attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_replay_buffer))) {
+		spotify->player.replay_kb=atoi(attr->u.str);
+                dbg(1, "found spotify_replay_buffer attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_speed_volume))) {
+		spotify->speed_volume_db=atoi(attr->u.str);
+                dbg(1, "found spotify_speed_volume attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_coverage_map))) {
+		if (prefetch_coverage_load(&spotify->coverage, attr->u.str) < 0)
+			dbg(0, "can't read spotify_coverage_map %s\n", attr->u.str);
+                dbg(1, "found spotify_coverage_map attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_cover_size))) {
+		spotify->player.cover_size=atoi(attr->u.str);
+                dbg(1, "found spotify_cover_size attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_spectrum_fps))) {
+		spotify->player.spectrum_fps=atoi(attr->u.str);
+                dbg(1, "found spotify_spectrum_fps attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_trace_file))) {
+		spotify->player.trace_file=g_strdup(attr->u.str);
+                dbg(1, "found spotify_trace_file attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_trace_pcm))) {
+		spotify->player.trace_pcm=atoi(attr->u.str);
+                dbg(1, "found spotify_trace_pcm attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_trace))) {
+		spotify->player.trace=g_strdup(attr->u.str);
+                dbg(1, "found spotify_trace attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_device))) {
+		spotify->player.device=attr->u.str;
+                dbg(1, "found spotify_device attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_period))) {
+		spotify->player.period=atoi(attr->u.str);
+                dbg(1, "found spotify_period attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_buffer))) {
+		spotify->player.buffer_ms=atoi(attr->u.str);
+                dbg(1, "found spotify_buffer attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_bitrate))) {
+		spotify->player.bitrate_kbps=atoi(attr->u.str);
+                dbg(1, "found spotify_bitrate attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_shuffle))) {
+		spotify->player.shuffle=atoi(attr->u.str);
+                dbg(1, "found spotify_shuffle attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_repeat))) {
+		spotify->player.repeat=atoi(attr->u.str);
+                dbg(1, "found spotify_repeat attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_search_cache))) {
+		spotify->player.search_cache=atoi(attr->u.str);
+                dbg(1, "found spotify_search_cache attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_dbus_address))) {
+		spotify->player.dbus_address=g_strdup(attr->u.str);
+                dbg(1, "found spotify_dbus_address attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_pcm_export))) {
+		spotify->player.pcm_export=g_strdup(attr->u.str);
+                dbg(1, "found spotify_pcm_export attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_zones))) {
+		spotify->player.zones=g_strdup(attr->u.str);
+                dbg(1, "found spotify_zones attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_silence_trim))) {
+		spotify->player.trim_threshold=atoi(attr->u.str) < 0 ? 32767 * pow(10, atoi(attr->u.str) / 20.0) : 0;
+                dbg(1, "found spotify_silence_trim attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_eq))) {
+		if (dsp_chain_parse_eq(&spotify->player.dsp, attr->u.str)) {
+			dbg(0, "bad spotify_eq attr %s\n", attr->u.str);
+			spotify->player.dsp.nbiquads=0;
+		} else
+			spotify->player.dsp_enabled=TRUE;
+                dbg(1, "found spotify_eq attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_balance))) {
+		spotify->player.dsp.balance=CLAMP(atoi(attr->u.str), -100, 100)/100.0f;
+		spotify->player.dsp_enabled=TRUE;
+                dbg(1, "found spotify_balance attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_fader))) {
+		spotify->player.dsp.fader=CLAMP(atoi(attr->u.str), -100, 100)/100.0f;
+		spotify->player.dsp_enabled=TRUE;
+                dbg(1, "found spotify_fader attr %s\n", attr->u.str);
+        }
+        if ( (attr=attr_search(attrs, NULL, attr_spotify_limiter))) {
+		spotify->player.dsp.limit_db=atof(attr->u.str);
+		spotify->player.dsp_enabled=TRUE;
+                dbg(1, "found spotify_limiter attr %s\n", attr->u.str);
         }
 }
 
@@ -418,7 +939,8 @@ void
 plugin_init (void)
 {
   spotify = g_new0 (struct spotify, 1);
-  dbg (0, "spotify init\n");
+  player_config_init (&spotify->player);
+  dbg (1, "spotify init\n");
   struct attr callback, navit;
   struct attr_iter *iter;
   callback.type = attr_callback;
@@ -429,5 +951,5 @@ plugin_init (void)
   while (config_get_attr (config, attr_navit, &navit, iter))
     spotify_navit_init (navit.u.navit);
   config_attr_iter_destroy (iter);
+  plugin_register_speech_type ("spotify", spotify_speech_new);
 }
-
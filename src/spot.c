@@ -0,0 +1,217 @@
+/*
+ * spot: the player core without Navit.
+ *
+ * Plays a playlist headless, on the same core library as the Navit
+ * plugin, from an epoll loop of its own. It is controlled over MPRIS
+ * (-d) and its audio can be tapped with the PCM export (-e), e.g.
+ *
+ *   SPOT_PASSWORD=... spot -u user -l "Road trip" -d session
+ *
+ * SIGUSR1 logs the audio statistics, SIGUSR2 dumps the trace rings (-X)
+ * to trace.bin in the cache directory, SIGINT and SIGTERM stop it.
+ *
+ * With -R it doesn't log in, but replays a delivery trace into the audio
+ * pipeline instead, see delivery-trace.h.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "../log.h"
+#include "../mpris.h"
+#include "../player.h"
+#include "../trace.h"
+
+/* Longest we sleep, so the published position keeps moving */
+#define SPOT_TICK_MS	250
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s -u login -l playlist [options]\n"
+		"  -u login       Spotify user, SPOT_PASSWORD holds the password\n"
+		"  -l playlist    name of the playlist to play\n"
+		"  -c dir         libspotify cache and settings (default tmp)\n"
+		"  -z zones       output zones, as spotify_zones\n"
+		"  -x ms          crossfade between tracks\n"
+		"  -r KiB         replay buffer budget\n"
+		"  -g dB          volume\n"
+		"  -t dB          trim silence below this level\n"
+		"  -e socket      export the PCM on this unix socket\n"
+		"  -d address     MPRIS on this bus, or \"session\"\n"
+		"  -T file        record libspotify's deliveries to file\n"
+		"  -P             record the audio too\n"
+		"  -R file        replay a delivery trace instead of logging in\n"
+		"  -s speed       replay speed, 0 for as fast as it goes (default 1)\n"
+		"  -X categories  trace these, e.g. delivery,output or all\n"
+		"  -b kbps        96, 160 or 320 instead of adapting the bitrate\n"
+		"  -D device      ALSA device of the first zone\n"
+		"  -p frames      ALSA period\n"
+		"  -B ms          audio buffered ahead (default 1000)\n"
+		"  -S             shuffle the playlist\n"
+		"  -L             repeat the playlist\n"
+		"  -v             more verbose, may be repeated\n", argv0);
+	exit(1);
+}
+
+static int watch(int ep, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+	return epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int main(int argc, char **argv)
+{
+	struct player_config cfg;
+	struct epoll_event ev[4];
+	struct signalfd_siginfo si;
+	sigset_t sigs;
+	const char *replay = NULL;
+	double speed = 1;
+	int ep, sfd, mfd = -1, timeout, i, n, c;
+
+	player_config_init(&cfg);
+	while ((c = getopt(argc, argv, "u:l:c:z:x:r:g:t:e:d:T:PR:s:X:b:D:p:B:SLv")) != -1) {
+		switch (c) {
+		case 'u':
+			cfg.login = optarg;
+			break;
+		case 'l':
+			cfg.playlist = optarg;
+			break;
+		case 'c':
+			cfg.cache_dir = optarg;
+			break;
+		case 'z':
+			cfg.zones = optarg;
+			break;
+		case 'x':
+			cfg.crossfade_ms = atoi(optarg);
+			break;
+		case 'r':
+			cfg.replay_kb = atoi(optarg);
+			break;
+		case 'g':
+			cfg.volume_db = atoi(optarg);
+			break;
+		case 't':
+			if (atoi(optarg) < 0)
+				cfg.trim_threshold =
+					32767 * pow(10, atoi(optarg) / 20.0);
+			break;
+		case 'e':
+			cfg.pcm_export = optarg;
+			break;
+		case 'd':
+			cfg.dbus_address = optarg;
+			break;
+		case 'T':
+			cfg.trace_file = optarg;
+			break;
+		case 'P':
+			cfg.trace_pcm = 1;
+			break;
+		case 'R':
+			replay = optarg;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'X':
+			cfg.trace = optarg;
+			break;
+		case 'b':
+			cfg.bitrate_kbps = atoi(optarg);
+			break;
+		case 'D':
+			cfg.device = optarg;
+			break;
+		case 'p':
+			cfg.period = atoi(optarg);
+			break;
+		case 'B':
+			cfg.buffer_ms = atoi(optarg);
+			break;
+		case 'S':
+			cfg.shuffle = 1;
+			break;
+		case 'L':
+			cfg.repeat = 1;
+			break;
+		case 'v':
+			log_level++;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (replay)
+		return player_replay(&cfg, replay, speed) ? 1 : 0;
+
+	/* Not on the command line, where ps would show it */
+	cfg.password = getenv("SPOT_PASSWORD");
+	if (!cfg.login || !cfg.password || !cfg.playlist || optind != argc)
+		usage(argv[0]);
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	sfd = signalfd(-1, &sigs, SFD_CLOEXEC);
+
+	/* Threads started from here on inherit the blocked signals */
+	if (player_start(&cfg))
+		return 1;
+	if (cfg.dbus_address)
+		mfd = mpris_command_fd();
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0 || sfd < 0 || watch(ep, sfd) ||
+	    watch(ep, player_notify_fd()) || (mfd >= 0 && watch(ep, mfd))) {
+		perror("spot");
+		return 1;
+	}
+
+	timeout = 0;
+	for (;;) {
+		n = epoll_wait(ep, ev, 4, timeout);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.fd == mfd) {
+				player_mpris_commands();
+			} else if (ev[i].data.fd == sfd) {
+				if (read(sfd, &si, sizeof(si)) != sizeof(si))
+					continue;
+				if (si.ssi_signo == SIGUSR1) {
+					player_stats();
+					continue;
+				}
+				if (si.ssi_signo == SIGUSR2) {
+					if (trace_dump(NULL))
+						dbg(0, "no trace to dump\n");
+					continue;
+				}
+				dbg(0, "exiting on signal %u\n", si.ssi_signo);
+				return 0;
+			}
+		}
+
+		/* The notify fd is drained by player_process() itself */
+		timeout = player_process();
+		if (timeout > SPOT_TICK_MS)
+			timeout = SPOT_TICK_MS;
+	}
+}
@@ -0,0 +1,293 @@
+/*
+ * MPRIS service against a private session bus: run it under
+ * dbus-run-session, which ctest does. Reads properties and calls
+ * methods as a client would, and checks the commands and signals that
+ * come out. Exits non zero if a check fails.
+ */
+
+#include "../mpris.h"
+#include "../player-state.h"
+#include <dbus/dbus.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define PATH		"/org/mpris/MediaPlayer2"
+#define PLAYER		"org.mpris.MediaPlayer2.Player"
+#define TRACK		"/org/navit/spotify/track/3"
+#define TIMEOUT_MS	2000
+
+static DBusConnection *client;
+static int failed;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);\
+		failed++;						\
+	}								\
+} while (0)
+
+/* Call method on the service; the reply, or NULL after an error reply */
+static DBusMessage *call(const char *iface, const char *method,
+                         int first_type, ...)
+{
+	DBusMessage *msg, *reply;
+	DBusError err;
+	va_list ap;
+
+	msg = dbus_message_new_method_call(MPRIS_NAME, PATH, iface, method);
+	va_start(ap, first_type);
+	dbus_message_append_args_valist(msg, first_type, ap);
+	va_end(ap);
+	dbus_error_init(&err);
+	reply = dbus_connection_send_with_reply_and_block(client, msg,
+	                                                  TIMEOUT_MS, &err);
+	dbus_message_unref(msg);
+	dbus_error_free(&err);
+	return reply;
+}
+
+/* Find key in the a{sv} at it and recurse into its value */
+static int dict_find(DBusMessageIter *it, const char *key,
+                     DBusMessageIter *value)
+{
+	DBusMessageIter dict, e;
+	const char *k;
+
+	if (dbus_message_iter_get_arg_type(it) != DBUS_TYPE_ARRAY)
+		return -1;
+	for (dbus_message_iter_recurse(it, &dict);
+	     dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+	     dbus_message_iter_next(&dict)) {
+		dbus_message_iter_recurse(&dict, &e);
+		dbus_message_iter_get_basic(&e, &k);
+		if (strcmp(k, key))
+			continue;
+		dbus_message_iter_next(&e);
+		dbus_message_iter_recurse(&e, value);
+		return 0;
+	}
+	return -1;
+}
+
+static int dict_size(DBusMessageIter *it)
+{
+	DBusMessageIter dict;
+	int n = 0;
+
+	for (dbus_message_iter_recurse(it, &dict);
+	     dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY;
+	     dbus_message_iter_next(&dict))
+		n++;
+	return n;
+}
+
+/* Get a string (or object path) property, "" if it isn't one */
+static void get_string(const char *name, char *buf, size_t len)
+{
+	const char *iface = PLAYER, *s = "";
+	DBusMessageIter it, v;
+	DBusMessage *reply;
+
+	reply = call(DBUS_INTERFACE_PROPERTIES, "Get", DBUS_TYPE_STRING, &iface,
+	             DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+	if (reply && dbus_message_iter_init(reply, &it)) {
+		dbus_message_iter_recurse(&it, &v);
+		if (dbus_message_iter_get_arg_type(&v) == DBUS_TYPE_STRING)
+			dbus_message_iter_get_basic(&v, &s);
+	}
+	snprintf(buf, len, "%s", s);
+	if (reply)
+		dbus_message_unref(reply);
+}
+
+static void test_properties(void)
+{
+	const char *iface = PLAYER, *name = "Shuffle", *s;
+	dbus_bool_t yes = TRUE;
+	DBusMessageIter it, v, meta;
+	DBusMessage *reply;
+	dbus_int64_t len = 0;
+	char buf[64];
+
+	get_string("PlaybackStatus", buf, sizeof(buf));
+	CHECK(!strcmp(buf, "Playing"));
+
+	reply = call(DBUS_INTERFACE_PROPERTIES, "GetAll", DBUS_TYPE_STRING,
+	             &iface, DBUS_TYPE_INVALID);
+	CHECK(reply);
+	if (!reply)
+		return;
+	dbus_message_iter_init(reply, &it);
+	CHECK(dict_size(&it) == 13);
+	CHECK(!dict_find(&it, "Metadata", &meta));
+
+	s = "";
+	if (!dict_find(&meta, "mpris:trackid", &v))
+		dbus_message_iter_get_basic(&v, &s);
+	CHECK(!strcmp(s, TRACK));
+	s = "";
+	if (!dict_find(&meta, "xesam:title", &v))
+		dbus_message_iter_get_basic(&v, &s);
+	CHECK(!strcmp(s, "Song"));
+	if (!dict_find(&meta, "mpris:length", &v))
+		dbus_message_iter_get_basic(&v, &len);
+	CHECK(len == 200000000);
+	dbus_message_unref(reply);
+
+	/* Unknown properties and writes are refused */
+	CHECK(!call(DBUS_INTERFACE_PROPERTIES, "Get", DBUS_TYPE_STRING, &iface,
+	            DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID));
+	CHECK(!call(DBUS_INTERFACE_PROPERTIES, "Set", DBUS_TYPE_STRING, &iface,
+	            DBUS_TYPE_STRING, &name, DBUS_TYPE_BOOLEAN, &yes,
+	            DBUS_TYPE_INVALID));
+}
+
+/* Wait for mpris_poll() to have a command and take it */
+static int next_command(struct mpris_command *cmd)
+{
+	struct pollfd pfd = { .fd = mpris_command_fd(), .events = POLLIN };
+
+	if (!mpris_poll(cmd))
+		return 0;
+	if (poll(&pfd, 1, TIMEOUT_MS) <= 0)
+		return -1;
+	return mpris_poll(cmd);
+}
+
+static void test_commands(void)
+{
+	const char *track = TRACK, *other = "/org/navit/spotify/track/4";
+	dbus_int64_t back = -5000000, to = 20000000, late = 300000000;
+	struct mpris_command cmd;
+	DBusMessage *reply;
+
+	CHECK((reply = call(PLAYER, "PlayPause", DBUS_TYPE_INVALID)));
+	if (reply)
+		dbus_message_unref(reply);
+	CHECK((reply = call(PLAYER, "Seek", DBUS_TYPE_INT64, &back,
+	                    DBUS_TYPE_INVALID)));
+	if (reply)
+		dbus_message_unref(reply);
+	/* Only the first is for the track playing, within its length */
+	CHECK((reply = call(PLAYER, "SetPosition", DBUS_TYPE_OBJECT_PATH,
+	                    &track, DBUS_TYPE_INT64, &to, DBUS_TYPE_INVALID)));
+	if (reply)
+		dbus_message_unref(reply);
+	CHECK((reply = call(PLAYER, "SetPosition", DBUS_TYPE_OBJECT_PATH,
+	                    &other, DBUS_TYPE_INT64, &to, DBUS_TYPE_INVALID)));
+	if (reply)
+		dbus_message_unref(reply);
+	CHECK((reply = call(PLAYER, "SetPosition", DBUS_TYPE_OBJECT_PATH,
+	                    &track, DBUS_TYPE_INT64, &late, DBUS_TYPE_INVALID)));
+	if (reply)
+		dbus_message_unref(reply);
+	CHECK(!call(PLAYER, "OpenUri", DBUS_TYPE_STRING, &track,
+	            DBUS_TYPE_INVALID));
+
+	CHECK(!next_command(&cmd) && cmd.action == MPRIS_PLAY_PAUSE);
+	CHECK(!next_command(&cmd) && cmd.action == MPRIS_SEEK &&
+	      cmd.us == back);
+	CHECK(!next_command(&cmd) && cmd.action == MPRIS_SET_POSITION &&
+	      cmd.us == to);
+	CHECK(mpris_poll(&cmd) == -1);
+}
+
+/*
+ * Wait for a signal named member from the service; returns it, or NULL
+ * after TIMEOUT_MS.
+ */
+static DBusMessage *wait_signal(const char *member)
+{
+	struct timespec start, now;
+	DBusMessage *msg;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		dbus_connection_read_write(client, 100);
+		while ((msg = dbus_connection_pop_message(client))) {
+			if (dbus_message_is_signal(msg, dbus_message_get_interface(msg),
+			                           member))
+				return msg;
+			dbus_message_unref(msg);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000 +
+	         (now.tv_nsec - start.tv_nsec) / 1000000 < TIMEOUT_MS);
+	return NULL;
+}
+
+static void test_signals(struct player_state *st)
+{
+	DBusMessageIter it, v;
+	DBusMessage *msg;
+	dbus_int64_t us = 0;
+	const char *s = "";
+
+	dbus_bus_add_match(client, "type='signal',path='" PATH "'", NULL);
+
+	st->playing = 0;
+	player_state_publish(st);
+	msg = wait_signal("PropertiesChanged");
+	CHECK(msg);
+	if (msg) {
+		dbus_message_iter_init(msg, &it);
+		dbus_message_iter_next(&it);
+		if (!dict_find(&it, "PlaybackStatus", &v))
+			dbus_message_iter_get_basic(&v, &s);
+		CHECK(!strcmp(s, "Paused"));
+		/* The track didn't change, so neither did its metadata */
+		CHECK(dict_find(&it, "Metadata", &v));
+		dbus_message_unref(msg);
+	}
+
+	/* A jump in the position is a seek */
+	st->position_ms = 60000;
+	player_state_publish(st);
+	msg = wait_signal("Seeked");
+	CHECK(msg);
+	if (msg) {
+		dbus_message_get_args(msg, NULL, DBUS_TYPE_INT64, &us,
+		                      DBUS_TYPE_INVALID);
+		CHECK(us == 60000000);
+		dbus_message_unref(msg);
+	}
+}
+
+int main(void)
+{
+	struct player_state st = {
+		.track = "Song",
+		.artist = "Artist",
+		.index = 3,
+		.duration_ms = 200000,
+		.position_ms = 1000,
+		.playing = 1,
+		.connection = PLAYER_ONLINE,
+	};
+	DBusError err;
+
+	player_state_publish(&st);
+	if (mpris_start(NULL)) {
+		fprintf(stderr, "no session bus, run under dbus-run-session\n");
+		return 1;
+	}
+
+	dbus_error_init(&err);
+	client = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+	if (!client) {
+		fprintf(stderr, "%s\n", err.message);
+		return 1;
+	}
+	dbus_connection_set_exit_on_disconnect(client, FALSE);
+
+	test_properties();
+	test_commands();
+	test_signals(&st);
+
+	if (failed)
+		fprintf(stderr, "%d checks failed\n", failed);
+	return failed != 0;
+}
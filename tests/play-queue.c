@@ -0,0 +1,215 @@
+/*
+ * Play order and queue: what plays next, through playlist edits,
+ * shuffling and the queue. Exits non zero if a check fails.
+ */
+
+#include "../play-queue.h"
+#include <stdio.h>
+
+static int failed;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);\
+		failed++;						\
+	}								\
+} while (0)
+
+/* Playlist position peek(n) or advance() give, -1 for none or an item */
+static int peek_index(const struct play_queue *q, int n)
+{
+	struct play_queue_entry e;
+
+	return play_queue_peek(q, n, &e) ? -1 : e.index;
+}
+
+static int advance_index(struct play_queue *q)
+{
+	struct play_queue_entry e;
+
+	return play_queue_advance(q, &e) ? -1 : e.index;
+}
+
+static void test_straight(void)
+{
+	struct play_queue q;
+	int i;
+
+	play_queue_init(&q, 1);
+	play_queue_reset(&q, 4);
+	CHECK(play_queue_current(&q) == 0);
+	CHECK(peek_index(&q, 0) == 1);
+	CHECK(peek_index(&q, 2) == 3);
+	CHECK(peek_index(&q, 3) == -1);
+	for (i = 1; i < 4; i++) {
+		CHECK(advance_index(&q) == i);
+		CHECK(play_queue_current(&q) == i);
+	}
+	CHECK(peek_index(&q, 0) == -1);
+	CHECK(advance_index(&q) == -1);
+	CHECK(play_queue_current(&q) == -1);
+
+	/* Repeating starts over, peeking at most one pass ahead */
+	q.repeat = 1;
+	CHECK(peek_index(&q, 0) == 0);
+	CHECK(peek_index(&q, 3) == 3);
+	CHECK(peek_index(&q, 4) == -1);
+	CHECK(advance_index(&q) == 0);
+	play_queue_back(&q);
+	CHECK(play_queue_current(&q) == 3);
+	CHECK(peek_index(&q, 0) == 0);
+	CHECK(advance_index(&q) == 0);
+}
+
+static void test_shuffle(void)
+{
+	struct play_queue q;
+	int seen[16] = { 0 }, i, n;
+
+	play_queue_init(&q, 42);
+	q.shuffle = 1;
+	play_queue_reset(&q, 16);
+	seen[play_queue_current(&q)]++;
+	for (i = 0; i < 15; i++) {
+		n = peek_index(&q, 0);
+		CHECK(n >= 0 && advance_index(&q) == n);
+		if (n >= 0)
+			seen[n]++;
+	}
+	CHECK(advance_index(&q) == -1);
+	for (i = 0; i < 16; i++)
+		CHECK(seen[i] == 1);
+}
+
+static void test_remove(void)
+{
+	struct play_queue q;
+	int positions[1];
+
+	/* The track playing: the one after it is still next */
+	play_queue_init(&q, 1);
+	play_queue_reset(&q, 5);
+	advance_index(&q);
+	advance_index(&q);
+	positions[0] = 2;
+	play_queue_removed(&q, positions, 1);
+	CHECK(q.length == 4);
+	CHECK(peek_index(&q, 0) == 2);
+	CHECK(advance_index(&q) == 2);
+
+	/* The first track, while it plays */
+	play_queue_reset(&q, 3);
+	positions[0] = 0;
+	play_queue_removed(&q, positions, 1);
+	CHECK(play_queue_current(&q) == -1);
+	CHECK(peek_index(&q, 0) == 0);
+	CHECK(advance_index(&q) == 0);
+	CHECK(advance_index(&q) == 1);
+	CHECK(advance_index(&q) == -1);
+}
+
+static void test_move_shuffled(void)
+{
+	/* Tracks 5 and 6 moved to the front: [5 6 0 1 2 3 4 7] */
+	static const int map[8] = { 2, 3, 4, 5, 6, 0, 1, 7 };
+	struct play_queue q;
+	int before[8], positions[2] = { 5, 6 }, current, i, n;
+
+	play_queue_init(&q, 7);
+	q.shuffle = 1;
+	play_queue_reset(&q, 8);
+	advance_index(&q);
+	advance_index(&q);
+	current = play_queue_current(&q);
+	for (n = 0; n < 8 && (before[n] = peek_index(&q, n)) >= 0; n++)
+		;
+
+	play_queue_moved(&q, positions, 2, 0);
+	CHECK(play_queue_current(&q) == map[current]);
+	for (i = 0; i < n; i++)
+		CHECK(peek_index(&q, i) == map[before[i]]);
+	CHECK(peek_index(&q, n) == -1);
+	for (i = 0; i < n; i++)
+		CHECK(advance_index(&q) == map[before[i]]);
+}
+
+static void test_append(void)
+{
+	struct play_queue q;
+
+	/* Played to the end, then a track is appended */
+	play_queue_init(&q, 1);
+	play_queue_reset(&q, 2);
+	CHECK(advance_index(&q) == 1);
+	CHECK(advance_index(&q) == -1);
+	play_queue_added(&q, 2, 1);
+	CHECK(q.length == 3);
+	CHECK(peek_index(&q, 0) == 2);
+	CHECK(advance_index(&q) == 2);
+	CHECK(play_queue_current(&q) == 2);
+	CHECK(advance_index(&q) == -1);
+
+	/* Two at once, while shuffling: both play, then the end */
+	play_queue_added(&q, 3, 2);
+	q.shuffle = 1;
+	CHECK(peek_index(&q, 0) == 3);
+	CHECK(advance_index(&q) == 3);
+	CHECK(advance_index(&q) == 4);
+	CHECK(advance_index(&q) == -1);
+	play_queue_added(&q, 5, 1);
+	CHECK(advance_index(&q) == 5);
+
+	/* Appended while playing the last track */
+	play_queue_reset(&q, 2);
+	q.shuffle = 0;
+	advance_index(&q);
+	play_queue_added(&q, 2, 1);
+	CHECK(play_queue_current(&q) == 1);
+	CHECK(advance_index(&q) == 2);
+}
+
+static void test_queue_ring(void)
+{
+	struct play_queue q;
+	struct play_queue_entry e;
+	static int items[PLAY_QUEUE_ITEMS + 8];
+	int i;
+
+	play_queue_init(&q, 1);
+	play_queue_reset(&q, 3);
+	for (i = 0; i < PLAY_QUEUE_ITEMS; i++)
+		CHECK(!play_queue_enqueue(&q, &items[i]));
+	CHECK(play_queue_enqueue(&q, &items[i]) == -1);
+	CHECK(play_queue_queued(&q) == PLAY_QUEUE_ITEMS);
+
+	CHECK(!play_queue_peek(&q, PLAY_QUEUE_ITEMS - 1, &e) &&
+	      e.index == -1 && e.item == &items[PLAY_QUEUE_ITEMS - 1]);
+	CHECK(peek_index(&q, PLAY_QUEUE_ITEMS) == 1);
+
+	/* Room for one more, wrapping the ring */
+	CHECK(!play_queue_advance(&q, &e) && e.item == &items[0]);
+	CHECK(!play_queue_enqueue(&q, &items[PLAY_QUEUE_ITEMS]));
+	CHECK(!play_queue_peek(&q, PLAY_QUEUE_ITEMS - 1, &e) &&
+	      e.item == &items[PLAY_QUEUE_ITEMS]);
+
+	for (i = 1; i <= PLAY_QUEUE_ITEMS; i++)
+		CHECK(!play_queue_advance(&q, &e) && e.index == -1 &&
+		      e.item == &items[i]);
+	CHECK(!play_queue_queued(&q));
+	/* The playlist carries on where it was */
+	CHECK(play_queue_current(&q) == 0);
+	CHECK(advance_index(&q) == 1);
+}
+
+int main(void)
+{
+	test_straight();
+	test_shuffle();
+	test_remove();
+	test_move_shuffled();
+	test_append();
+	test_queue_ring();
+	if (failed)
+		fprintf(stderr, "%d checks failed\n", failed);
+	return failed != 0;
+}
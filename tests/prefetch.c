@@ -0,0 +1,118 @@
+/*
+ * Prefetch planning on the canned route in prefetch-route.txt, against
+ * the gap in prefetch-coverage.txt and gaps placed along it here. The
+ * directory holding the files is the argument. Exits non zero if a
+ * check fails.
+ */
+
+#include "../prefetch.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The route runs east at 52N, 0.5 degrees in 1200 s */
+#define ROUTE_LAT	52.0
+#define ROUTE_LNG	13.0
+#define ROUTE_S		1200
+#define ROUTE_DEG	0.5
+/* How far off a planned time may be: a 100 m step takes 3.5 s */
+#define SLACK_S		5
+#define RADIUS_M	2000.0
+
+static int failed;
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);\
+		failed++;						\
+	}								\
+} while (0)
+
+#define NEAR(a, b)	(abs((a) - (b)) <= SLACK_S)
+
+/* Seconds it takes to drive RADIUS_M along the route */
+static int radius_s(void)
+{
+	double m_per_deg = 6371000.0 * M_PI / 180 * cos(ROUTE_LAT * M_PI / 180);
+
+	return RADIUS_M / (m_per_deg * ROUTE_DEG / ROUTE_S);
+}
+
+/* A gap of RADIUS_M around where the route is at time_s */
+static void gap_at(struct prefetch_area *area, int time_s)
+{
+	area->lat = ROUTE_LAT;
+	area->lng = ROUTE_LNG + ROUTE_DEG * time_s / ROUTE_S;
+	area->radius_m = RADIUS_M;
+}
+
+static void plan_with(const struct prefetch_route *route, int n,
+                      const int *centres_s, struct prefetch_plan *plan)
+{
+	struct prefetch_area areas[4];
+	struct prefetch_coverage cov = { n, areas };
+	int i;
+
+	for (i = 0; i < n; i++)
+		gap_at(&areas[i], centres_s[i]);
+	prefetch_plan(route, &cov, plan);
+}
+
+int main(int argc, char **argv)
+{
+	const char *dir = argc > 1 ? argv[1] : "tests";
+	struct prefetch_route route = { 0 };
+	struct prefetch_coverage cov = { 0 };
+	struct prefetch_plan plan;
+	int r = radius_s();
+	char path[4096];
+	int centres[2];
+
+	snprintf(path, sizeof(path), "%s/prefetch-route.txt", dir);
+	CHECK(prefetch_route_load(&route, path) == 11);
+	snprintf(path, sizeof(path), "%s/prefetch-coverage.txt", dir);
+	CHECK(prefetch_coverage_load(&cov, path) == 1);
+	if (failed)
+		return 1;
+
+	/* Covered all the way: nothing to fetch ahead */
+	plan_with(&route, 0, NULL, &plan);
+	CHECK(plan.duration_s == ROUTE_S);
+	CHECK(plan.gap_start_s == -1 && plan.need_s == 0);
+
+	/* The file's gap, around 480 s */
+	prefetch_plan(&route, &cov, &plan);
+	CHECK(NEAR(plan.gap_start_s, 480 - r));
+	CHECK(NEAR(plan.gap_end_s, 480 + r));
+	CHECK(plan.need_s == plan.gap_end_s);
+
+	/* Back in coverage for less than PREFETCH_MERGE_S: one gap */
+	centres[0] = 480;
+	centres[1] = 480 + 2 * r + PREFETCH_MERGE_S / 2;
+	plan_with(&route, 2, centres, &plan);
+	CHECK(NEAR(plan.gap_start_s, 480 - r));
+	CHECK(NEAR(plan.gap_end_s, centres[1] + r));
+
+	/* For longer: only the first gap counts */
+	centres[1] = 480 + 2 * r + PREFETCH_MERGE_S * 2;
+	plan_with(&route, 2, centres, &plan);
+	CHECK(NEAR(plan.gap_end_s, 480 + r));
+
+	/* No coverage at the destination: the gap lasts to the end */
+	centres[0] = ROUTE_S;
+	plan_with(&route, 1, centres, &plan);
+	CHECK(NEAR(plan.gap_start_s, ROUTE_S - r));
+	CHECK(plan.gap_end_s == ROUTE_S && plan.need_s == ROUTE_S);
+
+	/* Already without coverage */
+	centres[0] = 0;
+	plan_with(&route, 1, centres, &plan);
+	CHECK(plan.gap_start_s == 0);
+	CHECK(NEAR(plan.gap_end_s, r));
+
+	prefetch_route_clear(&route);
+	free(cov.areas);
+	if (failed)
+		fprintf(stderr, "%d checks failed\n", failed);
+	return failed != 0;
+}
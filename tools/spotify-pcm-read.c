@@ -0,0 +1,175 @@
+/*
+ * Sample client of the plugin's PCM export: connects to the export
+ * socket, maps the ring and copies the music to stdout as raw stereo
+ * S16_LE, e.g.
+ *
+ *   spotify-pcm-read /run/spotify-pcm | aplay -f cd
+ *
+ * Format changes, seeks and lost audio are reported on stderr.
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../pcm-export.h"
+
+/// Frames copied out of the ring before checking they are still whole
+#define CHUNK_FRAMES	4096
+
+static int receive_fds(int sock, int *memfd, int *efd)
+{
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte;
+	int fds[2];
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &msg, 0) != 1 || byte != PCM_EXPORT_VERSION)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		return -1;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	*memfd = fds[0];
+	*efd = fds[1];
+	return 0;
+}
+
+/* Consistent copy of the header fields, see pcm-export.h */
+static void read_header(const struct pcm_export_header *shm,
+                        struct pcm_export_header *h)
+{
+	unsigned int s;
+
+	for (;;) {
+		s = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (s & 1)
+			continue;
+		memcpy(h, shm, sizeof(*h));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == s)
+			return;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	const struct pcm_export_header *shm;
+	struct pcm_export_header h, now;
+	struct pollfd pfd;
+	const int16_t *ring;
+	int16_t *buf;
+	uint64_t r, n, pos, count;
+	uint32_t rate = 0, epoch = 0;
+	int sock, memfd, efd;
+	size_t size;
+
+	if (argc != 2 || strlen(argv[1]) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "usage: %s <export socket>\n", argv[0]);
+		return 1;
+	}
+
+	strcpy(sun.sun_path, argv[1]);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0 || connect(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (receive_fds(sock, &memfd, &efd)) {
+		fprintf(stderr, "%s: not a PCM export\n", argv[1]);
+		return 1;
+	}
+
+	/* Map the header first to learn how big the ring is */
+	shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, memfd, 0);
+	if (shm == MAP_FAILED || shm->magic != PCM_EXPORT_MAGIC) {
+		fprintf(stderr, "%s: bad export header\n", argv[1]);
+		return 1;
+	}
+	size = shm->data_offset +
+	       (size_t)shm->ring_frames * shm->channels * sizeof(int16_t);
+	munmap((void *)shm, sizeof(*shm));
+	shm = mmap(NULL, size, PROT_READ, MAP_SHARED, memfd, 0);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	ring = (const int16_t *)((const char *)shm + shm->data_offset);
+	buf = malloc(CHUNK_FRAMES * shm->channels * sizeof(int16_t));
+	if (!buf)
+		return 1;
+
+	read_header(shm, &h);
+	r = h.write_frames;
+
+	/*
+	 * Every write bumps the eventfd. It is non blocking, as the plugin
+	 * shares it, so wait for it with poll().
+	 */
+	pfd.fd = efd;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) >= 0) {
+		if (read(efd, &count, sizeof(count)) != sizeof(count))
+			continue;
+		read_header(shm, &h);
+		if (h.rate != rate) {
+			rate = h.rate;
+			fprintf(stderr, "%u Hz, %u channels\n", rate, h.channels);
+		}
+		if (h.epoch != epoch) {
+			epoch = h.epoch;
+			fprintf(stderr, "seek at frame %llu\n",
+			        (unsigned long long)h.epoch_frame);
+		}
+
+		/* Keep a quarter of the ring away from the writer */
+		if (h.write_frames - r > h.ring_frames * 3 / 4) {
+			fprintf(stderr, "lost %llu frames\n",
+			        (unsigned long long)(h.write_frames - r));
+			r = h.write_frames;
+		}
+
+		while (r < h.write_frames) {
+			pos = r % h.ring_frames;
+			n = h.write_frames - r;
+			if (n > h.ring_frames - pos)
+				n = h.ring_frames - pos;
+			if (n > CHUNK_FRAMES)
+				n = CHUNK_FRAMES;
+			memcpy(buf, ring + pos * h.channels,
+			       n * h.channels * sizeof(int16_t));
+
+			/* The writer may have caught up with us meanwhile */
+			read_header(shm, &now);
+			if (now.write_frames - r > h.ring_frames * 3 / 4) {
+				fprintf(stderr, "lost %llu frames\n",
+				        (unsigned long long)(now.write_frames - r));
+				r = now.write_frames;
+				break;
+			}
+
+			if (fwrite(buf, h.channels * sizeof(int16_t), n,
+			           stdout) != n)
+				return 0;
+			r += n;
+		}
+		fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Turn a trace dump (see trace.h) into Chrome's trace event format, to
+ * load in chrome://tracing or Perfetto, e.g.
+ *
+ *   spotify-trace-export tmp/trace.bin > trace.json
+ *
+ * Each traced thread becomes a track, with times relative to the
+ * earliest record in the dump.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../trace.h"
+
+static const struct {
+	const char *name;
+	const char *category;
+	const char *arg[2];
+} events[] = {
+#define TRACE_EVENT(id, level, cat, name, arg0, arg1) \
+	{ name, #cat, { arg0, arg1 } },
+#include "../trace-events.h"
+#undef TRACE_EVENT
+};
+
+struct event {
+	struct trace_record rec;
+	uint32_t tid;
+};
+
+static int by_time(const void *a, const void *b)
+{
+	const struct event *x = a, *y = b;
+
+	return x->rec.ns < y->rec.ns ? -1 : x->rec.ns > y->rec.ns;
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_dump_header h;
+	struct trace_dump_thread t;
+	struct event *ev = NULL;
+	size_t n = 0, i, j;
+	uint64_t start;
+	FILE *f;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace dump>\n", argv[0]);
+		return 1;
+	}
+	f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_DUMP_MAGIC ||
+	    h.version != TRACE_DUMP_VERSION ||
+	    h.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+		return 1;
+	}
+
+	while (h.threads-- && fread(&t, sizeof(t), 1, f) == 1) {
+		ev = realloc(ev, (n + t.records) * sizeof(*ev));
+		if (!ev) {
+			perror("realloc");
+			return 1;
+		}
+		for (i = 0; i < t.records; i++, n++) {
+			if (fread(&ev[n].rec, sizeof(ev[n].rec), 1, f) != 1)
+				break;
+			ev[n].tid = t.tid;
+		}
+	}
+	fclose(f);
+	qsort(ev, n, sizeof(*ev), by_time);
+
+	start = n ? ev[0].rec.ns : 0;
+	printf("{\"traceEvents\":[\n");
+	for (i = 0; i < n; i++) {
+		const struct trace_record *r = &ev[i].rec;
+
+		if (r->id >= sizeof(events) / sizeof(*events))
+			continue;	/* from a newer build */
+		printf("%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+		       "\"ts\":%.3f,\"pid\":1,\"tid\":%u,\"s\":\"t\",\"args\":{",
+		       i ? ",\n" : "", events[r->id].name,
+		       events[r->id].category, r->phase,
+		       (r->ns - start) / 1000.0, ev[i].tid);
+		for (j = 0; j < 2 && events[r->id].arg[j]; j++)
+			printf("%s\"%s\":%lld", j ? "," : "",
+			       events[r->id].arg[j], (long long)r->arg[j]);
+		printf("}}");
+	}
+	printf("\n]}\n");
+	free(ev);
+	return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * The trace events, as
+ *
+ *   TRACE_EVENT(id, level, category, name, arg0, arg1)
+ *
+ * level is the TRACE_LEVEL an event needs to be compiled in, arg0 and
+ * arg1 name its two arguments (NULL when unused). Included by trace.h
+ * and by tools/spotify-trace-export.c, which must agree on the order:
+ * only ever add events at the end.
+ */
+
+TRACE_EVENT(PROCESS,	  1, MAIN,     "process_events", "timeout_ms", NULL)
+TRACE_EVENT(DELIVERY,	  1, DELIVERY, "music_delivery", "frames", "accepted")
+TRACE_EVENT(END_OF_TRACK, 1, DELIVERY, "end_of_track", "index", NULL)
+TRACE_EVENT(FIFO_GET,	  2, OUTPUT,   "fifo_get", "frames", "queued")
+TRACE_EVENT(ALSA_WRITE,	  2, OUTPUT,   "alsa_write", "zone", "frames")
+TRACE_EVENT(XRUN,	  1, OUTPUT,   "xrun", "zone", NULL)
+TRACE_EVENT(LOGIN,	  1, PLAYER,   "login", "error", "playlists")
+TRACE_EVENT(PLAYLIST,	  1, PLAYER,   "playlist", "tracks", "offline_status")
+TRACE_EVENT(TRACK_START,  1, PLAYER,   "track_start", "index", "duration_ms")
+TRACE_EVENT(FLUSH,	  1, PLAYER,   "flush", "index", NULL)
+TRACE_EVENT(SEEK,	  1, PLAYER,   "seek", "pos_ms", "from_fifo")
+TRACE_EVENT(PLAY,	  1, PLAYER,   "play", "playing", NULL)
+TRACE_EVENT(NEXT,	  1, PLAYER,   "next", "index", NULL)
+TRACE_EVENT(PREVIOUS,	  1, PLAYER,   "previous", "index", "restart")
+TRACE_EVENT(VOLUME,	  1, PLAYER,   "volume", "db", NULL)
+TRACE_EVENT(BITRATE,	  1, PLAYER,   "bitrate", "stream_kbps", "offline_kbps")
+TRACE_EVENT(LOAD,	  1, PLAYER,   "load", "busy", NULL)
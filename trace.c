@@ -0,0 +1,202 @@
+/*
+ * Trace rings, see trace.h.
+ *
+ * A thread's ring is allocated the first time it traces and pushed onto
+ * a list that is never shrunk, so the dump can walk it without locks,
+ * from a signal handler too. Only the owning thread writes a ring: it
+ * fills the record, then publishes it by moving head. A dump taken while
+ * threads keep tracing may catch the record being overwritten at the
+ * oldest end of a full ring.
+ */
+
+#define _GNU_SOURCE
+#include "trace.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct trace_ring {
+	struct trace_ring *next;
+	uint32_t tid;
+	uint64_t head;			/* records ever written */
+	struct trace_record rec[TRACE_RING_RECORDS];
+};
+
+unsigned int trace_mask;
+
+static struct trace_ring *rings;
+static __thread struct trace_ring *ring;
+static char dump_path[256];
+
+static const char *categories[] = { "main", "delivery", "output", "player" };
+
+static struct trace_ring *ring_new(void)
+{
+	struct trace_ring *r = calloc(1, sizeof(*r));
+
+	if (!r)
+		return NULL;
+	r->tid = syscall(SYS_gettid);
+	r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+					    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return r;
+}
+
+void trace_emit(enum trace_id id, enum trace_phase phase,
+		int64_t arg0, int64_t arg1)
+{
+	struct trace_ring *r = ring;
+	struct trace_record *rec;
+	struct timespec ts;
+
+	if (!r) {
+		r = ring = ring_new();
+		if (!r)
+			return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	rec = &r->rec[r->head & (TRACE_RING_RECORDS - 1)];
+	rec->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	rec->id = id;
+	rec->phase = phase;
+	rec->arg[0] = arg0;
+	rec->arg[1] = arg1;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Categories from a comma separated list of their names, or "all".
+ * Unknown names are ignored.
+ */
+unsigned int trace_parse_mask(const char *spec)
+{
+	unsigned int mask = 0, i;
+	size_t len;
+
+	while (*spec) {
+		len = strcspn(spec, ",");
+		if (len == 3 && !strncmp(spec, "all", 3))
+			mask |= TRACE_CAT_ALL;
+		for (i = 0; i < sizeof(categories) / sizeof(*categories); i++)
+			if (strlen(categories[i]) == len &&
+			    !strncmp(spec, categories[i], len))
+				mask |= 1 << i;
+		spec += len;
+		if (*spec)
+			spec++;
+	}
+	return mask;
+}
+
+/* Only uses async signal safe calls, for the crash handler */
+static int dump_to(const char *path)
+{
+	struct trace_dump_header h = {
+		.magic = TRACE_DUMP_MAGIC,
+		.version = TRACE_DUMP_VERSION,
+		.record_size = sizeof(struct trace_record),
+	};
+	struct trace_dump_thread t;
+	struct trace_ring *r, *first;
+	uint64_t head, n, start, part;
+	int fd, ok = 1;
+
+	/* Rings are only ever added in front of first */
+	first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (r = first; r; r = r->next)
+		h.threads++;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	ok &= write(fd, &h, sizeof(h)) == sizeof(h);
+
+	for (r = first; r; r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		n = head < TRACE_RING_RECORDS ? head : TRACE_RING_RECORDS;
+		t.tid = r->tid;
+		t.records = n;
+		ok &= write(fd, &t, sizeof(t)) == sizeof(t);
+
+		/* Oldest first: from the wrap point to the end, then the rest */
+		start = (head - n) & (TRACE_RING_RECORDS - 1);
+		part = TRACE_RING_RECORDS - start < n ?
+		       TRACE_RING_RECORDS - start : n;
+		ok &= write(fd, r->rec + start, part * sizeof(*r->rec)) ==
+		      (ssize_t)(part * sizeof(*r->rec));
+		if (n > part)
+			ok &= write(fd, r->rec, (n - part) * sizeof(*r->rec)) ==
+			      (ssize_t)((n - part) * sizeof(*r->rec));
+	}
+	close(fd);
+	return ok ? 0 : -1;
+}
+
+/* Write the rings to path, or to the one given to trace_start() */
+int trace_dump(const char *path)
+{
+	if (!path)
+		path = dump_path;
+	return *path ? dump_to(path) : -1;
+}
+
+static const int crash_signals[] = {
+	SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT
+};
+/* What the host had installed for them, chained to after the dump */
+static struct sigaction crash_prev[sizeof(crash_signals) /
+				   sizeof(*crash_signals)];
+
+static void trace_crash(int sig, siginfo_t *info, void *ctx)
+{
+	struct sigaction *prev = NULL;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(crash_signals) / sizeof(*crash_signals); i++)
+		if (crash_signals[i] == sig)
+			prev = &crash_prev[i];
+	if (!prev)
+		return;
+
+	dump_to(dump_path);
+	/* Only dump once, and let the previous handler have the signal */
+	sigaction(sig, prev, NULL);
+	if (prev->sa_flags & SA_SIGINFO)
+		prev->sa_sigaction(sig, info, ctx);
+	else if (prev->sa_handler == SIG_DFL)
+		raise(sig);	/* blocked until we return */
+	else if (prev->sa_handler != SIG_IGN)
+		prev->sa_handler(sig);
+}
+
+/*
+ * Start tracing the categories in mask. The rings are dumped to path
+ * when the process crashes, before the handlers that were installed
+ * for that get the signal, and by trace_dump(NULL).
+ */
+int trace_start(unsigned int mask, const char *path)
+{
+	struct sigaction sa;
+	unsigned int i;
+
+	if (strlen(path) >= sizeof(dump_path))
+		return -1;
+	strcpy(dump_path, path);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = trace_crash;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < sizeof(crash_signals) / sizeof(*crash_signals); i++)
+		sigaction(crash_signals[i], &sa, &crash_prev[i]);
+
+	__atomic_store_n(&trace_mask, mask, __ATOMIC_RELAXED);
+	return 0;
+}
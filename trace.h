@@ -0,0 +1,104 @@
+/*
+ * Low overhead tracing.
+ *
+ * Every thread that traces gets a ring of fixed size binary records of
+ * its own, written without locks or system calls; the oldest records are
+ * overwritten. Events are declared in trace-events.h with the category
+ * they belong to and a level: those above TRACE_LEVEL are compiled out,
+ * the others cost a load and a branch while their category is not in
+ * trace_mask.
+ *
+ * trace_dump() writes all rings to a file, on demand, and trace_start()
+ * has it done on a crash too. tools/spotify-trace-export.c turns the dump
+ * into Chrome's trace format, so the delivery, output and main loop
+ * threads can be seen on one timeline.
+ */
+#ifndef _SPOTIFY_TRACE_H_
+#define _SPOTIFY_TRACE_H_
+
+#include <stdint.h>
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL		2
+#endif
+
+#define TRACE_RING_RECORDS	8192	/* per thread, a power of two */
+#define TRACE_DUMP_MAGIC	0x52545053	/* "SPTR" */
+#define TRACE_DUMP_VERSION	1
+
+enum trace_category {
+	TRACE_CAT_MAIN		= 0x1,
+	TRACE_CAT_DELIVERY	= 0x2,
+	TRACE_CAT_OUTPUT	= 0x4,
+	TRACE_CAT_PLAYER	= 0x8,
+	TRACE_CAT_ALL		= 0xf
+};
+
+enum trace_id {
+#define TRACE_EVENT(id, level, cat, name, arg0, arg1) TRACE_##id,
+#include "trace-events.h"
+#undef TRACE_EVENT
+	TRACE_EVENTS
+};
+
+/* Compile time level and category of each event */
+enum {
+#define TRACE_EVENT(id, level, cat, name, arg0, arg1) \
+	TRACE_LEVEL_##id = level, TRACE_CAT_OF_##id = TRACE_CAT_##cat,
+#include "trace-events.h"
+#undef TRACE_EVENT
+};
+
+enum trace_phase {
+	TRACE_INSTANT	= 'i',
+	TRACE_BEGIN	= 'B',
+	TRACE_END	= 'E'
+};
+
+struct trace_record {
+	uint64_t ns;			/* CLOCK_MONOTONIC */
+	uint16_t id;
+	uint8_t phase;
+	uint8_t pad[5];
+	int64_t arg[2];
+};
+
+/*
+ * A dump is this header, then for each thread its tid, its record count
+ * and that many records, oldest first.
+ */
+struct trace_dump_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t threads;
+};
+
+struct trace_dump_thread {
+	uint32_t tid;
+	uint32_t records;
+};
+
+extern unsigned int trace_mask;
+
+extern void trace_emit(enum trace_id id, enum trace_phase phase,
+		       int64_t arg0, int64_t arg1);
+extern unsigned int trace_parse_mask(const char *spec);
+extern int trace_start(unsigned int mask, const char *path);
+extern int trace_dump(const char *path);
+
+#define TRACE_ON(id) \
+	(TRACE_LEVEL_##id <= TRACE_LEVEL && \
+	 (__atomic_load_n(&trace_mask, __ATOMIC_RELAXED) & TRACE_CAT_OF_##id))
+
+#define trace(id, a, b) do { \
+	if (TRACE_ON(id)) trace_emit(TRACE_##id, TRACE_INSTANT, a, b); \
+} while (0)
+#define trace_begin(id, a, b) do { \
+	if (TRACE_ON(id)) trace_emit(TRACE_##id, TRACE_BEGIN, a, b); \
+} while (0)
+#define trace_end(id, a, b) do { \
+	if (TRACE_ON(id)) trace_emit(TRACE_##id, TRACE_END, a, b); \
+} while (0)
+
+#endif /* _SPOTIFY_TRACE_H_ */
@@ -0,0 +1,172 @@
+/**
+ * Persistent per-track index, keyed by track URI.
+ *
+ * The file is an append-only log of "<uri> key=value..." lines where the
+ * last line for a URI wins, so storing a result is a single append. It
+ * is rewritten without the superseded lines when it is opened.
+ */
+#include <glib.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "track-index.h"
+#include "log.h"
+
+static GHashTable *g_index;
+static char *g_index_path;
+static pthread_mutex_t g_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+track_info_init (struct track_info *info)
+{
+  info->loudness = NAN;
+  info->lead_ms = -1;
+  info->tail_ms = -1;
+}
+
+static void
+track_index_parse (char *line)
+{
+  char **fields = g_strsplit (g_strstrip (line), " ", 0);
+  struct track_info *info;
+  int i;
+
+  if (!fields[0] || !fields[0][0])
+    {
+      g_strfreev (fields);
+      return;
+    }
+
+  info = g_new0 (struct track_info, 1);
+  track_info_init (info);
+
+  for (i = 1; fields[i]; i++)
+    {
+      if (g_str_has_prefix (fields[i], "loudness="))
+        info->loudness = g_ascii_strtod (fields[i] + 9, NULL);
+      else if (g_str_has_prefix (fields[i], "lead="))
+        info->lead_ms = atoi (fields[i] + 5);
+      else if (g_str_has_prefix (fields[i], "tail="))
+        info->tail_ms = atoi (fields[i] + 5);
+    }
+
+  g_hash_table_replace (g_index, g_strdup (fields[0]), info);
+  g_strfreev (fields);
+}
+
+static void
+track_index_write_line (FILE *f, const char *uri,
+                        const struct track_info *info)
+{
+  gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+  fprintf (f, "%s", uri);
+  if (!isnan (info->loudness))
+    fprintf (f, " loudness=%s",
+             g_ascii_formatd (buf, sizeof (buf), "%.2f", info->loudness));
+  if (info->lead_ms >= 0)
+    fprintf (f, " lead=%d", info->lead_ms);
+  if (info->tail_ms >= 0)
+    fprintf (f, " tail=%d", info->tail_ms);
+  fprintf (f, "\n");
+}
+
+static void
+track_index_write_entry (gpointer key, gpointer value, gpointer data)
+{
+  track_index_write_line (data, key, value);
+}
+
+void
+track_index_open (const char *path)
+{
+  gchar *contents, **lines, *tmp;
+  unsigned int nlines = 0;
+  FILE *f;
+  int i;
+
+  pthread_mutex_lock (&g_index_mutex);
+
+  g_index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_index_path = g_strdup (path);
+
+  if (g_file_get_contents (path, &contents, NULL, NULL))
+    {
+      lines = g_strsplit (contents, "\n", 0);
+      for (i = 0; lines[i]; i++)
+        {
+          if (lines[i][0])
+            nlines++;
+          track_index_parse (lines[i]);
+        }
+      g_strfreev (lines);
+      g_free (contents);
+    }
+
+  /* Compact the log once it carries more dead lines than live ones */
+  if (nlines > 2 * g_hash_table_size (g_index))
+    {
+      tmp = g_strdup_printf ("%s.tmp", path);
+      if ((f = fopen (tmp, "w")))
+        {
+          g_hash_table_foreach (g_index, track_index_write_entry, f);
+          if (!fclose (f))
+            rename (tmp, path);
+        }
+      g_free (tmp);
+    }
+
+  dbg (1, "track index %s: %u tracks\n", path, g_hash_table_size (g_index));
+  pthread_mutex_unlock (&g_index_mutex);
+}
+
+/**
+ * Copy the entry for uri to info, or mark everything in info unknown if
+ * there is none.
+ *
+ * @return 0 if the track is known, -1 otherwise
+ */
+int
+track_index_lookup (const char *uri, struct track_info *info)
+{
+  struct track_info *found = NULL;
+
+  pthread_mutex_lock (&g_index_mutex);
+  if (g_index)
+    found = g_hash_table_lookup (g_index, uri);
+  if (found)
+    *info = *found;
+  else
+    track_info_init (info);
+  pthread_mutex_unlock (&g_index_mutex);
+
+  return found ? 0 : -1;
+}
+
+void
+track_index_store (const char *uri, const struct track_info *info)
+{
+  struct track_info *copy;
+  FILE *f;
+
+  pthread_mutex_lock (&g_index_mutex);
+  if (!g_index)
+    {
+      pthread_mutex_unlock (&g_index_mutex);
+      return;
+    }
+
+  copy = g_new (struct track_info, 1);
+  *copy = *info;
+  g_hash_table_replace (g_index, g_strdup (uri), copy);
+
+  if ((f = fopen (g_index_path, "a")))
+    {
+      track_index_write_line (f, uri, info);
+      fclose (f);
+    }
+  pthread_mutex_unlock (&g_index_mutex);
+}
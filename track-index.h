@@ -0,0 +1,20 @@
+#ifndef _SPOTIFY_TRACK_INDEX_H_
+#define _SPOTIFY_TRACK_INDEX_H_
+
+/**
+ * What we learned about a track the last time it played. Fields that
+ * haven't been measured yet are NAN or -1.
+ */
+struct track_info
+{
+  float loudness;		/* gated loudness, dB relative to full scale */
+  int lead_ms;			/* silence skipped at the start */
+  int tail_ms;			/* silence at the end */
+};
+
+void track_info_init (struct track_info *info);
+void track_index_open (const char *path);
+int track_index_lookup (const char *uri, struct track_info *info);
+void track_index_store (const char *uri, const struct track_info *info);
+
+#endif /* _SPOTIFY_TRACK_INDEX_H_ */
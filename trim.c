@@ -0,0 +1,233 @@
+/*
+ * Silence trimming at track boundaries.
+ *
+ * Leading silence is dropped as the player delivers it, up to the first
+ * sample above the threshold, keeping TRIM_FADE_MS in front of it as a
+ * fade-in. Trailing silence can only be known once the track is over,
+ * so the first play trims what of it is still queued and measures how
+ * long it was; both lengths go to the track index, and later plays skip
+ * the known lead without scanning and end the track early.
+ */
+
+#include "audio.h"
+#include "dsp.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TRIM_FADE_MS		10
+/* Give up looking for the start of the music after this */
+#define TRIM_MAX_LEAD_MS	30000
+
+static int64_t track_frame(const audio_fifo_t *af, int rate)
+{
+	return (int64_t)af->pos_ms * rate / 1000 + af->pos_frames;
+}
+
+/*
+ * Set up trimming for the track about to be delivered. threshold is the
+ * peak at or below which audio counts as silence, 0 disables trimming.
+ * lead_ms is the known leading silence or -1 to scan for it, end_ms the
+ * track time to stop at or 0 to play to the end.
+ */
+void audio_trim_start(audio_fifo_t *af, int threshold, int lead_ms, int end_ms)
+{
+	audio_trim_t *t = &af->trim;
+
+	pthread_mutex_lock(&af->mutex);
+	memset(t, 0, sizeof(*t));
+	t->threshold = threshold;
+	if (threshold) {
+		t->lead = 1;
+		t->lead_ms = lead_ms;
+		t->end_ms = end_ms;
+	}
+	pthread_mutex_unlock(&af->mutex);
+}
+
+/* A seek invalidates the lead: what plays next is not the track start */
+void audio_trim_cancel(audio_fifo_t *af)
+{
+	if (af->trim.lead)
+		af->trim.lead_frames = -1;
+	af->trim.lead = 0;
+	af->trim.fadein = 0;
+}
+
+/*
+ * Look at delivered frames before they are queued. Leading silence is
+ * dropped from the front of *frames, and *n is cut short at the end
+ * point. Returns how many frames were dropped, which count as consumed.
+ */
+int audio_trim_input(audio_fifo_t *af, int rate, int channels,
+                     const int16_t **frames, int *n)
+{
+	audio_trim_t *t = &af->trim;
+	int64_t pos, end;
+	int drop = 0, fade = rate * TRIM_FADE_MS / 1000;
+
+	if (!t->threshold || t->ended)
+		goto end;
+
+	if (t->lead) {
+		if (t->lead_ms >= 0) {
+			/* Known from an earlier play */
+			drop = (int64_t)t->lead_ms * rate / 1000 - t->lead_frames;
+			if (drop > *n)
+				drop = *n;
+			else
+				t->lead = 0;
+		} else {
+			drop = dsp_first_loud_s16(*frames, *n * channels,
+			                          t->threshold) / channels;
+			if (drop < *n) {
+				t->lead = 0;
+				drop = drop > fade ? drop - fade : 0;
+			}
+		}
+		/* A crossfade into this track fades it in already */
+		if (!t->lead && t->lead_frames + drop && !af->xfade_len)
+			t->fadein = t->fadein_len = fade;
+		if (t->lead_frames + drop >= (int64_t)rate * TRIM_MAX_LEAD_MS / 1000)
+			t->lead = 0;
+		t->lead_frames += drop;
+		t->rate = rate;
+		af->pos_frames += drop;
+		*frames += drop * channels;
+		*n -= drop;
+	}
+
+end:
+	if (t->threshold && t->end_ms) {
+		pos = track_frame(af, rate);
+		end = (int64_t)t->end_ms * rate / 1000;
+		if (pos >= end || t->ended) {
+			/* Past the end point: swallow the rest of the track */
+			t->ended = 1;
+			if (!t->early)
+				t->early = 1;
+			af->pos_frames += *n;
+			drop += *n;
+			*n = 0;
+		} else if (pos + *n > end) {
+			*n = end - pos;
+		}
+	}
+	return drop;
+}
+
+/*
+ * Called on every chunk as it is queued: fades in after a trimmed lead,
+ * fades out into the end point and keeps count of the trailing silence.
+ */
+void audio_trim_queued(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	audio_trim_t *t = &af->trim;
+	int n = afd->nsamples, ch = afd->channels, len, fade, last;
+	int64_t pos;
+
+	if (!t->threshold)
+		return;
+
+	if (t->fadein) {
+		len = t->fadein < n ? t->fadein : n;
+		dsp_ramp_s16(afd->samples, len, ch,
+		             (int64_t)DSP_UNITY * (t->fadein_len - t->fadein) / t->fadein_len,
+		             (int64_t)DSP_UNITY * (t->fadein_len - t->fadein + len) / t->fadein_len);
+		t->fadein -= len;
+	}
+
+	/* audio_trim_input() cut this chunk at the end point */
+	pos = track_frame(af, afd->rate);
+	if (t->end_ms && pos + n >= (int64_t)t->end_ms * afd->rate / 1000) {
+		fade = afd->rate * TRIM_FADE_MS / 1000;
+		len = fade < n ? fade : n;
+		dsp_ramp_s16(afd->samples + (n - len) * ch, len, ch, DSP_UNITY, 0);
+		t->ended = 1;
+		if (!t->early)
+			t->early = 1;
+	}
+
+	last = dsp_last_loud_s16(afd->samples, n * ch, t->threshold);
+	if (last)
+		t->tail_frames = n - (last + ch - 1) / ch;
+	else
+		t->tail_frames += n;
+	t->rate = afd->rate;
+}
+
+/*
+ * Called with af->mutex held once the player has delivered the whole
+ * track: drop the trailing silence that is still queued, leaving a short
+ * fade-out. Returns the length of the trailing silence in ms, -1 if it
+ * wasn't measured.
+ */
+int audio_trim_tail(audio_fifo_t *af)
+{
+	audio_trim_t *t = &af->trim;
+	audio_fifo_data_t *afd;
+	int drop, fade, len;
+
+	if (!t->threshold || t->early || !t->rate)
+		return -1;
+
+	fade = t->rate * TRIM_FADE_MS / 1000;
+	drop = t->tail_frames - fade;
+	if (drop > af->qlen)
+		drop = af->qlen;
+
+	while (drop > 0 && (afd = TAILQ_LAST(&af->q, audio_fifo_q))) {
+		/* The output thread may be about to mix the next track in here */
+		if (afd == af->xfade_chunk)
+			break;
+		len = drop < afd->nsamples ? drop : afd->nsamples;
+		afd->nsamples -= len;
+		af->qlen -= len;
+		drop -= len;
+		if (!afd->nsamples) {
+			TAILQ_REMOVE(&af->q, afd, link);
+			free(afd);
+		}
+	}
+
+	if ((afd = TAILQ_LAST(&af->q, audio_fifo_q)) && t->tail_frames > fade) {
+		len = fade < afd->nsamples ? fade : afd->nsamples;
+		dsp_ramp_s16(afd->samples + (afd->nsamples - len) * afd->channels,
+		             len, afd->channels, DSP_UNITY, 0);
+	}
+
+	return (int64_t)t->tail_frames * 1000 / t->rate;
+}
+
+/*
+ * The leading silence measured on this play, in ms, or -1 if there was
+ * no complete scan from the start of the track.
+ */
+int audio_trim_lead_ms(audio_fifo_t *af)
+{
+	audio_trim_t *t = &af->trim;
+	int ms = -1;
+
+	pthread_mutex_lock(&af->mutex);
+	if (t->threshold && t->lead_ms < 0 && !t->lead && t->lead_frames >= 0 &&
+	    t->rate)
+		ms = (int64_t)t->lead_frames * 1000 / t->rate;
+	pthread_mutex_unlock(&af->mutex);
+	return ms;
+}
+
+/*
+ * Returns 1, once, when delivery has reached the end point of a track
+ * trimmed from the track index. The player should then move on as if
+ * the track had ended.
+ */
+int audio_trim_ended(audio_fifo_t *af)
+{
+	int ended;
+
+	pthread_mutex_lock(&af->mutex);
+	ended = af->trim.early == 1;
+	if (ended)
+		af->trim.early = 2;
+	pthread_mutex_unlock(&af->mutex);
+	return ended;
+}
@@ -0,0 +1,161 @@
+/*
+ * Track boundaries and crossfading.
+ *
+ * When the player has delivered the last frame of a track, whatever is
+ * still queued is that track's tail. With crossfading on, the last
+ * xfade_ms of the tail are faded out in place and the first frames of
+ * the next track are faded in and added on top of them as they are
+ * delivered, so the overlap costs no extra buffering and stays exact
+ * to the frame. If the output thread gets to the mix point before the
+ * next track delivers, the overlap just gets shorter; the fade-in still
+ * runs its full length.
+ */
+
+#include "audio.h"
+#include "dsp.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Below this there is no point in crossfading */
+#define XFADE_MIN_MS	20
+
+static int xfade_gain(const audio_fifo_t *af, int pos)
+{
+	return (int64_t)DSP_UNITY * pos / af->xfade_len;
+}
+
+void audio_xfade_cancel(audio_fifo_t *af)
+{
+	af->xfade_chunk = NULL;
+	af->xfade_off = 0;
+	af->xfade_len = 0;
+	af->xfade_pos = 0;
+}
+
+/*
+ * Called once the player has delivered the last frame of the current
+ * track. Nothing queued is dropped: the tail plays out and the next
+ * track follows without a gap, overlapped by xfade_ms if non-zero.
+ */
+void audio_fifo_boundary(audio_fifo_t *af, int xfade_ms)
+{
+	audio_fifo_data_t *afd;
+	int n, skip, off, len, done;
+
+	pthread_mutex_lock(&af->mutex);
+
+	audio_xfade_cancel(af);
+
+	/* The next track starts where the queued tail ends */
+	af->track++;
+	af->pos_ms = 0;
+	af->pos_frames = 0;
+
+	n = (int64_t)xfade_ms * af->rate / 1000;
+	if (n > af->qlen)
+		n = af->qlen;
+
+	if (xfade_ms > 0 && n >= af->rate * XFADE_MIN_MS / 1000) {
+		/* Find the first frame of the last n and fade out from there */
+		skip = af->qlen - n;
+		done = 0;
+		TAILQ_FOREACH(afd, &af->q, link) {
+			if (skip >= afd->nsamples) {
+				skip -= afd->nsamples;
+				continue;
+			}
+			off = skip;
+			skip = 0;
+			if (!af->xfade_chunk) {
+				af->xfade_chunk = afd;
+				af->xfade_off = off;
+			}
+			len = afd->nsamples - off;
+			dsp_ramp_s16(afd->samples + off * afd->channels, len,
+			             afd->channels,
+			             DSP_UNITY - (int64_t)DSP_UNITY * done / n,
+			             DSP_UNITY - (int64_t)DSP_UNITY * (done + len) / n);
+			done += len;
+		}
+		af->xfade_len = n;
+		af->xfade_pos = 0;
+		af->stats.crossfades++;
+	}
+	/* Its start is mixed into the tail, where the replay ring can't tell */
+	af->replay.next_complete = !af->xfade_len;
+
+	pthread_mutex_unlock(&af->mutex);
+}
+
+/*
+ * Add the first frames of the next track on top of the faded-out tail.
+ * Returns how many of the n frames were consumed; the caller queues the
+ * rest as usual, after audio_xfade_fadein.
+ */
+int audio_xfade_mix(audio_fifo_t *af, int rate, int channels,
+                    const int16_t *frames, int n)
+{
+	audio_fifo_data_t *afd = af->xfade_chunk;
+	int16_t scratch[1024];
+	int done = 0, len;
+
+	if (!afd)
+		return 0;
+
+	if (afd->rate != rate || afd->channels != channels) {
+		/* Can't overlap a format change, play it back to back */
+		audio_xfade_cancel(af);
+		return 0;
+	}
+
+	while (afd && done < n) {
+		len = afd->nsamples - af->xfade_off;
+		if (len > n - done)
+			len = n - done;
+		if (len > (int)(sizeof(scratch) / sizeof(scratch[0])) / channels)
+			len = (sizeof(scratch) / sizeof(scratch[0])) / channels;
+		if (len > af->xfade_len - af->xfade_pos)
+			len = af->xfade_len - af->xfade_pos;
+		if (len <= 0)
+			break;
+
+		memcpy(scratch, frames + done * channels, len * channels * sizeof(int16_t));
+		dsp_ramp_s16(scratch, len, channels, xfade_gain(af, af->xfade_pos),
+		             xfade_gain(af, af->xfade_pos + len));
+		dsp_mix_s16(afd->samples + af->xfade_off * channels, scratch,
+		            len * channels);
+
+		done += len;
+		af->xfade_pos += len;
+		af->xfade_off += len;
+		if (af->xfade_off == afd->nsamples) {
+			afd = TAILQ_NEXT(afd, link);
+			af->xfade_off = 0;
+		}
+	}
+
+	af->xfade_chunk = af->xfade_pos < af->xfade_len ? afd : NULL;
+	return done;
+}
+
+/*
+ * Continue the fade-in on a chunk of the next track that is queued
+ * after the tail rather than mixed into it.
+ */
+void audio_xfade_fadein(audio_fifo_t *af, audio_fifo_data_t *afd)
+{
+	int len;
+
+	if (af->xfade_pos >= af->xfade_len)
+		return;
+
+	len = af->xfade_len - af->xfade_pos;
+	if (len > afd->nsamples)
+		len = afd->nsamples;
+	dsp_ramp_s16(afd->samples, len, afd->channels,
+	             xfade_gain(af, af->xfade_pos),
+	             xfade_gain(af, af->xfade_pos + len));
+	af->xfade_pos += len;
+	if (af->xfade_pos >= af->xfade_len)
+		audio_xfade_cancel(af);
+}